@@ -0,0 +1,286 @@
+####################################################################################################################################
+# WATCH MODULE
+#
+# Keeps a sorted list of the csv log files in the log directory and waits for the log to change.  Where Linux::Inotify2 is
+# available the directory is read once and the list is kept up to date from inotify events, and waiting blocks until a log file
+# is written, created or renamed into the directory.  Elsewhere the directory is read again after each wait and waiting sleeps
+# for a short interval.
+####################################################################################################################################
+package PgAudit::Watch;
+
+use strict;
+use warnings FATAL => qw(all);
+use Carp qw(confess);
+
+use Exporter qw(import);
+    our @EXPORT = qw();
+
+use PgAudit::Wait;
+
+####################################################################################################################################
+# Boolean constants
+####################################################################################################################################
+use constant
+{
+    true    => 1,
+    false   => 0
+};
+
+####################################################################################################################################
+# Wait constants
+####################################################################################################################################
+use constant
+{
+    WATCH_POLL_TIME     => .1,      # Sleep between directory reads when polling
+    WATCH_EVENT_TIME    => 1        # Longest wait for an inotify event before checking again anyway
+};
+
+####################################################################################################################################
+# watchLogFile
+#
+# Is the file a csv log file (plain or compressed)?
+####################################################################################################################################
+sub watchLogFile
+{
+    my $strFile = shift;
+
+    return $strFile =~ /.*\.csv(\.(gz|lz4|zst))?$/i;
+}
+
+push @EXPORT, qw(watchLogFile);
+
+####################################################################################################################################
+# watchLogName
+#
+# Return the name of the log file without its compression extension.  A log that is compressed after it was read (or partly read)
+# keeps its place in the log, so it is not read again as a new file.
+####################################################################################################################################
+sub watchLogName
+{
+    my $strFile = shift;
+
+    $strFile =~ s/\.(gz|lz4|zst)$//i;
+
+    return $strFile;
+}
+
+push @EXPORT, qw(watchLogName);
+
+####################################################################################################################################
+# watchCompare
+#
+# Compare log files by log name, then by file name when the same log is both plain and compressed.
+####################################################################################################################################
+sub watchCompare
+{
+    my $strFile1 = shift;
+    my $strFile2 = shift;
+
+    return watchLogName($strFile1) cmp watchLogName($strFile2) || $strFile1 cmp $strFile2;
+}
+
+####################################################################################################################################
+# watchSort
+####################################################################################################################################
+sub watchSort
+{
+    return sort {watchCompare($a, $b)} @_;
+}
+
+push @EXPORT, qw(watchSort);
+
+####################################################################################################################################
+# watchSearch
+#
+# Return the index of the first file in the sorted list that is a later log than the file, or the index of the file itself (or where
+# it belongs) if equal is requested.
+####################################################################################################################################
+sub watchSearch
+{
+    my $stryFileList = shift;
+    my $strFile = shift;
+    my $bEqual = shift;
+
+    my $iLow = 0;
+    my $iHigh = @{$stryFileList};
+
+    while ($iLow < $iHigh)
+    {
+        my $iMid = int(($iLow + $iHigh) / 2);
+
+        if ($bEqual ? watchCompare($$stryFileList[$iMid], $strFile) < 0 :
+                      watchLogName($$stryFileList[$iMid]) le watchLogName($strFile))
+        {
+            $iLow = $iMid + 1;
+        }
+        else
+        {
+            $iHigh = $iMid;
+        }
+    }
+
+    return $iLow;
+}
+
+####################################################################################################################################
+# watchScan
+#
+# Read the directory into the sorted file list.
+####################################################################################################################################
+sub watchScan
+{
+    my $oWatch = shift;
+
+    my $hPath;
+
+    if (!opendir($hPath, $$oWatch{path}))
+    {
+        confess "unable to open database log directory";
+    }
+
+    $$oWatch{file_list} = [watchSort(grep {watchLogFile($_)} readdir($hPath))];
+    $$oWatch{stale} = false;
+
+    closedir($hPath);
+}
+
+####################################################################################################################################
+# watchInit
+####################################################################################################################################
+sub watchInit
+{
+    my $strPath = shift;
+
+    my $oWatch = {path => $strPath};
+
+    # Use inotify when it is available.  The watch is added before the directory is read so no file can be missed in between.
+    if (eval {require Linux::Inotify2; 1})
+    {
+        my $oInotify = Linux::Inotify2->new();
+
+        if (defined($oInotify) &&
+            $oInotify->watch($strPath, Linux::Inotify2::IN_MODIFY() | Linux::Inotify2::IN_CREATE() |
+                                       Linux::Inotify2::IN_MOVED_TO() | Linux::Inotify2::IN_MOVED_FROM() |
+                                       Linux::Inotify2::IN_DELETE()))
+        {
+            $oInotify->blocking(0);
+            $$oWatch{inotify} = $oInotify;
+        }
+    }
+
+    watchScan($oWatch);
+
+    return $oWatch;
+}
+
+push @EXPORT, qw(watchInit);
+
+####################################################################################################################################
+# watchEvent
+#
+# Apply pending inotify events to the file list.
+####################################################################################################################################
+sub watchEvent
+{
+    my $oWatch = shift;
+
+    foreach my $oEvent ($$oWatch{inotify}->read())
+    {
+        # Events were lost so the directory must be read again
+        if ($oEvent->IN_Q_OVERFLOW())
+        {
+            $$oWatch{stale} = true;
+            next;
+        }
+
+        my $strFile = $oEvent->name();
+
+        next if (!defined($strFile) || !watchLogFile($strFile));
+
+        my $iIndex = watchSearch($$oWatch{file_list}, $strFile, true);
+        my $bFound = $iIndex < @{$$oWatch{file_list}} && $$oWatch{file_list}[$iIndex] eq $strFile;
+
+        # Add new files in order
+        if ($oEvent->IN_CREATE() || $oEvent->IN_MOVED_TO())
+        {
+            splice(@{$$oWatch{file_list}}, $iIndex, 0, $strFile)
+                if (!$bFound);
+        }
+        # Remove files that are gone
+        elsif ($oEvent->IN_DELETE() || $oEvent->IN_MOVED_FROM())
+        {
+            splice(@{$$oWatch{file_list}}, $iIndex, 1)
+                if ($bFound);
+        }
+    }
+}
+
+####################################################################################################################################
+# watchNext
+#
+# Return the first log file alphabetically greater than the last log file, or the first log file when there is no last log file.
+# The last log file compressed since it was read is not greater.
+####################################################################################################################################
+sub watchNext
+{
+    my $oWatch = shift;
+    my $strLastLogFile = shift;
+
+    # Bring the file list up to date
+    if (defined($$oWatch{inotify}))
+    {
+        watchEvent($oWatch);
+    }
+
+    if ($$oWatch{stale})
+    {
+        watchScan($oWatch);
+    }
+
+    # Make sure there are some log files
+    if (@{$$oWatch{file_list}} == 0)
+    {
+        confess "no csv log files found";
+    }
+
+    # If there is no last log file return the first log in the list
+    if (!defined($strLastLogFile))
+    {
+        return $$oWatch{file_list}[0];
+    }
+
+    # Else return the first log file alphabetically greater than the last log, if any
+    my $iIndex = watchSearch($$oWatch{file_list}, $strLastLogFile, false);
+
+    return $iIndex < @{$$oWatch{file_list}} ? $$oWatch{file_list}[$iIndex] : undef;
+}
+
+push @EXPORT, qw(watchNext);
+
+####################################################################################################################################
+# watchWait
+#
+# Wait for the log to change.  Returns early with inotify as soon as a log file is written or the directory changes.
+####################################################################################################################################
+sub watchWait
+{
+    my $oWatch = shift;
+
+    # Without inotify sleep and read the directory again next time
+    if (!defined($$oWatch{inotify}))
+    {
+        waitHiRes(WATCH_POLL_TIME);
+        $$oWatch{stale} = true;
+
+        return;
+    }
+
+    my $strMask = '';
+    vec($strMask, $$oWatch{inotify}->fileno(), 1) = 1;
+
+    select($strMask, undef, undef, WATCH_EVENT_TIME);
+}
+
+push @EXPORT, qw(watchWait);
+
+1;
@@ -57,6 +57,7 @@ create table pgaudit.session
     process_id int not null,
     session_start_time timestamp with time zone not null,
     user_name text not null,
+    database_name text not null,
     application_name text,
     connection_from text,
     state text not null
@@ -66,6 +67,10 @@ create table pgaudit.session
         primary key (session_id)
 );
 
+-- Find the sessions of a database when the log of several databases is loaded into one (see pgaudit_analyze --audit-database)
+create index session_databasename_idx
+    on pgaudit.session (database_name);
+
 grant select,
       insert,
       update (application_name)
@@ -141,6 +146,10 @@ create table pgaudit.log_event
         primary key (session_id, session_line_num)
 );
 
+-- Find the events of a virtual transaction when attributing an error to its statements
+create index logevent_sessionid_virtualtransactionid_idx
+    on pgaudit.log_event (session_id, virtual_transaction_id);
+
 grant select,
       insert
    on pgaudit.log_event
@@ -225,12 +234,53 @@ grant select,
    on pgaudit.audit_substatement_detail
    to pgaudit_etl;
 
+-- Create checkpoint table to record how far the log has been loaded so pgaudit_analyze can resume there after a restart
+create table pgaudit.checkpoint
+(
+    worker int not null,
+    log_file text not null,
+    log_offset bigint not null,
+    update_time timestamp with time zone not null default current_timestamp,
+
+    constraint checkpoint_pk
+        primary key (worker)
+);
+
+grant select,
+      insert,
+      update,
+      delete
+   on pgaudit.checkpoint
+   to pgaudit_etl;
+
+-- Create backfill table to record how far each worker of pgaudit_analyze --backfill has loaded each log file
+create table pgaudit.backfill
+(
+    log_file text not null,
+    worker int not null,
+    workers int not null,
+    log_offset bigint not null,
+    complete boolean not null,
+    update_time timestamp with time zone not null default current_timestamp,
+
+    constraint backfill_pk
+        primary key (log_file, worker)
+);
+
+grant select,
+      insert,
+      update,
+      delete
+   on pgaudit.backfill
+   to pgaudit_etl;
+
 -- Create vw_audit_event view to allow easy access to the pgaudit log entries
 create view pgaudit.vw_audit_event as
 select session.session_id,
        log_event.session_line_num,
        log_event.log_time,
        session.user_name,
+       session.database_name,
        audit_statement.statement_id,
        audit_statement.state,
        audit_statement.error_session_line_num,
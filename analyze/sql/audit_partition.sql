@@ -0,0 +1,312 @@
+-- Convert the audit schema created by audit.sql to monthly partitions.  Run this as postgres after audit.sql with pgaudit_analyze
+-- stopped.  The rows already loaded become the legacy partition.
+--
+-- PostgreSQL 9.5 has no declarative partitioning, so the partitions are tables that inherit from the audit tables.  Each row is
+-- loaded by pgaudit_analyze directly into the partition of the month of its log time, which is created the first time it is
+-- needed by pgaudit.partition_create().  Old partitions are dropped with pgaudit_analyze --retain, which calls
+-- pgaudit.partition_retain().  pgaudit_analyze --backfill creates partitions without their secondary indexes and builds them at the
+-- end with pgaudit.partition_index().
+--
+-- The functions run as pgaudit_owner, so they set a search_path that the caller cannot add objects to and name the audit objects
+-- with their schema.
+
+-- Stop on error
+\set ON_ERROR_STOP on
+
+-- Make sure that errors are detected and not automatically rolled back
+\set ON_ERROR_ROLLBACK off
+
+-- Bring a schema created by an earlier audit.sql up to date first
+\ir audit_upgrade.sql
+
+-- Convert everything or nothing
+begin;
+
+-- Set session authorization so all schema objects are owned by pgaudit_owner
+set session authorization pgaudit_owner;
+
+-- The view is created again on the parent tables at the end
+drop view pgaudit.vw_audit_event;
+
+-- Foreign keys cannot reference the partitions through their parent, so they are dropped.  pgaudit_analyze loads the tables in an
+-- order that keeps them consistent.
+alter table pgaudit.audit_substatement_detail
+    drop constraint auditsubstatementdetail_sessionid_statementid_substatementid_fk,
+    drop constraint auditsubstatementdetail_sessionid_sessionlinenum_fk;
+
+alter table pgaudit.audit_substatement
+    drop constraint auditsubstatement_sessionid_statementid_fk;
+
+alter table pgaudit.audit_statement
+    drop constraint auditstatement_sessionid_fk,
+    drop constraint auditstatement_sessionid_sessionlinenum_fk;
+
+alter table pgaudit.log_event
+    drop constraint logevent_sessionid_fk;
+
+-- Use bigint keys, which are smaller and faster to compare than numeric
+alter table pgaudit.log_event
+    alter column session_line_num type bigint;
+
+alter table pgaudit.audit_statement
+    alter column statement_id type bigint,
+    alter column error_session_line_num type bigint;
+
+alter table pgaudit.audit_substatement
+    alter column statement_id type bigint,
+    alter column substatement_id type bigint;
+
+alter table pgaudit.audit_substatement_detail
+    alter column statement_id type bigint,
+    alter column substatement_id type bigint,
+    alter column session_line_num type bigint;
+
+-- Keep the rows already loaded as the legacy partition
+alter table pgaudit.log_event rename to log_event_legacy;
+alter table pgaudit.audit_statement rename to audit_statement_legacy;
+alter table pgaudit.audit_substatement rename to audit_substatement_legacy;
+alter table pgaudit.audit_substatement_detail rename to audit_substatement_detail_legacy;
+
+create index logevent_legacy_logtime_idx
+    on pgaudit.log_event_legacy using brin (log_time);
+
+-- Create the parent tables, which hold no rows themselves
+create table pgaudit.log_event
+    (like pgaudit.log_event_legacy including defaults including constraints);
+
+grant select
+   on pgaudit.log_event
+   to pgaudit_etl;
+
+create table pgaudit.audit_statement
+    (like pgaudit.audit_statement_legacy including defaults including constraints);
+
+grant select,
+      update (state, error_session_line_num)
+   on pgaudit.audit_statement
+   to pgaudit_etl;
+
+create table pgaudit.audit_substatement
+    (like pgaudit.audit_substatement_legacy including defaults including constraints);
+
+grant select
+   on pgaudit.audit_substatement
+   to pgaudit_etl;
+
+create table pgaudit.audit_substatement_detail
+    (like pgaudit.audit_substatement_detail_legacy including defaults including constraints);
+
+grant select
+   on pgaudit.audit_substatement_detail
+   to pgaudit_etl;
+
+alter table pgaudit.log_event_legacy inherit pgaudit.log_event;
+alter table pgaudit.audit_statement_legacy inherit pgaudit.audit_statement;
+alter table pgaudit.audit_substatement_legacy inherit pgaudit.audit_substatement;
+alter table pgaudit.audit_substatement_detail_legacy inherit pgaudit.audit_substatement_detail;
+
+-- Create partition table to track the partitions, which are named for the year and month they hold (e.g. log_event_201510)
+create table pgaudit.partition
+(
+    period text not null
+        constraint partition_period_ck check (period = 'legacy' or period ~ '^[0-9]{6}$'),
+    create_time timestamp with time zone not null default current_timestamp,
+    indexed boolean not null default true,
+
+    constraint partition_pk
+        primary key (period)
+);
+
+insert into pgaudit.partition (period)
+                       values ('legacy');
+
+grant select
+   on pgaudit.partition
+   to pgaudit_etl;
+
+-- Create partition_create() function to allow pgaudit_analyze to create the partitions of a month.  Only the keys are created when
+-- defer_index is set and the other indexes are left to partition_index().
+create or replace function pgaudit.partition_create
+(
+    period text,
+    defer_index boolean default false
+)
+    returns void as $$
+begin
+    -- Workers may need the same partition at the same time
+    perform pg_advisory_xact_lock(hashtext('pgaudit.partition'));
+
+    if exists
+    (
+        select true
+          from pgaudit.partition
+         where partition.period = partition_create.period
+    ) then
+        return;
+    end if;
+
+    -- The check constraint makes sure the period is safe to use in table names
+    insert into pgaudit.partition (period, indexed)
+                           values (partition_create.period, false);
+
+    execute format(
+        'create table pgaudit.%I (constraint %I primary key (session_id, session_line_num)) inherits (pgaudit.log_event)',
+        'log_event_' || period, 'logevent_' || period || '_pk');
+    execute format(
+        'create table pgaudit.%I (constraint %I primary key (session_id, statement_id)) inherits (pgaudit.audit_statement)',
+        'audit_statement_' || period, 'auditstatement_' || period || '_pk');
+
+    execute format(
+        'create table pgaudit.%I (constraint %I primary key (session_id, statement_id, substatement_id))' ||
+        ' inherits (pgaudit.audit_substatement)',
+        'audit_substatement_' || period, 'auditsubstatement_' || period || '_pk');
+
+    execute format(
+        'create table pgaudit.%I (constraint %I primary key (session_id, statement_id, substatement_id, session_line_num),' ||
+        ' constraint %I unique (session_id, session_line_num)) inherits (pgaudit.audit_substatement_detail)',
+        'audit_substatement_detail_' || period, 'auditsubstatementdetail_' || period || '_pk',
+        'auditsubstatementdetail_' || period || '_sessionid_sessionlinenum_unq');
+
+    -- Rows are loaded into the partitions directly and read through the parents
+    execute format(
+        'grant insert on pgaudit.%I, pgaudit.%I, pgaudit.%I, pgaudit.%I to pgaudit_etl',
+        'log_event_' || period, 'audit_statement_' || period, 'audit_substatement_' || period,
+        'audit_substatement_detail_' || period);
+
+    if not defer_index then
+        perform pgaudit.partition_index(partition_create.period);
+    end if;
+end
+$$ language plpgsql security definer set search_path = pg_catalog, pg_temp;
+
+revoke execute on function pgaudit.partition_create(text, boolean) from public;
+grant execute on function pgaudit.partition_create(text, boolean) to pgaudit_etl;
+
+-- Create partition_index() function to create the indexes of the partitions that do not have them yet, or only of the partition of
+-- a period.  Returns the periods that were indexed.
+create or replace function pgaudit.partition_index
+(
+    period text default null
+)
+    returns setof text as $$
+declare
+    partition_period text;
+begin
+    perform pg_advisory_xact_lock(hashtext('pgaudit.partition'));
+
+    for partition_period in
+        select partition.period
+          from pgaudit.partition
+         where not partition.indexed
+           and (partition_index.period is null or partition.period = partition_index.period)
+         order by partition.period
+    loop
+        execute format(
+            'create index %I on pgaudit.%I (session_id, virtual_transaction_id)',
+            'logevent_' || partition_period || '_sessionid_virtualtransactionid_idx', 'log_event_' || partition_period);
+        execute format(
+            'create index %I on pgaudit.%I using brin (log_time)',
+            'logevent_' || partition_period || '_logtime_idx', 'log_event_' || partition_period);
+
+        update pgaudit.partition
+           set indexed = true
+         where partition.period = partition_period;
+
+        return next partition_period;
+    end loop;
+end
+$$ language plpgsql security definer set search_path = pg_catalog, pg_temp;
+
+revoke execute on function pgaudit.partition_index(text) from public;
+grant execute on function pgaudit.partition_index(text) to pgaudit_etl;
+
+-- Create partition_retain() function to drop the partitions that only hold rows older than the retention in months.  The legacy
+-- partition is dropped once all of its log events are older than the retention, and sessions that have no log events left are
+-- deleted.  Returns the periods that were dropped.
+create or replace function pgaudit.partition_retain
+(
+    retain_months int
+)
+    returns setof text as $$
+declare
+    cutoff_time timestamp with time zone :=
+        date_trunc('month', current_timestamp - make_interval(months => retain_months));
+    partition_period text;
+    table_name text;
+begin
+    for partition_period in
+        select period
+          from pgaudit.partition
+         where period = 'legacy'
+            or period < to_char(cutoff_time, 'YYYYMM')
+         order by period
+    loop
+        -- The legacy partition has no period to compare so its log events are checked
+        if partition_period = 'legacy' and exists
+        (
+            select true
+              from pgaudit.log_event_legacy
+             where log_time >= cutoff_time
+        ) then
+            continue;
+        end if;
+
+        -- Detach the partitions from their parents then drop them
+        foreach table_name in array array['audit_substatement_detail', 'audit_substatement', 'audit_statement', 'log_event']
+        loop
+            execute format('alter table pgaudit.%I no inherit pgaudit.%I', table_name || '_' || partition_period, table_name);
+            execute format('drop table pgaudit.%I', table_name || '_' || partition_period);
+        end loop;
+
+        delete from pgaudit.partition
+         where period = partition_period;
+
+        return next partition_period;
+    end loop;
+
+    delete from pgaudit.session
+     where session_start_time < cutoff_time
+       and not exists
+    (
+        select true
+          from pgaudit.log_event
+         where log_event.session_id = session.session_id
+    );
+end
+$$ language plpgsql security definer set search_path = pg_catalog, pg_temp;
+
+revoke execute on function pgaudit.partition_retain(int) from public;
+grant execute on function pgaudit.partition_retain(int) to pgaudit_etl;
+
+-- Create vw_audit_event view again on the parent tables
+create view pgaudit.vw_audit_event as
+select session.session_id,
+       log_event.session_line_num,
+       log_event.log_time,
+       session.user_name,
+       session.database_name,
+       audit_statement.statement_id,
+       audit_statement.state,
+       audit_statement.error_session_line_num,
+       audit_substatement.substatement_id,
+       audit_substatement.substatement,
+       audit_substatement_detail.audit_type,
+       audit_substatement_detail.class,
+       audit_substatement_detail.command,
+       audit_substatement_detail.object_type,
+       audit_substatement_detail.object_name
+  from pgaudit.audit_substatement_detail
+       inner join pgaudit.log_event
+            on log_event.session_id = audit_substatement_detail.session_id
+           and log_event.session_line_num = audit_substatement_detail.session_line_num
+       inner join pgaudit.session
+            on session.session_id = audit_substatement_detail.session_id
+       inner join pgaudit.audit_substatement
+            on audit_substatement.session_id = audit_substatement_detail.session_id
+           and audit_substatement.statement_id = audit_substatement_detail.statement_id
+           and audit_substatement.substatement_id = audit_substatement_detail.substatement_id
+       inner join pgaudit.audit_statement
+            on audit_statement.session_id = audit_substatement_detail.session_id
+           and audit_statement.statement_id = audit_substatement_detail.statement_id;
+
+commit;
@@ -0,0 +1,117 @@
+-- Bring an audit schema created by an earlier audit.sql up to date.  Run this as postgres with pgaudit_analyze stopped before
+-- starting the new version of pgaudit_analyze.  It only makes the changes that are missing, so it can be run more than once and on
+-- a schema that is already up to date or partitioned (see audit_partition.sql).
+
+-- Stop on error
+\set ON_ERROR_STOP on
+
+-- Make sure that errors are detected and not automatically rolled back
+\set ON_ERROR_ROLLBACK off
+
+-- Upgrade everything or nothing
+begin;
+
+-- Set session authorization so all schema objects are owned by pgaudit_owner
+set session authorization pgaudit_owner;
+
+-- Add the database of each session.  The sessions already loaded were loaded into the audit schema of their own database.
+do $$
+begin
+    if not exists
+    (
+        select 1
+          from pg_attribute
+         where attrelid = 'pgaudit.session'::regclass
+           and attname = 'database_name'
+           and not attisdropped
+    ) then
+        alter table pgaudit.session
+            add column database_name text not null default current_database();
+
+        alter table pgaudit.session
+            alter column database_name drop default;
+    end if;
+end $$;
+
+create index if not exists session_databasename_idx
+    on pgaudit.session (database_name);
+
+-- Find the events of a virtual transaction when attributing an error to its statements.  Building it reads all of log_event, so it
+-- can take some time when the table is large.
+create index if not exists logevent_sessionid_virtualtransactionid_idx
+    on pgaudit.log_event (session_id, virtual_transaction_id);
+
+-- Create checkpoint table to record how far the log has been loaded so pgaudit_analyze can resume there after a restart
+create table if not exists pgaudit.checkpoint
+(
+    worker int not null,
+    log_file text not null,
+    log_offset bigint not null,
+    update_time timestamp with time zone not null default current_timestamp,
+
+    constraint checkpoint_pk
+        primary key (worker)
+);
+
+grant select,
+      insert,
+      update,
+      delete
+   on pgaudit.checkpoint
+   to pgaudit_etl;
+
+-- Create backfill table to record how far each worker of pgaudit_analyze --backfill has loaded each log file
+create table if not exists pgaudit.backfill
+(
+    log_file text not null,
+    worker int not null,
+    workers int not null,
+    log_offset bigint not null,
+    complete boolean not null,
+    update_time timestamp with time zone not null default current_timestamp,
+
+    constraint backfill_pk
+        primary key (log_file, worker)
+);
+
+grant select,
+      insert,
+      update,
+      delete
+   on pgaudit.backfill
+   to pgaudit_etl;
+
+-- Create vw_audit_event view again with the database of each session
+drop view pgaudit.vw_audit_event;
+
+create view pgaudit.vw_audit_event as
+select session.session_id,
+       log_event.session_line_num,
+       log_event.log_time,
+       session.user_name,
+       session.database_name,
+       audit_statement.statement_id,
+       audit_statement.state,
+       audit_statement.error_session_line_num,
+       audit_substatement.substatement_id,
+       audit_substatement.substatement,
+       audit_substatement_detail.audit_type,
+       audit_substatement_detail.class,
+       audit_substatement_detail.command,
+       audit_substatement_detail.object_type,
+       audit_substatement_detail.object_name
+  from pgaudit.audit_substatement_detail
+       inner join pgaudit.log_event
+            on log_event.session_id = audit_substatement_detail.session_id
+           and log_event.session_line_num = audit_substatement_detail.session_line_num
+       inner join pgaudit.session
+            on session.session_id = audit_substatement_detail.session_id
+       inner join pgaudit.audit_substatement
+            on audit_substatement.session_id = audit_substatement_detail.session_id
+           and audit_substatement.statement_id = audit_substatement_detail.statement_id
+           and audit_substatement.substatement_id = audit_substatement_detail.substatement_id
+       inner join pgaudit.audit_statement
+            on audit_statement.session_id = audit_substatement_detail.session_id
+           and audit_statement.statement_id = audit_substatement_detail.statement_id;
+
+commit;
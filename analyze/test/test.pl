@@ -92,6 +92,8 @@ if ($bHelp)
 # Global variables
 ####################################################################################################################################
 my $hDb;                                        # Master connection to Postgres
+my $strBasePath = dirname(dirname(abs_path($0)));
+my $strAnalyzeExe = "${strBasePath}/bin/pgaudit_analyze";
 
 ####################################################################################################################################
 # commandExecute
@@ -408,11 +410,42 @@ sub pgPsql
     commandExecute("${strPgSqlBin}/psql -p ${iPort} ${strOption} ${strDatabase}", $bSuppressError);
 }
 
+####################################################################################################################################
+# analyzeStart
+####################################################################################################################################
+sub analyzeStart
+{
+    my $strOption = shift;
+
+    # Set default
+    $strOption = defined($strOption) ? " ${strOption}" : '';
+
+    &log("ANALYZE: start${strOption}");
+
+    return IPC::Open3::open3(undef, undef, undef,
+                             "${strAnalyzeExe} --port=${iPort} --socket-path=/tmp" .
+                             " --log-file=${strTestPath}/pgaudit_analyze.log${strOption} ${strTestPath}/pg_log");
+}
+
+####################################################################################################################################
+# analyzeStop
+#
+# Kill pgaudit_analyze and its workers without giving them a chance to load what they have read, as in a crash.
+####################################################################################################################################
+sub analyzeStop
+{
+    my $iPid = shift;
+
+    &log("ANALYZE: stop");
+
+    commandExecute("pkill -KILL -P ${iPid}", true);
+    kill 'KILL', $iPid;
+    waitpid($iPid, 0);
+}
+
 ####################################################################################################################################
 # Main
 ####################################################################################################################################
-my $strBasePath = dirname(dirname(abs_path($0)));
-my $strAnalyzeExe = "${strBasePath}/bin/pgaudit_analyze";
 my $strSql;
 
 &log("INIT:\n");
@@ -426,9 +459,7 @@ pgStart();
 pgPsql("-f ${strBasePath}/sql/audit.sql");
 
 # Start pgaudit_analyze
-my $pId = IPC::Open3::open3(undef, undef, undef,
-                            "${strBasePath}/bin/pgaudit_analyze --port=${iPort} --socket-path=/tmp" .
-                            " --log-file=${strTestPath}/pgaudit_analyze.log ${strTestPath}/pg_log");
+my $pId = analyzeStart();
 
 use constant LOCALHOST => '127.0.0.1';
 
@@ -723,17 +754,268 @@ pgQueryTest($strSql);
 
 &log(undef, undef, true);
 
+# Verify that the analyzer resumes from its checkpoints after it is killed
+#-------------------------------------------------------------------------------
+&log("\nTEST: checkpoint-resume (log written while stopped is loaded once)\n");
+
+analyzeStop($pId);
+
+pgExecute("set pgaudit.log = 'read'");
+
+$strSql =
+    "select count(*)\n" .
+    "  from test_table\n" .
+    " where id = 1";
+
+pgExecute($strSql);
+
+$pId = analyzeStart();
+
+# The statement written while the analyzer was stopped is loaded
+my $strResumeSql = $strSql;
+
+$strSql =
+    "select count(*) = 1\n" .
+    "  from pgaudit.vw_audit_event\n" .
+    " where state = 'ok'\n" .
+    "   and audit_type = 'session'\n" .
+    "   and class = 'read'\n" .
+    "   and object_name = 'public.test_table'\n" .
+    "   and substatement = '${strResumeSql}'";
+
+pgQueryTest($strSql);
+
+# The log that was already loaded is not loaded again
+$strSql =
+    "select count(*) = 1\n" .
+    "  from pgaudit.vw_audit_event\n" .
+    " where class = 'role'\n" .
+    "   and command = 'alter role'\n" .
+    "   and substatement = 'alter role " . USER1 . " createdb'";
+
+pgQueryTest($strSql);
+
+$strSql =
+    "select count(*) = 1\n" .
+    "  from pgaudit.checkpoint\n" .
+    " where worker = 0";
+
+pgQueryTest($strSql);
+
+&log(undef, undef, true);
+
+# Verify that the log is loaded by several workers
+#-------------------------------------------------------------------------------
+&log("\nTEST: workers (log is split between workers)\n");
+
+analyzeStop($pId);
+$pId = analyzeStart('--workers=2');
+
+pgExecute('grant select on audit_table to ' . USER1);
+
+# Statements from several sessions so both workers are likely to get some
+for (my $iSession = 1; $iSession <= 4; $iSession++)
+{
+    $hUserDb = pgConnect(USER1, USER1, LOCALHOST);
+
+    pgExecute("select count(*) from audit_table where id = ${iSession}", $hUserDb);
+
+    pgDisconnect($hUserDb);
+}
+
+$strSql =
+    "select count(*) = 4\n" .
+    "  from pgaudit.vw_audit_event\n" .
+    " where user_name = '" . USER1 . "'\n" .
+    "   and state = 'ok'\n" .
+    "   and audit_type = 'object'\n" .
+    "   and object_name = 'public.audit_table'\n" .
+    "   and substatement like 'select count(*) from audit_table where id = %'";
+
+pgQueryTest($strSql);
+
+# Every worker has a checkpoint
+$strSql =
+    "select count(*) = 2\n" .
+    "  from pgaudit.checkpoint";
+
+pgQueryTest($strSql);
+
+&log(undef, undef, true);
+
+# Verify that the log of every database can be loaded into one audit database
+#-------------------------------------------------------------------------------
+&log("\nTEST: audit-database (log of other databases is loaded into one)\n");
+
+analyzeStop($pId);
+
+pgExecute('create database audit_db');
+pgExecute('create database other_db');
+commandExecute("${strPgSqlBin}/psql -p ${iPort} -f ${strBasePath}/sql/audit.sql audit_db");
+
+$pId = analyzeStart('--audit-database=audit_db');
+
+my $hOtherDb = pgConnect(undef, undef, undef, 'other_db');
+
+pgExecute('create table other_table (id int)', $hOtherDb);
+pgExecute("set pgaudit.log = 'read'", $hOtherDb);
+
+$strSql =
+    "select count(*)\n" .
+    "  from other_table";
+
+pgExecute($strSql, $hOtherDb);
+pgDisconnect($hOtherDb);
+
+my $hAuditDb = pgConnect(undef, undef, undef, 'audit_db');
+
+$strSql =
+    "select count(*) = 1\n" .
+    "  from pgaudit.vw_audit_event\n" .
+    " where database_name = 'other_db'\n" .
+    "   and state = 'ok'\n" .
+    "   and class = 'read'\n" .
+    "   and object_name = 'public.other_table'\n" .
+    "   and substatement = 'select count(*)\n  from other_table'";
+
+pgQueryTest($strSql, $hAuditDb);
+
+pgDisconnect($hAuditDb);
+
+&log(undef, undef, true);
+
+# Verify that a partitioned schema is loaded and old partitions are dropped
+#-------------------------------------------------------------------------------
+&log("\nTEST: partition-retain (rows go to monthly partitions that are dropped by --retain)\n");
+
+analyzeStop($pId);
+
+pgPsql("-f ${strBasePath}/sql/audit_partition.sql");
+
+$pId = analyzeStart();
+
+$strSql =
+    "select count(*)\n" .
+    "  from test_table\n" .
+    " where id = 2";
+
+pgExecute($strSql);
+
+my $strPartitionSql = $strSql;
+
+$strSql =
+    "select count(*) = 1\n" .
+    "  from pgaudit.vw_audit_event\n" .
+    "       inner join pgaudit.partition\n" .
+    "            on partition.period = to_char(current_timestamp, 'YYYYMM')\n" .
+    "           and partition.indexed\n" .
+    " where substatement = '${strPartitionSql}'";
+
+pgQueryTest($strSql);
+
+# The rows loaded before the schema was partitioned are in the legacy partition
+$strSql =
+    "select count(*) = 1\n" .
+    "  from pgaudit.log_event_legacy\n" .
+    "       inner join pgaudit.audit_substatement_detail_legacy\n" .
+    "            on audit_substatement_detail_legacy.session_id = log_event_legacy.session_id\n" .
+    "           and audit_substatement_detail_legacy.session_line_num = log_event_legacy.session_line_num\n" .
+    "       inner join pgaudit.audit_substatement_legacy\n" .
+    "            on audit_substatement_legacy.session_id = audit_substatement_detail_legacy.session_id\n" .
+    "           and audit_substatement_legacy.statement_id = audit_substatement_detail_legacy.statement_id\n" .
+    "           and audit_substatement_legacy.substatement_id = audit_substatement_detail_legacy.substatement_id\n" .
+    " where audit_substatement_legacy.substatement = '${strResumeSql}'";
+
+pgQueryTest($strSql);
+
+# An old partition is dropped and the current one is kept
+pgExecute("select pgaudit.partition_create('201001')");
+
+commandExecute("${strAnalyzeExe} --port=${iPort} --socket-path=/tmp --retain=1");
+
+$strSql =
+    "select count(*) filter (where period = '201001') = 0,\n" .
+    "       count(*) filter (where period = to_char(current_timestamp, 'YYYYMM')) = 1,\n" .
+    "       count(*) filter (where period = 'legacy') = 1,\n" .
+    "       to_regclass('pgaudit.log_event_201001') is null\n" .
+    "  from pgaudit.partition";
+
+pgQueryTest($strSql);
+
+&log(undef, undef, true);
+
+# Verify that archived log files are backfilled
+#-------------------------------------------------------------------------------
+&log("\nTEST: backfill (compressed log file is loaded once)\n");
+
+my $strBackfillPath = "${strTestPath}/backfill";
+my $strBackfillFile = "${strBackfillPath}/postgresql-2015-10-01_000000.csv";
+
+commandExecute("mkdir -p ${strBackfillPath}");
+
+# A session that ran before the analyzer was installed, written as csvlog
+open(my $hBackfill, '>', $strBackfillFile)
+    or confess "unable to create ${strBackfillFile}";
+
+print $hBackfill
+    "2015-10-01 12:00:00.000 UTC,\"" . USER1 . "\",\"${strDatabase}\",12345,\"127.0.0.1:50000\",560d20c0.3039,1," .
+        "\"authentication\",2015-10-01 12:00:00 UTC,2/1,0,LOG,00000,\"connection authorized: user=" . USER1 .
+        " database=${strDatabase}\",,,,,,,,,\"\"\n" .
+    "2015-10-01 12:00:01.000 UTC,\"" . USER1 . "\",\"${strDatabase}\",12345,\"127.0.0.1:50000\",560d20c0.3039,2," .
+        "\"SELECT\",2015-10-01 12:00:00 UTC,2/2,0,LOG,00000,\"AUDIT: SESSION,1,1,READ,SELECT,TABLE,public.test_table," .
+        "select id from backfill_test,<not logged>\",,,,,,,,,\"psql\"\n";
+
+close($hBackfill);
+
+commandExecute("gzip ${strBackfillFile}");
+
+my $strBackfillCommand =
+    "${strAnalyzeExe} --port=${iPort} --socket-path=/tmp --log-file=${strTestPath}/pgaudit_backfill.log --workers=2" .
+    " --backfill ${strBackfillPath}";
+
+commandExecute($strBackfillCommand);
+
+$strSql =
+    "select count(*) = 1\n" .
+    "  from pgaudit.vw_audit_event\n" .
+    "       inner join pgaudit.partition\n" .
+    "            on partition.period = '201510'\n" .
+    "           and partition.indexed\n" .
+    " where session_id = '560d20c0.3039'\n" .
+    "   and log_time = '2015-10-01 12:00:01 UTC'\n" .
+    "   and substatement = 'select id from backfill_test'";
+
+pgQueryTest($strSql);
+
+$strSql =
+    "select bool_and(complete)\n" .
+    "  from pgaudit.backfill\n" .
+    " where log_file = 'postgresql-2015-10-01_000000.csv'";
+
+pgQueryTest($strSql);
+
+# A second backfill of the same file loads nothing again
+commandExecute($strBackfillCommand);
+
+$strSql =
+    "select count(*) = 1\n" .
+    "  from pgaudit.vw_audit_event\n" .
+    " where session_id = '560d20c0.3039'";
+
+pgQueryTest($strSql);
+
+&log(undef, undef, true);
+
 # Cleanup
 #-------------------------------------------------------------------------------
+# Send kill to pgaudit_analyze
+analyzeStop($pId);
+
 # Stop the database
 if (!$bNoCleanup)
 {
     pgDrop();
 }
 
-# Send kill to pgaudit_analyze
-kill 'KILL', $pId;
-waitpid($pId, 0);
-
 # Print success
 &log("\nTESTS COMPLETED SUCCESSFULLY!");
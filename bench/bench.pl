@@ -0,0 +1,505 @@
+#!/usr/bin/perl
+####################################################################################################################################
+# bench.pl - pgaudit overhead benchmark
+####################################################################################################################################
+
+####################################################################################################################################
+# Perl includes
+####################################################################################################################################
+use strict;
+use warnings FATAL => qw(all);
+use Carp;
+
+use Cwd qw(abs_path);
+use Getopt::Long;
+use File::Basename qw(dirname);
+use Pod::Usage;
+use IPC::System::Simple qw(capture);
+
+####################################################################################################################################
+# Usage
+####################################################################################################################################
+
+=head1 NAME
+
+bench.pl - pgaudit Overhead Benchmark
+
+=head1 SYNOPSIS
+
+bench.pl [options]
+
+ Benchmark Options:
+   --profile            comma-separated audit profiles to run (defaults to all)
+   --workload           comma-separated workloads to run (defaults to all)
+   --clients            comma-separated client counts (defaults to 1,4,16,64)
+   --duration           seconds each pgbench run lasts (defaults to 30)
+   --scale              pgbench scale factor (defaults to 10)
+   --report             also write the report to this file
+   --no-cleanup         don't remove the cluster when the benchmark is complete
+
+ Configuration Options:
+   --pgsql-bin          path to the postgres executables (defaults to /usr/local/pgsql/bin)
+   --test-path          path where the cluster is created (defaults to ./bench-data)
+   --port               port to run Postgres on (defaults to 6544)
+   --quiet, -q          suppress non-error output
+
+ General Options:
+   --help               display usage and exit
+=cut
+
+####################################################################################################################################
+# Constants
+####################################################################################################################################
+use constant
+{
+    true  => 1,
+    false => 0
+};
+
+####################################################################################################################################
+# Audit profiles - each is run against every workload.  The first profile is the baseline that deltas are reported against.
+####################################################################################################################################
+my @oyProfile =
+(
+    {name => 'unloaded', preload => false, setting => {}},
+    {name => 'log-none', preload => true, setting => {'pgaudit.log' => 'none'}},
+    {name => 'read-write', preload => true, setting => {'pgaudit.log' => 'read,write'}},
+    {name => 'log-relation', preload => true, setting => {'pgaudit.log' => 'read,write', 'pgaudit.log_relation' => 'on'}},
+    {name => 'log-parameter', preload => true, setting => {'pgaudit.log' => 'read,write', 'pgaudit.log_parameter' => 'on'}},
+    {name => 'object', preload => true, setting => {'pgaudit.log' => 'none', 'pgaudit.role' => 'auditor'}}
+);
+
+####################################################################################################################################
+# Workloads - script is the pgbench script in bench/script (param.sql is generated) and mode is the pgbench query mode
+####################################################################################################################################
+my @oyWorkload =
+(
+    {name => 'select', script => 'select.sql', mode => 'prepared'},
+    {name => 'tpcb', script => 'tpcb.sql', mode => 'prepared'},
+    {name => 'wide', script => 'wide.sql', mode => 'prepared'},
+    {name => 'param', script => 'param.sql', mode => 'prepared'},
+    {name => 'plpgsql', script => 'plpgsql.sql', mode => 'prepared'},
+    {name => 'ddl', script => 'ddl.sql', mode => 'simple'}
+);
+
+# Number of parameters in the param workload insert
+use constant PARAM_TOTAL => 500;
+
+####################################################################################################################################
+# Command line parameters
+####################################################################################################################################
+my $strPgSqlBin = '/usr/local/pgsql/bin';       # Path of PG binaries to use for this benchmark
+my $strTestPath = 'bench-data';                 # Path where the cluster is created
+my $strUser = getpwuid($>);                     # PG user name
+my $strHost = '/tmp';                           # PG default host
+my $strDatabase = 'postgres';                   # PG database
+my $iPort = 6544;                               # Port to run Postgres on
+my $strProfile;                                 # Profiles to run
+my $strWorkload;                                # Workloads to run
+my $strClients = '1,4,16,64';                   # Client counts to run
+my $iDuration = 30;                             # Seconds per pgbench run
+my $iScale = 10;                                # pgbench scale factor
+my $strReport;                                  # File to write the report to
+my $bHelp = false;                              # Display help
+my $bQuiet = false;                             # Supress output except for errors
+my $bNoCleanup = false;                         # Cleanup database on exit
+
+GetOptions ('q|quiet' => \$bQuiet,
+            'no-cleanup' => \$bNoCleanup,
+            'help' => \$bHelp,
+            'pgsql-bin=s' => \$strPgSqlBin,
+            'test-path=s' => \$strTestPath,
+            'port=i' => \$iPort,
+            'profile=s' => \$strProfile,
+            'workload=s' => \$strWorkload,
+            'clients=s' => \$strClients,
+            'duration=i' => \$iDuration,
+            'scale=i' => \$iScale,
+            'report=s' => \$strReport)
+    or pod2usage(2);
+
+# Display version and exit if requested
+if ($bHelp)
+{
+    syswrite(*STDOUT, "pgaudit Overhead Benchmark\n\n");
+    pod2usage();
+
+    exit 0;
+}
+
+####################################################################################################################################
+# Global variables
+####################################################################################################################################
+my $strScriptPath = dirname(abs_path($0)) . '/script';
+my $iPgBenchVersion;                            # Major version of pgbench (e.g. 905, 1000)
+my %oResult;                                    # Results by workload, clients and profile
+
+####################################################################################################################################
+# commandExecute
+####################################################################################################################################
+sub commandExecute
+{
+    my $strCommand = shift;
+    my $bSuppressError = shift;
+
+    # Set default
+    $bSuppressError = defined($bSuppressError) ? $bSuppressError : false;
+
+    # Run the command
+    my $strResult;
+
+    eval
+    {
+        $strResult = capture($strCommand);
+    };
+
+    if ($@ && !$bSuppressError)
+    {
+        confess $@;
+    }
+
+    return $strResult;
+}
+
+####################################################################################################################################
+# log
+####################################################################################################################################
+sub log
+{
+    my $strMessage = shift;
+    my $bError = shift;
+
+    if (defined($strMessage))
+    {
+        # Set default
+        $bError = defined($bError) ? $bError : false;
+
+        if (!$bQuiet || $bError)
+        {
+            syswrite(*STDOUT, "${strMessage}\n");
+        }
+    }
+
+    if ($bError)
+    {
+        exit 1;
+    }
+}
+
+####################################################################################################################################
+# listFilter - select the named entries from a list of hashes, or all of them when no names are given
+####################################################################################################################################
+sub listFilter
+{
+    my $oyList = shift;
+    my $strName = shift;
+    my $strType = shift;
+
+    if (!defined($strName))
+    {
+        return @{$oyList};
+    }
+
+    my @oyResult;
+
+    foreach my $strItem (split(',', $strName))
+    {
+        my @oyMatch = grep {$_->{name} eq $strItem} @{$oyList};
+
+        if (@oyMatch == 0)
+        {
+            &log("unknown ${strType} '${strItem}'", true);
+        }
+
+        push(@oyResult, $oyMatch[0]);
+    }
+
+    return @oyResult;
+}
+
+####################################################################################################################################
+# psqlExecute
+####################################################################################################################################
+sub psqlExecute
+{
+    my $strSql = shift;
+    my $strFile = shift;
+
+    commandExecute("${strPgSqlBin}/psql -X -q -v ON_ERROR_STOP=1 -h ${strHost} -p ${iPort} -U ${strUser} -d ${strDatabase}" .
+                   (defined($strFile) ? " -f ${strFile}" : " -c \"${strSql}\"") . ' > /dev/null');
+}
+
+####################################################################################################################################
+# pgCreate
+####################################################################################################################################
+sub pgCreate
+{
+    commandExecute("${strPgSqlBin}/initdb -D ${strTestPath} -U ${strUser} -A trust > /dev/null");
+    commandExecute("echo 'local all all trust' > ${strTestPath}/pg_hba.conf");
+}
+
+####################################################################################################################################
+# pgStop
+####################################################################################################################################
+sub pgStop
+{
+    my $bImmediate = shift;
+
+    # Set default
+    $bImmediate = defined($bImmediate) ? $bImmediate : false;
+
+    # If postmaster process is running then stop the cluster
+    if (-e $strTestPath . '/postmaster.pid')
+    {
+        commandExecute("${strPgSqlBin}/pg_ctl stop -D ${strTestPath} -w -s -m " . ($bImmediate ? 'immediate' : 'fast'), true);
+    }
+}
+
+####################################################################################################################################
+# pgDrop
+####################################################################################################################################
+sub pgDrop
+{
+    pgStop(true);
+    commandExecute("rm -rf ${strTestPath}");
+}
+
+####################################################################################################################################
+# pgStart - start the cluster with the settings of an audit profile
+####################################################################################################################################
+sub pgStart
+{
+    my $oProfile = shift;
+
+    # Make sure postgres is not running
+    if (-e $strTestPath . '/postmaster.pid')
+    {
+        confess "${strTestPath}/postmaster.pid exists, cannot start";
+    }
+
+    # Audit logs from the last profile are not needed
+    commandExecute("rm -rf ${strTestPath}/bench_log");
+
+    # All profiles log through the collector so the baseline pays the same logging cost as the audited profiles
+    my $strOption =
+        " -c port=${iPort}" .
+        " -c unix_socket_directories='${strHost}'" .
+        " -c max_connections=100" .
+        " -c shared_buffers=256MB" .
+        " -c log_destination=csvlog" .
+        " -c logging_collector=on" .
+        " -c log_directory=bench_log" .
+        " -c synchronous_commit=off";
+
+    if ($oProfile->{preload})
+    {
+        $strOption .= " -c shared_preload_libraries='pgaudit'";
+    }
+
+    foreach my $strKey (sort(keys(%{$oProfile->{setting}})))
+    {
+        $strOption .= " -c ${strKey}='$oProfile->{setting}{$strKey}'";
+    }
+
+    commandExecute("${strPgSqlBin}/pg_ctl start -o \"${strOption}\" -D ${strTestPath} -l ${strTestPath}/postgresql.log -w -s");
+
+    # The event triggers cannot run unless the library is preloaded, so the extension only exists in loaded profiles
+    if ($oProfile->{preload})
+    {
+        psqlExecute('CREATE EXTENSION pgaudit');
+    }
+
+    psqlExecute('CHECKPOINT');
+}
+
+####################################################################################################################################
+# scriptWrite - copy a benchmark script into the test path, rewriting random() for pgbench versions that predate it
+####################################################################################################################################
+sub scriptWrite
+{
+    my $strName = shift;
+    my $strScript = shift;
+
+    if ($iPgBenchVersion < 906)
+    {
+        $strScript =~ s/^\\set (\w+) random\(([^,]+), ([^)]+)\)$/\\setrandom $1 $2 $3/mg;
+    }
+
+    open(my $hFile, '>', "${strTestPath}/${strName}")
+        or confess "unable to open ${strTestPath}/${strName}";
+    print $hFile $strScript;
+    close($hFile);
+}
+
+####################################################################################################################################
+# benchSetup - load the benchmark data and write the scripts
+####################################################################################################################################
+sub benchSetup
+{
+    # Determine the pgbench version
+    my $strVersion = commandExecute("${strPgSqlBin}/pgbench --version");
+
+    if ($strVersion !~ /(\d+)\.(\d+)/)
+    {
+        confess "unable to parse pgbench version from '${strVersion}'";
+    }
+
+    $iPgBenchVersion = $1 >= 10 ? $1 * 100 : $1 * 100 + $2;
+
+    # Load the data
+    &log("load data (scale ${iScale})");
+
+    commandExecute("${strPgSqlBin}/pgbench -i -q -s ${iScale} -h ${strHost} -p ${iPort} -U ${strUser} ${strDatabase} 2>&1");
+    psqlExecute(undef, "${strScriptPath}/setup.sql");
+    psqlExecute('VACUUM ANALYZE');
+
+    # Copy the static scripts
+    foreach my $oWorkload (@oyWorkload)
+    {
+        if (-e "${strScriptPath}/$oWorkload->{script}")
+        {
+            open(my $hFile, '<', "${strScriptPath}/$oWorkload->{script}")
+                or confess "unable to open ${strScriptPath}/$oWorkload->{script}";
+            my $strScript = do {local $/; <$hFile>};
+            close($hFile);
+
+            scriptWrite($oWorkload->{script}, $strScript);
+        }
+    }
+
+    # Generate the many-parameter insert
+    my $strScript = "-- Insert with " . PARAM_TOTAL . " parameters\n";
+    my @stryParam;
+
+    for (my $iParam = 1; $iParam <= PARAM_TOTAL; $iParam++)
+    {
+        $strScript .= "\\set p${iParam} random(1, 100000)\n";
+        push(@stryParam, ":p${iParam}");
+    }
+
+    $strScript .= 'INSERT INTO bench_param VALUES (' . join(', ', @stryParam) . ");\n";
+
+    scriptWrite('param.sql', $strScript);
+}
+
+####################################################################################################################################
+# benchRun - run one workload at one client count and return tps and average latency
+####################################################################################################################################
+sub benchRun
+{
+    my $oWorkload = shift;
+    my $iClients = shift;
+
+    my $strOutput = commandExecute(
+        "${strPgSqlBin}/pgbench -n -c ${iClients} -j ${iClients} -T ${iDuration} -M $oWorkload->{mode}" .
+        " -D scale=${iScale} -f ${strTestPath}/$oWorkload->{script}" .
+        " -h ${strHost} -p ${iPort} -U ${strUser} ${strDatabase} 2>&1");
+
+    # Output differs slightly between pgbench versions
+    if ($strOutput !~ /^tps = ([0-9.]+) \((excluding|without)/m)
+    {
+        confess "unable to find tps in pgbench output:\n${strOutput}";
+    }
+
+    my $fTps = $1;
+
+    if ($strOutput !~ /^latency average[:=] *([0-9.]+) ms/m)
+    {
+        confess "unable to find latency in pgbench output:\n${strOutput}";
+    }
+
+    return ($fTps, $1);
+}
+
+####################################################################################################################################
+# benchReport
+####################################################################################################################################
+sub benchReport
+{
+    my $oyProfileRun = shift;
+    my $oyWorkloadRun = shift;
+    my $iyClients = shift;
+
+    my $strBaseline = $oyProfile[0]{name};
+    my $strFormat = "%-10s %7s  %-14s %12s %12s %9s %9s\n";
+    my $strText = sprintf($strFormat, 'workload', 'clients', 'profile', 'tps', 'latency ms', 'tps %', 'lat %');
+
+    foreach my $oWorkload (@{$oyWorkloadRun})
+    {
+        foreach my $iClients (@{$iyClients})
+        {
+            my $oBase = $oResult{$oWorkload->{name}}{$iClients}{$strBaseline};
+
+            foreach my $oProfile (@{$oyProfileRun})
+            {
+                my $oRun = $oResult{$oWorkload->{name}}{$iClients}{$oProfile->{name}};
+
+                $strText .= sprintf(
+                    $strFormat, $oWorkload->{name}, $iClients, $oProfile->{name},
+                    sprintf('%.1f', $oRun->{tps}), sprintf('%.3f', $oRun->{latency}),
+                    defined($oBase) && $oBase->{tps} > 0 ?
+                        sprintf('%+.1f', ($oRun->{tps} - $oBase->{tps}) * 100 / $oBase->{tps}) : 'n/a',
+                    defined($oBase) && $oBase->{latency} > 0 ?
+                        sprintf('%+.1f', ($oRun->{latency} - $oBase->{latency}) * 100 / $oBase->{latency}) : 'n/a');
+            }
+        }
+    }
+
+    syswrite(*STDOUT, "\n${strText}");
+
+    if (defined($strReport))
+    {
+        open(my $hFile, '>', $strReport)
+            or confess "unable to open ${strReport}";
+        print $hFile $strText;
+        close($hFile);
+    }
+}
+
+####################################################################################################################################
+# Main
+####################################################################################################################################
+my @oyProfileRun = listFilter(\@oyProfile, $strProfile, 'profile');
+my @oyWorkloadRun = listFilter(\@oyWorkload, $strWorkload, 'workload');
+my @iyClients = split(',', $strClients);
+
+# Create the cluster and load the data without pgaudit
+pgDrop();
+pgCreate();
+pgStart($oyProfile[0]);
+benchSetup();
+
+# Run every workload and client count for each profile
+foreach my $oProfile (@oyProfileRun)
+{
+    # Drop the extension while the library is still loaded, since dropping the event triggers fires them
+    psqlExecute('DROP EXTENSION IF EXISTS pgaudit');
+
+    pgStop();
+    pgStart($oProfile);
+
+    foreach my $oWorkload (@oyWorkloadRun)
+    {
+        foreach my $iClients (@iyClients)
+        {
+            my ($fTps, $fLatency) = benchRun($oWorkload, $iClients);
+
+            &log(sprintf('%-14s %-10s %3d clients: %10.1f tps %10.3f ms',
+                         $oProfile->{name}, $oWorkload->{name}, $iClients, $fTps, $fLatency));
+
+            $oResult{$oWorkload->{name}}{$iClients}{$oProfile->{name}} = {tps => $fTps, latency => $fLatency};
+        }
+    }
+}
+
+benchReport(\@oyProfileRun, \@oyWorkloadRun, \@iyClients);
+
+# Stop the cluster and remove the data unless asked to keep it
+if ($bNoCleanup)
+{
+    pgStop();
+}
+else
+{
+    pgDrop();
+}
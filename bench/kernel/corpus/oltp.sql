@@ -0,0 +1,39 @@
+SELECT abalance FROM pgbench_accounts WHERE aid = $1
+----
+UPDATE pgbench_accounts SET abalance = abalance + $1 WHERE aid = $2
+----
+UPDATE pgbench_tellers SET tbalance = tbalance + $1 WHERE tid = $2
+----
+UPDATE pgbench_branches SET bbalance = bbalance + $1 WHERE bid = $2
+----
+INSERT INTO pgbench_history (tid, bid, aid, delta, mtime) VALUES ($1, $2, $3, $4, CURRENT_TIMESTAMP)
+----
+SELECT id, name, email FROM customer WHERE id = $1
+----
+SELECT o.id, o.total FROM orders o WHERE o.customer_id = $1 ORDER BY o.created DESC LIMIT 10
+----
+INSERT INTO order_line (order_id, product_id, quantity, price) VALUES ($1, $2, $3, $4)
+----
+UPDATE inventory SET quantity = quantity - $1 WHERE product_id = $2 AND warehouse_id = $3
+----
+DELETE FROM session WHERE expires < now()
+----
+SELECT count(*) FROM order_line WHERE order_id = $1
+----
+SELECT price FROM product WHERE id = $1
+----
+UPDATE customer SET last_login = now() WHERE id = $1
+----
+INSERT INTO audit_trail (customer_id, action) VALUES ($1, $2)
+----
+SELECT 1
+----
+EXECUTE get_customer(42)
+----
+SELECT s_quantity, s_data FROM stock WHERE s_i_id = $1 AND s_w_id = $2 FOR UPDATE
+----
+UPDATE district SET d_next_o_id = d_next_o_id + 1 WHERE d_w_id = $1 AND d_id = $2
+----
+SELECT c_discount, c_last, c_credit FROM customer WHERE c_w_id = $1 AND c_d_id = $2 AND c_id = $3
+----
+DELETE FROM new_order WHERE no_o_id = $1 AND no_d_id = $2 AND no_w_id = $3
@@ -0,0 +1,31 @@
+#!/usr/bin/perl
+####################################################################################################################################
+# orm.pl - generate the ORM corpus
+#
+# ORM frameworks generate very long statements (wide column lists with aliases for every column, long IN lists, many joins).
+# Rather than store several 50KB statements in the repository they are generated here deterministically.
+####################################################################################################################################
+use strict;
+use warnings FATAL => qw(all);
+
+my @stryStatement;
+
+# Wide select with an alias for every column of every joined table
+my @stryTable = map {"t${_}"} (1 .. 12);
+my $strSql = 'SELECT ' . join(', ', map {my $strTable = $_; map {"${strTable}.column_${_} AS ${strTable}_column_${_}"} (1 .. 90)}
+                                     @stryTable) .
+             "\nFROM entity_" . join("\n", map {"LEFT OUTER JOIN entity_${_} ${_} ON ${_}.parent_id = t1.id"} @stryTable[1 .. $#stryTable]) .
+             "\nWHERE t1.id IN (" . join(', ', (1 .. 2000)) . ")\nORDER BY t1.id";
+$strSql =~ s/^(FROM entity_)/$1t1 t1\n/m;
+push(@stryStatement, $strSql);
+
+# Batched insert with a parameter for every value
+my $iParam = 1;
+push(@stryStatement, 'INSERT INTO entity_t1 (' . join(', ', map {"column_${_}"} (1 .. 60)) . ') VALUES ' .
+                     join(",\n", map {'(' . join(', ', map {'$' . $iParam++} (1 .. 60)) . ')'} (1 .. 120)));
+
+# Update with a long CASE expression
+push(@stryStatement, "UPDATE entity_t1 SET column_1 = CASE id\n" .
+                     join("\n", map {"    WHEN ${_} THEN 'value ${_}, \"quoted\"'"} (1 .. 1500)) . "\nEND\nWHERE id BETWEEN 1 AND 1500");
+
+print join("\n----\n", @stryStatement) . "\n";
@@ -0,0 +1,31 @@
+INSERT INTO note (body) VALUES ('He said "hello, world" and left')
+----
+SELECT 'a,b,c' AS list, '"quoted"' AS q FROM generate_series(1, 10)
+----
+INSERT INTO address (line1, line2, city)
+VALUES ('1 Main St, Apt "B"',
+        'c/o "Smith, J"',
+        'Springfield')
+----
+UPDATE document SET body = 'line one
+line two, "with quotes"
+line three' WHERE id = 7
+----
+SELECT "Customer"."Name", "Customer"."Address"
+FROM "Sales"."Customer"
+WHERE "Customer"."Region" IN ('North', 'South', 'East', 'West')
+----
+COPY (SELECT id, "Name" FROM "T") TO STDOUT WITH (FORMAT csv, QUOTE '"', DELIMITER ',')
+----
+DO $$
+BEGIN
+    RAISE NOTICE 'value: "%", next: "%"', 1, 2;
+END
+$$
+----
+INSERT INTO json_doc (doc) VALUES ('{"a": 1, "b": [1, 2, 3], "c": {"d": "e,f"}}')
+----
+SELECT format('%s, %s', '"x"', '"y"'),
+       E'tab\there, "there"'
+----
+CREATE TABLE "Quoted, Table" ("Col ""1""" int, "Col,2" text)
@@ -0,0 +1,23 @@
+CREATE ROLE app LOGIN PASSWORD 'secret'
+----
+ALTER ROLE app PASSWORD 'n3w,"secret"' VALID UNTIL '2030-01-01'
+----
+CREATE USER reporting WITH LOGIN CONNECTION LIMIT 10 ENCRYPTED PASSWORD 'md5c4ca4238a0b923820dcc509a6f75849b'
+----
+ALTER ROLE reporting WITH NOLOGIN
+----
+CREATE ROLE readonly NOLOGIN
+----
+GRANT SELECT ON ALL TABLES IN SCHEMA public TO readonly
+----
+ALTER USER app WITH PASSWORD NULL
+----
+DROP ROLE legacy_user
+----
+CREATE SERVER remote FOREIGN DATA WRAPPER postgres_fdw OPTIONS (host 'db.example.com', dbname 'app', port '5432')
+----
+ALTER SERVER remote OPTIONS (SET "password" E'it\'s secret', ADD sslmode 'require')
+----
+CREATE USER MAPPING FOR app SERVER remote OPTIONS (user 'app', password $pw$se'cr"et$pw$)
+----
+ALTER USER MAPPING FOR app SERVER remote OPTIONS (SET password 'rotated' /* 'not the password' */, SET user 'app2')
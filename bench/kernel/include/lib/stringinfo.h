@@ -0,0 +1,36 @@
+/*------------------------------------------------------------------------------
+ * stringinfo.h
+ *
+ * Minimal stand-in for the server StringInfo API, see bench/kernel/stub.c.
+ *
+ * IDENTIFICATION
+ *          contrib/pgaudit/bench/kernel/include/lib/stringinfo.h
+ *------------------------------------------------------------------------------
+ */
+#ifndef STRINGINFO_H
+#define STRINGINFO_H
+
+typedef struct StringInfoData
+{
+    char *data;
+    int len;
+    int maxlen;
+    int cursor;
+} StringInfoData;
+
+typedef StringInfoData *StringInfo;
+
+extern void initStringInfo(StringInfo str);
+extern void resetStringInfo(StringInfo str);
+extern void enlargeStringInfo(StringInfo str, int needed);
+extern void appendStringInfoString(StringInfo str, const char *s);
+extern void appendStringInfoChar(StringInfo str, char ch);
+extern void appendBinaryStringInfo(StringInfo str, const char *data,
+                                   int datalen);
+
+#define appendStringInfoCharMacro(str,ch) \
+    (((str)->len + 1 >= (str)->maxlen) ? \
+     appendStringInfoChar(str, ch) : \
+     (void)((str)->data[(str)->len] = (ch), (str)->data[++(str)->len] = '\0'))
+
+#endif   /* STRINGINFO_H */
@@ -0,0 +1,44 @@
+/*------------------------------------------------------------------------------
+ * nodes.h
+ *
+ * Minimal stand-in for the server node tags.  Only the tags that the pgaudit
+ * kernels test are defined and the values do not match the server.
+ *
+ * IDENTIFICATION
+ *          contrib/pgaudit/bench/kernel/include/nodes/nodes.h
+ *------------------------------------------------------------------------------
+ */
+#ifndef NODES_H
+#define NODES_H
+
+typedef enum NodeTag
+{
+    T_Invalid = 0,
+    T_PlannedStmt,
+    T_InsertStmt,
+    T_DeleteStmt,
+    T_UpdateStmt,
+    T_SelectStmt,
+    T_AlterTableStmt,
+    T_AlterDefaultPrivilegesStmt,
+    T_GrantStmt,
+    T_GrantRoleStmt,
+    T_CopyStmt,
+    T_CreateStmt,
+    T_DropStmt,
+    T_TruncateStmt,
+    T_DoStmt,
+    T_RenameStmt,
+    T_CreateRoleStmt,
+    T_AlterRoleStmt,
+    T_DropRoleStmt,
+    T_AlterRoleSetStmt,
+    T_PrepareStmt,
+    T_ExecuteStmt,
+    T_CreateForeignServerStmt,
+    T_AlterForeignServerStmt,
+    T_CreateUserMappingStmt,
+    T_AlterUserMappingStmt
+} NodeTag;
+
+#endif   /* NODES_H */
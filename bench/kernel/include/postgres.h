@@ -0,0 +1,36 @@
+/*------------------------------------------------------------------------------
+ * postgres.h
+ *
+ * Minimal stand-in for the server header so the pgaudit kernels can be built
+ * outside of the server.  Only what pgaudit_kernel.c uses is declared here.
+ *
+ * IDENTIFICATION
+ *          contrib/pgaudit/bench/kernel/include/postgres.h
+ *------------------------------------------------------------------------------
+ */
+#ifndef POSTGRES_H
+#define POSTGRES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int64_t int64;
+typedef uint64_t uint64;
+
+#define Assert(condition)
+
+#define IS_HIGHBIT_SET(ch)      ((unsigned char)(ch) & 0x80)
+
+extern void *palloc(size_t size);
+extern void *repalloc(void *pointer, size_t size);
+extern void pfree(void *pointer);
+extern char *pstrdup(const char *in);
+
+extern int pg_strcasecmp(const char *s1, const char *s2);
+extern int pg_strncasecmp(const char *s1, const char *s2, size_t n);
+extern unsigned char pg_tolower(unsigned char ch);
+
+#endif   /* POSTGRES_H */
@@ -0,0 +1,22 @@
+/*------------------------------------------------------------------------------
+ * utility.h
+ *
+ * Minimal stand-in for the server header, which provides LogStmtLevel by way
+ * of tcop/tcopprot.h.
+ *
+ * IDENTIFICATION
+ *          contrib/pgaudit/bench/kernel/include/tcop/utility.h
+ *------------------------------------------------------------------------------
+ */
+#ifndef UTILITY_H
+#define UTILITY_H
+
+typedef enum
+{
+    LOGSTMT_NONE,
+    LOGSTMT_DDL,
+    LOGSTMT_MOD,
+    LOGSTMT_ALL
+} LogStmtLevel;
+
+#endif   /* UTILITY_H */
@@ -0,0 +1,437 @@
+/*------------------------------------------------------------------------------
+ * kernel_bench.c
+ *
+ * Measures the pgaudit formatting and classification kernels outside of the
+ * server.  Each corpus file holds statements separated by lines containing
+ * only "----".  Every kernel is run over every statement in the corpus
+ * repeatedly until the run time has elapsed, then the time per statement
+ * (event), the size of the output per statement, and throughput over the
+ * statement text are reported.
+ *
+ * Usage: kernel_bench [-t seconds] corpus ...
+ *
+ * IDENTIFICATION
+ *          contrib/pgaudit/bench/kernel/kernel_bench.c
+ *------------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include "pgaudit_binary.h"
+#include "pgaudit_kernel.h"
+
+/* Separates statements in a corpus file */
+#define CORPUS_SEPARATOR    "\n----\n"
+
+/*
+ * A statement from the corpus along with the classification inputs that the
+ * server would have derived from the parse tree.
+ */
+typedef struct
+{
+    const char *text;
+    size_t len;
+    LogStmtLevel logStmtLevel;
+    NodeTag commandTag;
+    const char *command;
+} BenchEvent;
+
+/*
+ * Map from leading keywords to classification inputs.  Statements that do not
+ * match are classified as MISC.
+ */
+typedef struct
+{
+    const char *prefix;
+    LogStmtLevel logStmtLevel;
+    NodeTag commandTag;
+    const char *command;
+} BenchCommand;
+
+static const BenchCommand benchCommand[] =
+{
+    {"SELECT", LOGSTMT_ALL, T_SelectStmt, "SELECT"},
+    {"WITH", LOGSTMT_ALL, T_SelectStmt, "SELECT"},
+    {"COPY", LOGSTMT_ALL, T_CopyStmt, "COPY"},
+    {"DO", LOGSTMT_ALL, T_DoStmt, "DO"},
+    {"INSERT", LOGSTMT_MOD, T_InsertStmt, "INSERT"},
+    {"UPDATE", LOGSTMT_MOD, T_UpdateStmt, "UPDATE"},
+    {"DELETE", LOGSTMT_MOD, T_DeleteStmt, "DELETE"},
+    {"EXECUTE", LOGSTMT_MOD, T_ExecuteStmt, "EXECUTE"},
+    {"CREATE USER MAPPING", LOGSTMT_DDL, T_CreateUserMappingStmt,
+     "CREATE USER MAPPING"},
+    {"ALTER USER MAPPING", LOGSTMT_DDL, T_AlterUserMappingStmt,
+     "ALTER USER MAPPING"},
+    {"CREATE SERVER", LOGSTMT_DDL, T_CreateForeignServerStmt, "CREATE SERVER"},
+    {"ALTER SERVER", LOGSTMT_DDL, T_AlterForeignServerStmt, "ALTER SERVER"},
+    {"CREATE ROLE", LOGSTMT_DDL, T_CreateRoleStmt, "CREATE ROLE"},
+    {"CREATE USER", LOGSTMT_DDL, T_CreateRoleStmt, "CREATE ROLE"},
+    {"ALTER ROLE", LOGSTMT_DDL, T_AlterRoleStmt, "ALTER ROLE"},
+    {"ALTER USER", LOGSTMT_DDL, T_AlterRoleStmt, "ALTER ROLE"},
+    {"DROP ROLE", LOGSTMT_DDL, T_DropRoleStmt, "DROP ROLE"},
+    {"GRANT", LOGSTMT_DDL, T_GrantStmt, "GRANT"},
+    {"REVOKE", LOGSTMT_DDL, T_GrantStmt, "REVOKE"},
+    {"CREATE TABLE", LOGSTMT_DDL, T_CreateStmt, "CREATE TABLE"},
+    {"ALTER TABLE", LOGSTMT_DDL, T_AlterTableStmt, "ALTER TABLE"},
+    {"DROP TABLE", LOGSTMT_DDL, T_DropStmt, "DROP TABLE"},
+    {"TRUNCATE", LOGSTMT_MOD, T_TruncateStmt, "TRUNCATE TABLE"},
+    {NULL, LOGSTMT_ALL, T_Invalid, "UNKNOWN"}
+};
+
+/* A kernel runs over one event and returns a value so it is not optimized out */
+typedef size_t (*BenchKernel) (BenchEvent *event, StringInfoData *buffer);
+
+/* Output buffer shared by the kernels, reset before each event */
+static StringInfoData benchBuffer;
+
+/* Record built by the binary event kernel before it is framed */
+static StringInfoData benchRecord;
+
+/* Fields of an entry that do not come from the corpus */
+#define BENCH_TIME          "2015-06-01 12:00:00.000 UTC"
+#define BENCH_TIME_BINARY   UINT64_C(1433160000000000)
+#define BENCH_PID           12345
+#define BENCH_PID_TEXT      "12345"
+#define BENCH_USER          "app_user"
+#define BENCH_DATABASE      "app_db"
+
+/*
+ * Quote the statement text as a CSV field.
+ */
+static size_t
+kernel_csv(BenchEvent *event, StringInfoData *buffer)
+{
+    resetStringInfo(buffer);
+    append_valid_csv(buffer, event->text);
+
+    return buffer->len;
+}
+
+/*
+ * Encode the statement text as a text in the binary file format.
+ */
+static size_t
+kernel_binary(BenchEvent *event, StringInfoData *buffer)
+{
+    resetStringInfo(buffer);
+    append_binary_text(buffer, event->text);
+
+    return buffer->len;
+}
+
+/*
+ * Classify the statement.
+ */
+static size_t
+kernel_classify(BenchEvent *event, StringInfoData *buffer)
+{
+    const char *className;
+
+    (void) buffer;
+
+    return audit_classify(event->logStmtLevel, event->commandTag,
+                          event->command, &className);
+}
+
+/*
+ * Redact the password from the statement.  In the server statements that
+ * cannot contain passwords are returned without scanning but every statement
+ * is scanned here to measure the cost of the scan.
+ */
+static size_t
+kernel_redact(BenchEvent *event, StringInfoData *buffer)
+{
+    const char *redactText = audit_redact_password(T_AlterRoleStmt,
+                                                   event->text, true);
+
+    (void) buffer;
+
+    if (redactText != event->text)
+    {
+        size_t len = strlen(redactText);
+
+        pfree((void *) redactText);
+        return len;
+    }
+
+    return 0;
+}
+
+/*
+ * Everything that log_audit_event() does with the statement that does not
+ * require server state: classify, redact passwords, and build the line that
+ * pgaudit.log_file gets in the csv format.
+ */
+static size_t
+kernel_event(BenchEvent *event, StringInfoData *buffer)
+{
+    const char *className;
+    const char *commandText = event->text;
+
+    audit_classify(event->logStmtLevel, event->commandTag, event->command,
+                   &className);
+
+    commandText = audit_redact_password(event->commandTag, commandText, true);
+
+    resetStringInfo(buffer);
+    appendStringInfoString(buffer, BENCH_TIME "," BENCH_PID_TEXT ",");
+    append_valid_csv(buffer, BENCH_USER);
+    appendStringInfoCharMacro(buffer, ',');
+    append_valid_csv(buffer, BENCH_DATABASE);
+    appendStringInfoString(buffer, ",SESSION,1,1,");
+    appendStringInfoString(buffer, className);
+    appendStringInfoCharMacro(buffer, ',');
+    append_valid_csv(buffer, event->command);
+    appendStringInfoString(buffer, ",,,");
+    append_valid_csv(buffer, commandText);
+    appendStringInfoString(buffer, ",<not logged>\n");
+
+    if (commandText != event->text)
+        pfree((void *) commandText);
+
+    return buffer->len;
+}
+
+/*
+ * The same as the event kernel but building the frame that pgaudit.log_file
+ * gets in the binary format.  The names are taken to be defined already, as
+ * they are for all but the first entry of a backend, so the class, user,
+ * database, and command are encoded as one byte ids.  The checksum is left
+ * as zero since the server computes it with pg_crc32c, which is not built
+ * here.
+ */
+static size_t
+kernel_event_binary(BenchEvent *event, StringInfoData *buffer)
+{
+    const char *className;
+    const char *commandText = event->text;
+    int class;
+
+    class = audit_classify(event->logStmtLevel, event->commandTag,
+                           event->command, &className);
+
+    commandText = audit_redact_password(event->commandTag, commandText, true);
+
+    resetStringInfo(&benchRecord);
+    appendStringInfoCharMacro(&benchRecord, AUDIT_BINARY_ENTRY);
+    append_binary_varint(&benchRecord, BENCH_PID);
+    append_binary_varint(&benchRecord, BENCH_TIME_BINARY);
+    append_binary_varint(&benchRecord, AUDIT_ENTRY_STATEMENT);
+    append_binary_varint(&benchRecord, 1);
+    append_binary_varint(&benchRecord, 1);
+    append_binary_varint(&benchRecord, (uint64) class +
+                         AUDIT_BINARY_CODE_FIRST);
+    append_binary_varint(&benchRecord, AUDIT_BINARY_CODE_FIRST +
+                         AUDIT_BINARY_CODE_TOTAL);
+    append_binary_varint(&benchRecord, AUDIT_BINARY_CODE_FIRST +
+                         AUDIT_BINARY_CODE_TOTAL + 1);
+    append_binary_varint(&benchRecord, AUDIT_BINARY_CODE_FIRST +
+                         AUDIT_BINARY_CODE_TOTAL + 2);
+    append_binary_varint(&benchRecord, AUDIT_BINARY_NAME_NULL);
+    append_binary_varint(&benchRecord, AUDIT_BINARY_NAME_NULL);
+    append_binary_text(&benchRecord, commandText);
+
+    resetStringInfo(buffer);
+    appendBinaryStringInfo(buffer, AUDIT_BINARY_SYNC, AUDIT_BINARY_SYNC_LEN);
+    append_binary_varint(buffer, (uint64) benchRecord.len);
+    appendBinaryStringInfo(buffer, benchRecord.data, benchRecord.len);
+    appendBinaryStringInfo(buffer, "\0\0\0\0", AUDIT_BINARY_CHECKSUM_LEN);
+
+    if (commandText != event->text)
+        pfree((void *) commandText);
+
+    return buffer->len;
+}
+
+static const struct
+{
+    const char *name;
+    BenchKernel kernel;
+} benchKernel[] =
+{
+    {"csv", kernel_csv},
+    {"binary", kernel_binary},
+    {"classify", kernel_classify},
+    {"redact", kernel_redact},
+    {"event", kernel_event},
+    {"event-bin", kernel_event_binary}
+};
+
+/*
+ * Return the current time in seconds.
+ */
+static double
+bench_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Load a corpus file into an array of events.  The file contents are kept
+ * for the life of the process and the events point into them.
+ */
+static BenchEvent *
+corpus_load(const char *fileName, int *eventTotal)
+{
+    FILE *file;
+    long fileSize;
+    char *text;
+    char *pChar;
+    BenchEvent *eventList;
+    int eventMax = 16;
+
+    if ((file = fopen(fileName, "rb")) == NULL ||
+        fseek(file, 0, SEEK_END) != 0 || (fileSize = ftell(file)) < 0 ||
+        fseek(file, 0, SEEK_SET) != 0)
+    {
+        fprintf(stderr, "unable to open corpus %s\n", fileName);
+        exit(1);
+    }
+
+    text = palloc(fileSize + 1);
+
+    if (fread(text, 1, fileSize, file) != (size_t) fileSize)
+    {
+        fprintf(stderr, "unable to read corpus %s\n", fileName);
+        exit(1);
+    }
+
+    text[fileSize] = '\0';
+    fclose(file);
+
+    eventList = palloc(sizeof(BenchEvent) * eventMax);
+    *eventTotal = 0;
+
+    for (pChar = text; *pChar;)
+    {
+        char *separator = strstr(pChar, CORPUS_SEPARATOR);
+        BenchEvent *event;
+        const BenchCommand *command;
+
+        /* Terminate the statement, dropping the trailing newline */
+        if (separator != NULL)
+            *separator = '\0';
+        else if (pChar[strlen(pChar) - 1] == '\n')
+            pChar[strlen(pChar) - 1] = '\0';
+
+        if (*eventTotal == eventMax)
+        {
+            eventMax *= 2;
+            eventList = repalloc(eventList, sizeof(BenchEvent) * eventMax);
+        }
+
+        event = &eventList[(*eventTotal)++];
+        event->text = pChar;
+        event->len = strlen(pChar);
+
+        /* Find the classification inputs from the leading keywords */
+        for (command = benchCommand; command->prefix != NULL; command++)
+            if (pg_strncasecmp(pChar, command->prefix,
+                               strlen(command->prefix)) == 0)
+                break;
+
+        event->logStmtLevel = command->logStmtLevel;
+        event->commandTag = command->commandTag;
+        event->command = command->command;
+
+        if (separator == NULL)
+            break;
+
+        pChar = separator + strlen(CORPUS_SEPARATOR);
+    }
+
+    return eventList;
+}
+
+int
+main(int argc, char **argv)
+{
+    double runTime = 1.0;
+    int argIdx = 1;
+
+    if (argIdx + 1 < argc && strcmp(argv[argIdx], "-t") == 0)
+    {
+        runTime = atof(argv[argIdx + 1]);
+        argIdx += 2;
+    }
+
+    if (argIdx >= argc)
+    {
+        fprintf(stderr, "usage: %s [-t seconds] corpus ...\n", argv[0]);
+        return 1;
+    }
+
+    initStringInfo(&benchBuffer);
+    initStringInfo(&benchRecord);
+
+    printf("%-24s %-10s %8s %12s %12s %12s %10s\n",
+           "corpus", "kernel", "events", "avg bytes", "out bytes",
+           "ns/event", "MB/s");
+
+    for (; argIdx < argc; argIdx++)
+    {
+        const char *corpusName = strrchr(argv[argIdx], '/');
+        BenchEvent *eventList;
+        int eventTotal;
+        size_t corpusBytes = 0;
+        size_t kernelIdx;
+        int eventIdx;
+
+        corpusName = corpusName == NULL ? argv[argIdx] : corpusName + 1;
+        eventList = corpus_load(argv[argIdx], &eventTotal);
+
+        for (eventIdx = 0; eventIdx < eventTotal; eventIdx++)
+            corpusBytes += eventList[eventIdx].len;
+
+        for (kernelIdx = 0;
+             kernelIdx < sizeof(benchKernel) / sizeof(benchKernel[0]);
+             kernelIdx++)
+        {
+            BenchKernel kernel = benchKernel[kernelIdx].kernel;
+            volatile size_t result = 0;
+            size_t outBytes = 0;
+            double timeBegin;
+            double timeElapsed;
+            long passTotal = 0;
+
+            /*
+             * Warm up caches and the allocator, and measure the output of the
+             * kernels that write to the buffer
+             */
+            for (eventIdx = 0; eventIdx < eventTotal; eventIdx++)
+            {
+                resetStringInfo(&benchBuffer);
+                result += kernel(&eventList[eventIdx], &benchBuffer);
+                outBytes += benchBuffer.len;
+            }
+
+            /* Run whole passes over the corpus until the time is up */
+            timeBegin = bench_clock();
+
+            do
+            {
+                for (eventIdx = 0; eventIdx < eventTotal; eventIdx++)
+                    result += kernel(&eventList[eventIdx], &benchBuffer);
+
+                passTotal++;
+                timeElapsed = bench_clock() - timeBegin;
+            }
+            while (timeElapsed < runTime);
+
+            printf("%-24s %-10s %8d %12.0f %12.0f %12.1f %10.1f\n",
+                   corpusName, benchKernel[kernelIdx].name, eventTotal,
+                   (double) corpusBytes / eventTotal,
+                   (double) outBytes / eventTotal,
+                   timeElapsed * 1e9 / ((double) passTotal * eventTotal),
+                   (double) corpusBytes * passTotal / timeElapsed / 1e6);
+        }
+    }
+
+    return 0;
+}
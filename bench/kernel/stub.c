@@ -0,0 +1,152 @@
+/*------------------------------------------------------------------------------
+ * stub.c
+ *
+ * Implementations of the server memory, StringInfo and string comparison
+ * routines used by the pgaudit kernels.  Memory is taken directly from malloc
+ * so allocation costs will differ somewhat from palloc in a memory context.
+ *
+ * IDENTIFICATION
+ *          contrib/pgaudit/bench/kernel/stub.c
+ *------------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <ctype.h>
+#include <stdio.h>
+
+#include "lib/stringinfo.h"
+
+void *
+palloc(size_t size)
+{
+    void *pointer = malloc(size == 0 ? 1 : size);
+
+    if (pointer == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    return pointer;
+}
+
+void *
+repalloc(void *pointer, size_t size)
+{
+    pointer = realloc(pointer, size);
+
+    if (pointer == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    return pointer;
+}
+
+void
+pfree(void *pointer)
+{
+    free(pointer);
+}
+
+char *
+pstrdup(const char *in)
+{
+    size_t len = strlen(in) + 1;
+
+    return memcpy(palloc(len), in, len);
+}
+
+unsigned char
+pg_tolower(unsigned char ch)
+{
+    if (ch >= 'A' && ch <= 'Z')
+        ch += 'a' - 'A';
+
+    return ch;
+}
+
+int
+pg_strncasecmp(const char *s1, const char *s2, size_t n)
+{
+    while (n-- > 0)
+    {
+        unsigned char ch1 = pg_tolower((unsigned char) *s1++);
+        unsigned char ch2 = pg_tolower((unsigned char) *s2++);
+
+        if (ch1 != ch2)
+            return (int) ch1 - (int) ch2;
+
+        if (ch1 == 0)
+            break;
+    }
+
+    return 0;
+}
+
+int
+pg_strcasecmp(const char *s1, const char *s2)
+{
+    return pg_strncasecmp(s1, s2, (size_t) -1);
+}
+
+void
+initStringInfo(StringInfo str)
+{
+    str->maxlen = 1024;
+    str->data = palloc(str->maxlen);
+    resetStringInfo(str);
+}
+
+void
+resetStringInfo(StringInfo str)
+{
+    str->data[0] = '\0';
+    str->len = 0;
+    str->cursor = 0;
+}
+
+void
+enlargeStringInfo(StringInfo str, int needed)
+{
+    int newlen;
+
+    needed += str->len + 1;
+
+    if (needed <= str->maxlen)
+        return;
+
+    for (newlen = 2 * str->maxlen; needed > newlen; newlen *= 2)
+        ;
+
+    str->data = repalloc(str->data, newlen);
+    str->maxlen = newlen;
+}
+
+void
+appendBinaryStringInfo(StringInfo str, const char *data, int datalen)
+{
+    enlargeStringInfo(str, datalen);
+
+    memcpy(str->data + str->len, data, datalen);
+    str->len += datalen;
+    str->data[str->len] = '\0';
+}
+
+void
+appendStringInfoString(StringInfo str, const char *s)
+{
+    appendBinaryStringInfo(str, s, strlen(s));
+}
+
+void
+appendStringInfoChar(StringInfo str, char ch)
+{
+    if (str->len + 1 >= str->maxlen)
+        enlargeStringInfo(str, 1);
+
+    str->data[str->len] = ch;
+    str->len++;
+    str->data[str->len] = '\0';
+}
@@ -0,0 +1,5 @@
+-- Burst of DDL statements
+CREATE TEMP TABLE bench_ddl (id int primary key, data text);
+CREATE INDEX bench_ddl_data_idx ON bench_ddl (data);
+ALTER TABLE bench_ddl ADD COLUMN extra int;
+DROP TABLE bench_ddl;
@@ -0,0 +1,4 @@
+-- Nested PL/pgSQL function calls that each read a relation
+\set naccounts 100000 * :scale
+\set aid random(1, :naccounts)
+SELECT bench_nested(:aid);
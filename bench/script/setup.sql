@@ -0,0 +1,47 @@
+-- Objects used by the benchmark scripts, created after pgbench -i
+
+-- Role used for object auditing
+CREATE ROLE auditor;
+
+-- 100 column table for wide selects
+DO $$
+BEGIN
+    EXECUTE 'CREATE TABLE bench_wide (id int primary key, ' ||
+            (SELECT string_agg(format('c%s text', i), ', ') FROM generate_series(1, 99) AS i) || ')';
+
+    EXECUTE 'INSERT INTO bench_wide SELECT id, ' ||
+            (SELECT string_agg(format('md5((id + %s)::text)', i), ', ') FROM generate_series(1, 99) AS i) ||
+            ' FROM generate_series(1, 10000) AS id';
+END $$;
+
+-- 500 column table for inserts with many parameters
+DO $$
+BEGIN
+    EXECUTE 'CREATE UNLOGGED TABLE bench_param (' ||
+            (SELECT string_agg(format('p%s int', i), ', ') FROM generate_series(1, 500) AS i) || ')';
+END $$;
+
+-- Nested functions, each level reads pgbench_accounts before calling the next
+CREATE FUNCTION bench_level(aid int, depth int) RETURNS int
+LANGUAGE plpgsql AS $$
+DECLARE
+    balance int;
+BEGIN
+    SELECT abalance INTO balance FROM pgbench_accounts WHERE pgbench_accounts.aid = bench_level.aid;
+
+    IF depth > 1 THEN
+        balance := balance + bench_level(aid, depth - 1);
+    END IF;
+
+    RETURN balance;
+END $$;
+
+CREATE FUNCTION bench_nested(aid int) RETURNS int
+LANGUAGE plpgsql AS $$
+BEGIN
+    RETURN bench_level(aid, 5);
+END $$;
+
+-- Grants that drive object auditing when pgaudit.role = auditor
+GRANT SELECT, INSERT, UPDATE ON pgbench_accounts, pgbench_branches, pgbench_tellers, pgbench_history,
+                                bench_wide, bench_param TO auditor;
@@ -0,0 +1,3 @@
+-- Select every column of a 100 column table
+\set id random(1, 10000)
+SELECT * FROM bench_wide WHERE id = :id;
@@ -0,0 +1,118 @@
+/* pgaudit/pgaudit--1.0--1.1.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pgaudit UPDATE TO '1.1'" to load this file.\quit
+
+CREATE FUNCTION pgaudit_stat_class
+(
+	OUT class text,
+	OUT session_events int8,
+	OUT object_events int8,
+	OUT suppressed_events int8,
+	OUT bytes int8,
+	OUT stats_reset timestamptz
+)
+	RETURNS SETOF record
+	LANGUAGE C STRICT VOLATILE
+	AS 'MODULE_PATHNAME', 'pgaudit_stat_class';
+
+CREATE VIEW pg_stat_audit AS
+	SELECT * FROM pgaudit_stat_class();
+
+CREATE FUNCTION pgaudit_stat_hook
+(
+	OUT hook text,
+	OUT calls int8,
+	OUT stack_pushes int8,
+	OUT acl_checks int8,
+	OUT cache_hits int8,
+	OUT cache_misses int8,
+	OUT total_time float8
+)
+	RETURNS SETOF record
+	LANGUAGE C STRICT VOLATILE
+	AS 'MODULE_PATHNAME', 'pgaudit_stat_hook';
+
+CREATE VIEW pg_stat_audit_hook AS
+	SELECT * FROM pgaudit_stat_hook();
+
+CREATE FUNCTION pgaudit_stat_hook_histogram
+(
+	OUT hook text,
+	OUT bucket_min float8,
+	OUT bucket_max float8,
+	OUT calls int8
+)
+	RETURNS SETOF record
+	LANGUAGE C STRICT VOLATILE
+	AS 'MODULE_PATHNAME', 'pgaudit_stat_hook_histogram';
+
+CREATE VIEW pg_stat_audit_hook_histogram AS
+	SELECT * FROM pgaudit_stat_hook_histogram();
+
+CREATE FUNCTION pgaudit_stat_reset()
+	RETURNS void
+	LANGUAGE C STRICT VOLATILE
+	AS 'MODULE_PATHNAME', 'pgaudit_stat_reset';
+
+-- Don't want this to be available to non-superusers
+REVOKE ALL ON FUNCTION pgaudit_stat_reset() FROM PUBLIC;
+
+CREATE FUNCTION pgaudit_recent
+(
+	pid_filter int4 DEFAULT NULL,
+	role_filter text DEFAULT NULL,
+	object_filter text DEFAULT NULL,
+	OUT event_id int8,
+	OUT log_time timestamptz,
+	OUT pid int4,
+	OUT role_name text,
+	OUT database_name text,
+	OUT audit_type text,
+	OUT statement_id int8,
+	OUT substatement_id int8,
+	OUT class text,
+	OUT command text,
+	OUT object_type text,
+	OUT object_name text,
+	OUT statement text,
+	OUT parameter text,
+	OUT entry text,
+	OUT truncated bool
+)
+	RETURNS SETOF record
+	LANGUAGE C VOLATILE
+	AS 'MODULE_PATHNAME', 'pgaudit_recent';
+
+-- Recent entries include statements from all sessions
+REVOKE ALL ON FUNCTION pgaudit_recent(int4, text, text) FROM PUBLIC;
+
+CREATE FUNCTION pgaudit_stat_top_object
+(
+	OUT database_name text,
+	OUT role_name text,
+	OUT object_oid oid,
+	OUT object_type text,
+	OUT object_name text,
+	OUT command text,
+	OUT accesses int8,
+	OUT stats_reset timestamptz
+)
+	RETURNS SETOF record
+	LANGUAGE C STRICT VOLATILE
+	AS 'MODULE_PATHNAME', 'pgaudit_stat_top_object';
+
+CREATE VIEW pg_stat_audit_top_object AS
+	SELECT * FROM pgaudit_stat_top_object();
+
+-- Top objects show which roles access which objects in all databases
+REVOKE ALL ON FUNCTION pgaudit_stat_top_object() FROM PUBLIC;
+REVOKE ALL ON pg_stat_audit_top_object FROM PUBLIC;
+
+CREATE FUNCTION pgaudit_stat_top_object_reset()
+	RETURNS void
+	LANGUAGE C STRICT VOLATILE
+	AS 'MODULE_PATHNAME', 'pgaudit_stat_top_object_reset';
+
+-- Don't want this to be available to non-superusers
+REVOKE ALL ON FUNCTION pgaudit_stat_top_object_reset() FROM PUBLIC;
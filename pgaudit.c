@@ -13,7 +13,20 @@
  */
 #include "postgres.h"
 
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "access/hash.h"
 #include "access/htup_details.h"
+#include "access/parallel.h"
 #include "access/sysattr.h"
 #include "access/xact.h"
 #include "catalog/catalog.h"
@@ -22,79 +35,136 @@
 #include "catalog/namespace.h"
 #include "commands/dbcommands.h"
 #include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
 #include "commands/event_trigger.h"
 #include "executor/executor.h"
 #include "executor/spi.h"
+#include "funcapi.h"
 #include "miscadmin.h"
 #include "libpq/auth.h"
+#include "libpq/libpq-be.h"
 #include "nodes/nodes.h"
+#include "parser/parser.h"
+#include "parser/scansup.h"
+#include "pgtime.h"
+#include "port/atomics.h"
+#include "port/pg_crc32c.h"
+#include "portability/instr_time.h"
+#include "postmaster/syslogger.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
 #include "tcop/utility.h"
 #include "tcop/deparse_utility.h"
 #include "utils/acl.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
 #include "utils/syscache.h"
 #include "utils/timestamp.h"
 
+#include "pgaudit_binary.h"
+#include "pgaudit_kernel.h"
+
+/* IsParallelWorker() was added after parallel workers */
+#ifndef IsParallelWorker
+#define IsParallelWorker()      (ParallelWorkerNumber >= 0)
+#endif
+
 PG_MODULE_MAGIC;
 
 void _PG_init(void);
 
 PG_FUNCTION_INFO_V1(pgaudit_ddl_command_end);
+PG_FUNCTION_INFO_V1(pgaudit_recent);
 PG_FUNCTION_INFO_V1(pgaudit_sql_drop);
+PG_FUNCTION_INFO_V1(pgaudit_stat_class);
+PG_FUNCTION_INFO_V1(pgaudit_stat_hook);
+PG_FUNCTION_INFO_V1(pgaudit_stat_hook_histogram);
+PG_FUNCTION_INFO_V1(pgaudit_stat_reset);
+PG_FUNCTION_INFO_V1(pgaudit_stat_top_object);
+PG_FUNCTION_INFO_V1(pgaudit_stat_top_object_reset);
+
+/* GUC variable for pgaudit.log, which defines the classes to log. */
+char *auditLog = NULL;
+
+/*
+ * Bitmap of classes selected.  The classes are defined in pgaudit_kernel.h.
+ */
+static int auditLogBitmap = LOG_NONE;
 
 /*
- * Log Classes
+ * GUC variable for pgaudit.log_catalog
  *
- * pgAudit categorizes actions into classes (eg: DDL, FUNCTION calls, READ
- * queries, WRITE queries).  A GUC is provided for the administrator to
- * configure which class (or classes) of actions to include in the
- * audit log.  We track the currently active set of classes using
- * auditLogBitmap.
+ * Administrators can choose to NOT log queries when all relations used in
+ * the query are in pg_catalog.  Interactive sessions (eg: psql) can cause
+ * a lot of noise in the logs which might be uninteresting.
  */
+bool auditLogCatalog = true;
 
-/* Bits within auditLogBitmap, defines the classes we understand */
-#define LOG_DDL         (1 << 0)    /* CREATE/DROP/ALTER objects */
-#define LOG_FUNCTION    (1 << 1)    /* Functions and DO blocks */
-#define LOG_MISC        (1 << 2)    /* Statements not covered */
-#define LOG_READ        (1 << 3)    /* SELECTs */
-#define LOG_ROLE        (1 << 4)    /* GRANT/REVOKE, CREATE/ALTER/DROP ROLE */
-#define LOG_WRITE       (1 << 5)    /* INSERT, UPDATE, DELETE, TRUNCATE */
+/*
+ * GUC variables for pgaudit.log_destination and pgaudit.log_file
+ *
+ * Administrators can choose to keep audit entries out of the server log,
+ * which shares log_destination with everything else.  Entries are still
+ * reported with ereport() but an emit_log_hook diverts them to a dedicated
+ * file or to the recent entries buffer only.  Errors raised by audited
+ * statements stay in the server log and are tagged with the statement ID so
+ * they can be linked to the entries.
+ */
+#define AUDIT_DESTINATION_SERVER    0
+#define AUDIT_DESTINATION_FILE      1
+#define AUDIT_DESTINATION_BUFFER    2
 
-#define LOG_NONE        0               /* nothing */
-#define LOG_ALL         (0xFFFFFFFF)    /* All */
+char *auditLogDestinationString = NULL;
+int auditLogDestination = AUDIT_DESTINATION_SERVER;
+char *auditLogFile = NULL;
 
-/* GUC variable for pgaudit.log, which defines the classes to log. */
-char *auditLog = NULL;
+/*
+ * GUC variable for pgaudit.log_file_format
+ *
+ * Administrators can choose to write pgaudit.log_file in a compact binary
+ * format rather than CSV for high volume databases.  Entries are encoded
+ * without quoting, with commands, object types, and names replaced by ids, so
+ * they take less time to write and less space.  The file is turned back into
+ * CSV or JSON with pgaudit_decode.  See pgaudit_binary.h for the format.
+ */
+#define AUDIT_FILE_FORMAT_CSV       0
+#define AUDIT_FILE_FORMAT_BINARY    1
 
-/* Bitmap of classes selected */
-static int auditLogBitmap = LOG_NONE;
+char *auditLogFileFormatString = NULL;
+int auditLogFileFormat = AUDIT_FILE_FORMAT_CSV;
 
 /*
- * String constants for log classes - used when processing tokens in the
- * pgaudit.log GUC.
+ * GUC variable for pgaudit.log_file_compression
+ *
+ * Administrators can choose to compress pgaudit.log_file with zstd when the
+ * file is kept for a long time.  Each process compresses its entries into a
+ * zstd frame of its own that is written in a single append, so frames from
+ * different processes do not interleave and a crash loses at most the frame
+ * being filled.  Only available when pgaudit is built with USE_ZSTD.
  */
-#define CLASS_DDL       "DDL"
-#define CLASS_FUNCTION  "FUNCTION"
-#define CLASS_MISC      "MISC"
-#define CLASS_READ      "READ"
-#define CLASS_ROLE      "ROLE"
-#define CLASS_WRITE     "WRITE"
+#define AUDIT_COMPRESSION_NONE      0
+#define AUDIT_COMPRESSION_ZSTD      1
 
-#define CLASS_NONE      "NONE"
-#define CLASS_ALL       "ALL"
+char *auditLogFileCompressionString = NULL;
+int auditLogFileCompression = AUDIT_COMPRESSION_NONE;
 
 /*
- * GUC variable for pgaudit.log_catalog
+ * GUC variable for pgaudit.log_duration
  *
- * Administrators can choose to NOT log queries when all relations used in
- * the query are in pg_catalog.  Interactive sessions (eg: psql) can cause
- * a lot of noise in the logs which might be uninteresting.
+ * Administrators can choose to log the time taken by the statement, in
+ * milliseconds, as the last field of each entry.  Entries are then logged
+ * when the statement completes rather than when it starts, see
+ * log_audit_complete().
  */
-bool auditLogCatalog = true;
+bool auditLogDuration = false;
 
 /*
  * GUC variable for pgaudit.log_level
@@ -106,6 +176,34 @@ bool auditLogCatalog = true;
 char *auditLogLevelString = NULL;
 int auditLogLevel = LOG;
 
+/*
+ * GUC variables for pgaudit.log_min_rows and pgaudit.log_min_rows_relation
+ *
+ * Administrators can choose to log READ and WRITE session entries only for
+ * statements that retrieve or affect at least this many rows, e.g. to catch
+ * bulk reads without logging every single row lookup.  The threshold can be
+ * overridden for individual relations with a list of relation=rows pairs.  A
+ * statement uses the lowest threshold of its relations.  OBJECT entries are
+ * always logged.
+ */
+int auditLogMinRows = 0;
+char *auditLogMinRowsRelationString = NULL;
+
+typedef struct AuditMinRowsRelation
+{
+    char schemaName[NAMEDATALEN];   /* Empty to match any schema */
+    char relationName[NAMEDATALEN];
+    int minRows;
+} AuditMinRowsRelation;
+
+typedef struct AuditMinRowsRelationList
+{
+    int total;
+    AuditMinRowsRelation relation[FLEXIBLE_ARRAY_MEMBER];
+} AuditMinRowsRelationList;
+
+static AuditMinRowsRelationList *auditLogMinRowsRelation = NULL;
+
 /*
  * GUC variable for pgaudit.log_parameter
  *
@@ -123,6 +221,15 @@ bool auditLogParameter = false;
  */
 bool auditLogRelation = false;
 
+/*
+ * GUC variable for pgaudit.log_rows
+ *
+ * Administrators can choose to log the number of rows retrieved or affected
+ * by the statement.  As with pgaudit.log_duration, entries are then logged
+ * when the statement completes.
+ */
+bool auditLogRows = false;
+
 /*
  * GUC variable for pgaudit.log_statement_once
  *
@@ -142,10 +249,58 @@ bool auditLogStatementOnce = false;
  */
 char *auditRole = NULL;
 
+/*
+ * GUC variable for pgaudit.track_timing
+ *
+ * Administrators can choose to measure the time spent in each pgaudit hook.
+ * The total time and a latency histogram are reported in the
+ * pg_stat_audit_hook and pg_stat_audit_hook_histogram views.  This requires
+ * reading the clock on entry and exit of each hook so it is off by default.
+ */
+bool auditTrackTiming = false;
+
+/*
+ * GUC variable for pgaudit.buffer_size
+ *
+ * Administrators can choose to keep the most recent entries in a shared
+ * memory ring buffer that can be queried with pgaudit_recent(), e.g. to see
+ * what a session did in the last minute without waiting for the log to be
+ * processed.  The buffer is sized at server start and is disabled by default.
+ */
+int auditBufferSize = 0;
+
+/*
+ * GUC variable for pgaudit.buffer_defer_format
+ *
+ * Administrators can choose, when entries only go to the recent entries buffer,
+ * to copy parameters of simple built-in types (numbers, text, bytea, uuid)
+ * into the buffer as they are rather than calling the type output functions
+ * while the statement runs.  They are
+ * formatted by pgaudit_recent() when the entry is read, so the cost moves from
+ * the audited session to the one reading the buffer.
+ */
+bool auditBufferDeferFormat = false;
+
+/*
+ * GUC variable for pgaudit.top_objects
+ *
+ * Administrators can choose to count accesses to relations and functions by
+ * role and command and report the most accessed in the
+ * pg_stat_audit_top_object view.  The counts are kept in fixed size shared
+ * memory whatever the number of objects and roles, so they are estimates.
+ * This is the number of objects to report and is zero (disabled) by default.
+ */
+int auditTopObjects = 0;
+
 /*
  * String constants for the audit log fields.
  */
 
+/*
+ * Prefix of every audit log message
+ */
+#define AUDIT_PREFIX        "AUDIT: "
+
 /*
  * Audit type, which is responsbile for the log message
  */
@@ -195,24 +350,13 @@ char *auditRole = NULL;
 #define OBJECT_TYPE_UNKNOWN         "UNKNOWN"
 
 /*
- * String constants for testing role commands.  Rename and drop role statements
- * are assigned the nodeTag T_RenameStmt and T_DropStmt respectively.  This is
- * not very useful for classification, so we resort to comparing strings
- * against the result of CreateCommandTag(parsetree).
+ * String constants for testing grant commands.  Both GRANT and REVOKE are
+ * assigned the nodeTag T_GrantStmt so we compare strings against the result
+ * of CreateCommandTag(parsetree).
  */
-#define COMMAND_ALTER_ROLE          "ALTER ROLE"
-#define COMMAND_DROP_ROLE           "DROP ROLE"
 #define COMMAND_GRANT               "GRANT"
 #define COMMAND_REVOKE              "REVOKE"
 
-
-/*
- * String constants used for redacting text after the password token in
- * CREATE/ALTER ROLE commands.
- */
-#define TOKEN_PASSWORD             "password"
-#define TOKEN_REDACTED             "<REDACTED>"
-
 /*
  * An AuditEvent represents an operation that potentially affects a single
  * object.  If a statement affects multiple objects then multiple AuditEvents
@@ -232,6 +376,12 @@ typedef struct
     char *objectName;           /* Fully qualified object identification */
     const char *commandText;    /* sourceText / queryString */
     ParamListInfo paramList;    /* QueryDesc/ProcessUtility parameters */
+    char *paramText;            /* paramList formatted for the log, built
+                                   once and reused by every log entry */
+    char *paramData;            /* Or paramList copied for the buffer */
+    int paramDataLen;
+    uint64 rows;                /* Rows processed, set on completion */
+    uint64 timeStart;           /* Clock when the statement started */
 
     bool granted;               /* Audit role has object permissions? */
     bool logged;                /* Track if we have logged this event, used
@@ -250,12 +400,76 @@ typedef struct AuditEventStackItem
 
     int64 stackId;
 
+    /*
+     * Entries are deferred to statement completion when rows or duration are
+     * logged.  The settings are captured when the statement starts so all
+     * entries for the statement have the same fields.
+     */
+    bool logDefer;              /* Entries wait for statement completion */
+    bool logRows;               /* pgaudit.log_rows at statement start */
+    bool logDuration;           /* pgaudit.log_duration at statement start */
+    int logMinRows;             /* Row threshold for READ/WRITE entries */
+    List *logDeferred;          /* AuditDeferredEntry list */
+    MemoryContext contextDeferred;  /* Holds logDeferred, see stack_fail() */
+
     MemoryContext contextAudit;
     MemoryContextCallback contextCallback;
 } AuditEventStackItem;
 
 AuditEventStackItem *auditEventStack = NULL;
 
+/*
+ * The fields of a log entry.  They are kept apart until the entry is written
+ * so it can be formatted as CSV or encoded in the binary file format.  Flags
+ * are the AUDIT_ENTRY_* values from pgaudit_binary.h.
+ */
+typedef struct AuditEntry
+{
+    int flags;
+    int64 statementId;
+    int64 substatementId;
+    const char *className;
+    const char *command;
+    const char *objectType;
+    const char *objectName;
+    const char *commandText;    /* With AUDIT_ENTRY_STATEMENT */
+    const char *paramText;      /* With AUDIT_ENTRY_PARAMETER */
+    const char *paramData;      /* Instead of paramText, see
+                                   buffer_param_copy() */
+    int paramDataLen;
+    uint64 rows;                /* With AUDIT_ENTRY_ROWS_KNOWN */
+    uint64 duration;            /* Nanoseconds, with
+                                   AUDIT_ENTRY_DURATION_KNOWN */
+} AuditEntry;
+
+/*
+ * An entry that is waiting for the statement to complete.  Statistics are
+ * updated when it is emitted or filtered.
+ */
+typedef struct AuditDeferredEntry
+{
+    AuditEntry entry;           /* Entry without rows and duration */
+    int classIdx;               /* Statistics index of the class */
+    bool filterRows;            /* Subject to the row threshold */
+} AuditDeferredEntry;
+
+/*
+ * Deferred entries of a statement that did not complete, e.g. because it
+ * raised an error.  They are kept in the context they were deferred in, which
+ * outlives the stack item, until log_audit_failed() logs them.
+ */
+typedef struct AuditFailed
+{
+    struct AuditFailed *next;
+    MemoryContext contextDeferred;
+    List *logDeferred;          /* AuditDeferredEntry list */
+    int flags;                  /* Rows and duration fields */
+    uint64 duration;
+} AuditFailed;
+
+static AuditFailed *auditFailed = NULL;
+static AuditFailed **auditFailedTail = &auditFailed;
+
 /*
  * pgAudit runs queries of its own when using the event trigger system.
  *
@@ -274,346 +488,2223 @@ static int64 stackTotal = 0;
 static bool statementLogged = false;
 
 /*
- * Stack functions
+ * Statistics
  *
- * Audit events can go down to multiple levels so a stack is maintained to keep
- * track of them.
+ * Counters are kept in shared memory so administrators can see what pgAudit
+ * is logging and what it costs without having to parse the logs.  They are
+ * exposed through the pg_stat_audit and pg_stat_audit_hook views.  Counters
+ * are updated with atomic operations so no locks are taken on the hot path.
  */
 
+/* Number of log classes, in the same order as the LOG_* bits */
+#define AUDIT_CLASS_TOTAL           6
+
+/* Index of each audit type in the event counters */
+#define AUDIT_TYPE_INDEX_SESSION    0
+#define AUDIT_TYPE_INDEX_OBJECT     1
+#define AUDIT_TYPE_TOTAL            2
+
+static const char *const auditClassName[AUDIT_CLASS_TOTAL] =
+{
+    CLASS_DDL,
+    CLASS_FUNCTION,
+    CLASS_MISC,
+    CLASS_READ,
+    CLASS_ROLE,
+    CLASS_WRITE
+};
+
+/* Hooks that statistics are collected for */
+typedef enum AuditHook
+{
+    AUDIT_HOOK_EXECUTOR_START,
+    AUDIT_HOOK_EXECUTOR_CHECK_PERMS,
+    AUDIT_HOOK_EXECUTOR_END,
+    AUDIT_HOOK_PROCESS_UTILITY,
+    AUDIT_HOOK_OBJECT_ACCESS,
+    AUDIT_HOOK_LOG_AUDIT_EVENT,     /* Not a hook, but timed like one */
+    AUDIT_HOOK_TOTAL
+} AuditHook;
+
+static const char *const auditHookName[AUDIT_HOOK_TOTAL] =
+{
+    "executor_start",
+    "executor_check_perms",
+    "executor_end",
+    "process_utility",
+    "object_access",
+    "log_audit_event"
+};
+
 /*
- * Respond to callbacks registered with MemoryContextRegisterResetCallback().
- * Removes the event(s) off the stack that have become obsolete once the
- * MemoryContext has been freed.  The callback should always be freeing the top
- * of the stack, but the code is tolerant of out-of-order callbacks.
+ * Hook latency histograms have log2 buckets of nanoseconds, i.e. bucket n
+ * counts calls that took [2^n, 2^(n+1)) nanoseconds.  The last bucket also
+ * counts everything slower.
  */
-static void
-stack_free(void *stackFree)
+#define AUDIT_HISTOGRAM_TOTAL       32
+
+/* Counters for each log class */
+typedef struct AuditStatClass
 {
-    AuditEventStackItem *nextItem = auditEventStack;
+    pg_atomic_uint64 events[AUDIT_TYPE_TOTAL];  /* Entries logged */
+    pg_atomic_uint64 suppressed;    /* Entries not logged due to pgaudit.log */
+    pg_atomic_uint64 bytes;         /* Size of the logged messages */
+} AuditStatClass;
 
-    /* Only process if the stack contains items */
-    while (nextItem != NULL)
-    {
-        /* Check if this item matches the item to be freed */
-        if (nextItem == (AuditEventStackItem *) stackFree)
-        {
-            /* Move top of stack to the item after the freed item */
-            auditEventStack = nextItem->next;
+/* Counters for each hook */
+typedef struct AuditStatHook
+{
+    pg_atomic_uint64 calls;         /* Times the hook was called */
+    pg_atomic_uint64 stackPushes;   /* Items pushed onto the audit stack */
+    pg_atomic_uint64 aclChecks;     /* Object audit ACL checks performed */
+    pg_atomic_uint64 cacheHits;     /* Plan cache lookups that were used */
+    pg_atomic_uint64 cacheMisses;   /* Plan cache lookups that were not */
+    pg_atomic_uint64 time;          /* Time spent in pgaudit (nanoseconds) */
+    pg_atomic_uint64 histogram[AUDIT_HISTOGRAM_TOTAL];
+} AuditStatHook;
+
+/* Shared memory state */
+typedef struct AuditSharedState
+{
+    AuditStatClass statClass[AUDIT_CLASS_TOTAL];
+    AuditStatHook statHook[AUDIT_HOOK_TOTAL];
+    pg_atomic_uint64 statReset;     /* TimestampTz of the last reset */
+    pg_atomic_uint32 fileEpoch;     /* Truncations of the binary file seen */
+} AuditSharedState;
 
-            /* If the stack is not empty */
-            if (auditEventStack == NULL)
-            {
-                /*
-                 * Reset internal statement to false.  Normally this will be
-                 * reset but in case of an error it might be left set.
-                 */
-                internalStatement = false;
+static AuditSharedState *auditSharedState = NULL;
 
-                /*
-                 * Reset sub statement total so the next statement will start
-                 * from 1.
-                 */
-                substatementTotal = 0;
+/*
+ * Add to a shared memory counter.  Shared memory is always available since
+ * pgaudit must be loaded with shared_preload_libraries, but check anyway in
+ * case a hook is called before shared memory has been attached.
+ */
+#define stat_add(counter, value)                                            \
+    do                                                                      \
+    {                                                                       \
+        if (auditSharedState != NULL)                                       \
+            pg_atomic_fetch_add_u64(&auditSharedState->counter, value);     \
+    } while (0)
 
-                /*
-                 * Reset statement logged so that next statement will be
-                 * logged.
-                 */
-                statementLogged = false;
-            }
+/*
+ * Hook timings are accumulated in backend-local memory and merged into shared
+ * memory after AUDIT_STAT_FLUSH_TOTAL timings, when the backend exits, or
+ * when the statistics are read.  This keeps the atomic operations (and the
+ * cache line contention they cause) off the hot path.
+ */
+#define AUDIT_STAT_FLUSH_TOTAL      128
 
-            return;
-        }
+typedef struct AuditStatLocal
+{
+    uint64 time[AUDIT_HOOK_TOTAL];
+    uint64 histogram[AUDIT_HOOK_TOTAL][AUDIT_HISTOGRAM_TOTAL];
+    int total;                      /* Timings since the last flush */
+} AuditStatLocal;
 
-        nextItem = nextItem->next;
-    }
-}
+static AuditStatLocal auditStatLocal;
+static bool auditStatLocalExitRegistered = false;
 
 /*
- * Push a new audit event onto the stack and create a new memory context to
- * store it.
+ * Time spent in a hook.  Hooks that call the next hook in the chain pause the
+ * timing while it runs so only time spent in pgaudit is measured.
  */
-static AuditEventStackItem *
-stack_push()
+typedef struct AuditTiming
 {
-    MemoryContext contextAudit;
-    MemoryContext contextOld;
-    AuditEventStackItem *stackItem;
+    bool enabled;                   /* pgaudit.track_timing when started */
+    uint64 start;                   /* Clock when started or resumed */
+    uint64 total;                   /* Time accumulated before last pause */
+} AuditTiming;
 
-    /*
-     * Create a new memory context to contain the stack item.  This will be
-     * free'd on stack_pop, or by our callback when the parent context is
-     * destroyed.
-     */
-    contextAudit = AllocSetContextCreate(CurrentMemoryContext,
-                                         "pgaudit stack context",
-                                         ALLOCSET_DEFAULT_MINSIZE,
-                                         ALLOCSET_DEFAULT_INITSIZE,
-                                         ALLOCSET_DEFAULT_MAXSIZE);
+/*
+ * Read a monotonic clock in nanoseconds.
+ *
+ * CLOCK_MONOTONIC is read through the vDSO on Linux and costs tens of
+ * nanoseconds.  CLOCK_MONOTONIC_COARSE is cheaper but only advances once per
+ * scheduler tick (1-4ms), which would put nearly every hook call in the first
+ * bucket.  Fall back to the instr_time clock where CLOCK_MONOTONIC is not
+ * available.
+ */
+static inline uint64
+stat_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec clockTime;
 
-    /* Save the old context to switch back to at the end */
-    contextOld = MemoryContextSwitchTo(contextAudit);
+    clock_gettime(CLOCK_MONOTONIC, &clockTime);
 
-    /* Create our new stack item in our context */
-    stackItem = palloc0(sizeof(AuditEventStackItem));
-    stackItem->contextAudit = contextAudit;
-    stackItem->stackId = ++stackTotal;
+    return (uint64) clockTime.tv_sec * 1000000000 + clockTime.tv_nsec;
+#else
+    instr_time clockTime;
 
-    /*
-     * Setup a callback in case an error happens.  stack_free() will truncate
-     * the stack at this item.
-     */
-    stackItem->contextCallback.func = stack_free;
-    stackItem->contextCallback.arg = (void *) stackItem;
-    MemoryContextRegisterResetCallback(contextAudit,
-                                       &stackItem->contextCallback);
+    INSTR_TIME_SET_CURRENT(clockTime);
 
-    /* Push new item onto the stack */
-    if (auditEventStack != NULL)
-        stackItem->next = auditEventStack;
-    else
-        stackItem->next = NULL;
+    return INSTR_TIME_GET_MICROSEC(clockTime) * 1000;
+#endif
+}
 
-    auditEventStack = stackItem;
+/*
+ * Merge backend-local timings into shared memory.
+ */
+static void
+stat_flush_local(void)
+{
+    int hookIdx;
+    int bucketIdx;
 
-    MemoryContextSwitchTo(contextOld);
+    if (auditStatLocal.total == 0 || auditSharedState == NULL)
+        return;
 
-    return stackItem;
+    for (hookIdx = 0; hookIdx < AUDIT_HOOK_TOTAL; hookIdx++)
+    {
+        if (auditStatLocal.time[hookIdx] != 0)
+            stat_add(statHook[hookIdx].time, auditStatLocal.time[hookIdx]);
+
+        for (bucketIdx = 0; bucketIdx < AUDIT_HISTOGRAM_TOTAL; bucketIdx++)
+        {
+            if (auditStatLocal.histogram[hookIdx][bucketIdx] != 0)
+                stat_add(statHook[hookIdx].histogram[bucketIdx],
+                         auditStatLocal.histogram[hookIdx][bucketIdx]);
+        }
+    }
+
+    memset(&auditStatLocal, 0, sizeof(auditStatLocal));
 }
 
 /*
- * Pop an audit event from the stack by deleting the memory context that
- * contains it.  The callback to stack_free() does the actual pop.
+ * Merge backend-local timings into shared memory when the backend exits.
  */
 static void
-stack_pop(int64 stackId)
+stat_flush_local_exit(int code, Datum arg)
 {
-    /* Make sure what we want to delete is at the top of the stack */
-    if (auditEventStack != NULL && auditEventStack->stackId == stackId)
-        MemoryContextDelete(auditEventStack->contextAudit);
-    else
-        elog(ERROR, "pgaudit stack item " INT64_FORMAT " not found on top - cannot pop",
-             stackId);
+    stat_flush_local();
 }
 
 /*
- * Check that an item is on the stack.  If not, an error will be raised since
- * this is a bad state to be in and it might mean audit records are being lost.
+ * Start timing a hook, if pgaudit.track_timing is enabled.
  */
 static void
-stack_valid(int64 stackId)
+stat_timing_start(AuditTiming *timing)
 {
-    AuditEventStackItem *nextItem = auditEventStack;
+    timing->enabled = auditTrackTiming;
+    timing->total = 0;
 
-    /* Look through the stack for the stack entry */
-    while (nextItem != NULL && nextItem->stackId != stackId)
-        nextItem = nextItem->next;
+    if (timing->enabled)
+        timing->start = stat_clock();
+}
 
-    /* If we didn't find it, something went wrong. */
-    if (nextItem == NULL)
-        elog(ERROR, "pgaudit stack item " INT64_FORMAT
-             " not found - top of stack is " INT64_FORMAT "",
-             stackId,
-             auditEventStack == NULL ? (int64) -1 : auditEventStack->stackId);
+/*
+ * Pause timing while control is outside of pgaudit.
+ */
+static void
+stat_timing_pause(AuditTiming *timing)
+{
+    if (timing->enabled)
+        timing->total += stat_clock() - timing->start;
 }
 
 /*
- * Appends a properly quoted CSV field to StringInfo.
+ * Resume timing when control returns to pgaudit.
  */
 static void
-append_valid_csv(StringInfoData *buffer, const char *appendStr)
+stat_timing_resume(AuditTiming *timing)
 {
-    const char *pChar;
+    if (timing->enabled)
+        timing->start = stat_clock();
+}
 
-    /*
-     * If the append string is null then do nothing.  NULL fields are not
-     * quoted in CSV.
-     */
-    if (appendStr == NULL)
+/*
+ * Stop timing a hook and add the time to the backend-local total and
+ * histogram for the hook.
+ */
+static void
+stat_timing_end(AuditHook hook, AuditTiming *timing)
+{
+    int bucketIdx = 0;
+
+    if (!timing->enabled)
         return;
 
-    /* Only format for CSV if appendStr contains: ", comma, \n, \r */
-    if (strstr(appendStr, ",") || strstr(appendStr, "\"") ||
-        strstr(appendStr, "\n") || strstr(appendStr, "\r"))
-    {
-        appendStringInfoCharMacro(buffer, '"');
+    stat_timing_pause(timing);
 
-        for (pChar = appendStr; *pChar; pChar++)
-        {
-            if (*pChar == '"')    /* double single quotes */
-                appendStringInfoCharMacro(buffer, *pChar);
+    /* Find the histogram bucket */
+    while (bucketIdx < AUDIT_HISTOGRAM_TOTAL - 1 &&
+           (timing->total >> (bucketIdx + 1)) != 0)
+        bucketIdx++;
 
-            appendStringInfoCharMacro(buffer, *pChar);
-        }
+    auditStatLocal.time[hook] += timing->total;
+    auditStatLocal.histogram[hook][bucketIdx]++;
 
-        appendStringInfoCharMacro(buffer, '"');
+    /* Make sure timings are not lost when the backend exits */
+    if (!auditStatLocalExitRegistered)
+    {
+        before_shmem_exit(stat_flush_local_exit, (Datum) 0);
+        auditStatLocalExitRegistered = true;
     }
-    /* Else just append */
+
+    if (++auditStatLocal.total >= AUDIT_STAT_FLUSH_TOTAL)
+        stat_flush_local();
+}
+
+/*
+ * Initialize a counter when shared memory is created, else reset it.
+ */
+static void
+stat_counter_reset(pg_atomic_uint64 *counter, bool init)
+{
+    if (init)
+        pg_atomic_init_u64(counter, 0);
     else
-        appendStringInfoString(buffer, appendStr);
+        pg_atomic_write_u64(counter, 0);
 }
 
 /*
- * Takes an AuditEvent, classifies it, then logs it if appropriate.
- *
- * Logging is decided based on if the statement is in one of the classes being
- * logged or if an object used has been marked for auditing.
- *
- * Objects are marked for auditing by the auditor role being granted access
- * to the object.  The kind of access (INSERT, UPDATE, etc) is also considered
- * and logging is only performed when the kind of access matches the granted
- * right on the object.
- *
- * This will need to be updated if new kinds of GRANTs are added.
+ * Initialize or reset all statistics counters.
  */
 static void
-log_audit_event(AuditEventStackItem *stackItem)
+stat_reset(bool init)
 {
-    /* By default, put everything in the MISC class. */
-    int class = LOG_MISC;
-    const char *className = CLASS_MISC;
-    MemoryContext contextOld;
-    StringInfoData auditStr;
+    int classIdx;
+    int typeIdx;
+    int hookIdx;
+    int bucketIdx;
 
-    /* If this event has already been logged don't log it again */
-    if (stackItem->auditEvent.logged)
-        return;
+    for (classIdx = 0; classIdx < AUDIT_CLASS_TOTAL; classIdx++)
+    {
+        AuditStatClass *statClass = &auditSharedState->statClass[classIdx];
 
-    /* Classify the statement using log stmt level and the command tag */
-    switch (stackItem->auditEvent.logStmtLevel)
+        for (typeIdx = 0; typeIdx < AUDIT_TYPE_TOTAL; typeIdx++)
+            stat_counter_reset(&statClass->events[typeIdx], init);
+
+        stat_counter_reset(&statClass->suppressed, init);
+        stat_counter_reset(&statClass->bytes, init);
+    }
+
+    for (hookIdx = 0; hookIdx < AUDIT_HOOK_TOTAL; hookIdx++)
+    {
+        AuditStatHook *statHook = &auditSharedState->statHook[hookIdx];
+
+        stat_counter_reset(&statHook->calls, init);
+        stat_counter_reset(&statHook->stackPushes, init);
+        stat_counter_reset(&statHook->aclChecks, init);
+        stat_counter_reset(&statHook->cacheHits, init);
+        stat_counter_reset(&statHook->cacheMisses, init);
+        stat_counter_reset(&statHook->time, init);
+
+        for (bucketIdx = 0; bucketIdx < AUDIT_HISTOGRAM_TOTAL; bucketIdx++)
+            stat_counter_reset(&statHook->histogram[bucketIdx], init);
+    }
+
+    /* Record when the reset happened */
+    stat_counter_reset(&auditSharedState->statReset, init);
+    pg_atomic_write_u64(&auditSharedState->statReset,
+                        (uint64) GetCurrentTimestamp());
+}
+
+/*
+ * Recent entries buffer
+ *
+ * The most recent entries are kept in a ring buffer in shared memory.  Writers
+ * claim the next slot with an atomic increment and readers never block them:
+ * each slot has a sequence that is odd while the slot is being written, so a
+ * reader that sees an odd sequence, or a different sequence after copying the
+ * slot, skips it.  Entries longer than the slot are truncated.
+ *
+ * An entry with parameters copied by buffer_param_copy() is stored as the
+ * entry up to the parameter field, the rest of the entry, and the parameters,
+ * so pgaudit_recent() can format the parameters and put the entry together.
+ * Such entries are formatted in full if they do not fit in the slot.
+ */
+#define AUDIT_BUFFER_ENTRY_SIZE     1024
+
+typedef struct AuditBufferSlot
+{
+    pg_atomic_uint32 sequence;      /* Odd while the slot is being written */
+    uint64 eventId;                 /* Entry number, from 1 */
+    TimestampTz logTime;            /* When the entry was logged */
+    int pid;                        /* Backend that logged the entry */
+    Oid roleId;                     /* Session user */
+    Oid databaseId;
+    bool truncated;                 /* Entry did not fit in the slot */
+    int paramDataLen;               /* Parameters at the end of the entry */
+    char entry[AUDIT_BUFFER_ENTRY_SIZE];
+} AuditBufferSlot;
+
+typedef struct AuditBuffer
+{
+    pg_atomic_uint64 eventTotal;    /* Entries written since startup */
+    AuditBufferSlot slot[FLEXIBLE_ARRAY_MEMBER];
+} AuditBuffer;
+
+static AuditBuffer *auditBuffer = NULL;
+
+/*
+ * Size of the buffer in shared memory, or zero when it is disabled.
+ */
+static Size
+buffer_shmem_size(void)
+{
+    if (auditBufferSize == 0)
+        return 0;
+
+    return add_size(offsetof(AuditBuffer, slot),
+                    mul_size(sizeof(AuditBufferSlot), auditBufferSize));
+}
+
+/*
+ * Initialize the buffer when shared memory is created.
+ */
+static void
+buffer_init(void)
+{
+    int slotIdx;
+
+    pg_atomic_init_u64(&auditBuffer->eventTotal, 0);
+
+    for (slotIdx = 0; slotIdx < auditBufferSize; slotIdx++)
+    {
+        pg_atomic_init_u32(&auditBuffer->slot[slotIdx].sequence, 0);
+        auditBuffer->slot[slotIdx].eventId = 0;
+    }
+}
+
+/*
+ * Add an entry to the buffer, overwriting the oldest.  If paramData is not
+ * NULL the entry is in two parts, before and after the parameter field, and
+ * false is returned without adding it if it does not fit in a slot.
+ *
+ * If the previous writer of the slot is still copying (the buffer has wrapped
+ * around while it was descheduled) the entry is dropped from the buffer rather
+ * than waiting.  It is still in the log.
+ */
+static bool
+buffer_add(const char *auditStr, const char *suffixStr, const char *paramData,
+           int paramDataLen)
+{
+    AuditBufferSlot *slot;
+    uint64 eventId;
+    uint32 sequence;
+    size_t auditLen;
+    size_t suffixLen = 0;
+
+    if (auditBuffer == NULL)
+        return true;
+
+    /* Skip the prefix, which is not stored */
+    if (strncmp(auditStr, AUDIT_PREFIX, strlen(AUDIT_PREFIX)) == 0)
+        auditStr += strlen(AUDIT_PREFIX);
+
+    auditLen = strlen(auditStr);
+
+    if (paramData != NULL)
+    {
+        suffixLen = strlen(suffixStr);
+
+        if (auditLen + 1 + suffixLen + 1 + paramDataLen >
+            AUDIT_BUFFER_ENTRY_SIZE)
+            return false;
+    }
+
+    eventId = pg_atomic_fetch_add_u64(&auditBuffer->eventTotal, 1);
+    slot = &auditBuffer->slot[eventId % auditBufferSize];
+
+    /* Claim the slot by making the sequence odd */
+    sequence = pg_atomic_read_u32(&slot->sequence);
+
+    if (sequence & 1 ||
+        !pg_atomic_compare_exchange_u32(&slot->sequence, &sequence,
+                                        sequence + 1))
+        return true;
+
+    slot->eventId = eventId + 1;
+    slot->logTime = GetCurrentTimestamp();
+    slot->pid = MyProcPid;
+    slot->roleId = GetSessionUserId();
+    slot->databaseId = MyDatabaseId;
+
+    if (paramData != NULL)
+    {
+        /* Copy the parts of the entry, which are known to fit */
+        memcpy(slot->entry, auditStr, auditLen + 1);
+        memcpy(slot->entry + auditLen + 1, suffixStr, suffixLen + 1);
+        memcpy(slot->entry + auditLen + 1 + suffixLen + 1, paramData,
+               paramDataLen);
+        slot->paramDataLen = paramDataLen;
+        slot->truncated = false;
+    }
+    else
+    {
+        /* Copy the entry, truncating if needed */
+        auditLen = Min(auditLen, AUDIT_BUFFER_ENTRY_SIZE - 1);
+
+        memcpy(slot->entry, auditStr, auditLen);
+        slot->entry[auditLen] = '\0';
+        slot->paramDataLen = 0;
+        slot->truncated = auditStr[auditLen] != '\0';
+    }
+
+    /* Make the entry visible before releasing the slot */
+    pg_write_barrier();
+    pg_atomic_write_u32(&slot->sequence, sequence + 2);
+
+    return true;
+}
+
+/*
+ * Return the next field of an entry in the buffer and advance past it, or
+ * NULL if the field is empty or there are no more fields.  The last field of
+ * a truncated entry may be missing its closing quote.
+ */
+static char *
+buffer_field_next(const char **entry)
+{
+    const char *pChar = *entry;
+    StringInfoData field;
+
+    if (pChar == NULL)
+        return NULL;
+
+    initStringInfo(&field);
+
+    if (*pChar == '"')
+    {
+        /* Quoted field, a doubled quote is a literal quote */
+        for (pChar++; *pChar; pChar++)
+        {
+            if (*pChar == '"' && *++pChar != '"')
+                break;
+
+            appendStringInfoCharMacro(&field, *pChar);
+        }
+    }
+    else
+    {
+        while (*pChar && *pChar != ',')
+            appendStringInfoCharMacro(&field, *pChar++);
+    }
+
+    *entry = *pChar == ',' ? pChar + 1 : NULL;
+
+    if (field.len == 0)
+    {
+        pfree(field.data);
+        return NULL;
+    }
+
+    return field.data;
+}
+
+/*
+ * Header of each parameter copied by buffer_param_copy(), followed by len
+ * bytes of the value.  NULL parameters have an invalid type.
+ */
+typedef struct AuditBufferParam
+{
+    Oid type;
+    int len;
+} AuditBufferParam;
+
+/*
+ * Check if values of a type can be copied as they are and formatted when the
+ * entry is read.  Only types whose output does not depend on the catalog, on
+ * a row type registered in the backend, or on the date and time settings
+ * qualify, and arrays of them.  E.g. a regclass would be looked up in the
+ * database of the reader and a record may not be known there at all.
+ */
+static bool
+buffer_param_raw(Oid type)
+{
+    Oid elemType = get_element_type(type);
+
+    if (OidIsValid(elemType))
+        type = elemType;
+
+    switch (type)
+    {
+        case BOOLOID:
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+        case FLOAT4OID:
+        case FLOAT8OID:
+        case NUMERICOID:
+        case TEXTOID:
+        case VARCHAROID:
+        case BPCHAROID:
+        case BYTEAOID:
+        case UUIDOID:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/*
+ * Copy parameters to be formatted by buffer_param_format() when the entry is
+ * read.  Values of the types accepted by buffer_param_raw() are copied as they
+ * are.  Values of other types are formatted now, as they would be for the log,
+ * and copied as cstrings.
+ */
+static void
+buffer_param_copy(ParamListInfo paramList, StringInfo paramData)
+{
+    int paramIdx;
+
+    for (paramIdx = 0; paramIdx < paramList->numParams; paramIdx++)
+    {
+        ParamExternData *prm = &paramList->params[paramIdx];
+        AuditBufferParam header;
+        const char *value = NULL;
+        char *paramStr = NULL;
+
+        header.type = InvalidOid;
+        header.len = 0;
+
+        /* Skip if null or if oid is invalid */
+        if (prm->isnull || !OidIsValid(prm->ptype))
+        {
+            appendBinaryStringInfo(paramData, (char *) &header,
+                                   sizeof(header));
+            continue;
+        }
+
+        if (buffer_param_raw(prm->ptype))
+        {
+            int16 typeLen;
+            bool typeByVal;
+
+            get_typlenbyval(prm->ptype, &typeLen, &typeByVal);
+            header.type = prm->ptype;
+
+            if (typeByVal)
+            {
+                value = (const char *) &prm->value;
+                header.len = sizeof(Datum);
+            }
+            else if (typeLen == -1)
+            {
+                /* Toasted values would not outlive the statement */
+                value = (const char *) PG_DETOAST_DATUM_PACKED(prm->value);
+                header.len = VARSIZE_ANY(value);
+            }
+            else
+            {
+                value = DatumGetPointer(prm->value);
+                header.len = typeLen;
+            }
+        }
+        else
+        {
+            Oid typeOutput;
+            bool typeIsVarLena;
+
+            getTypeOutputInfo(prm->ptype, &typeOutput, &typeIsVarLena);
+            paramStr = OidOutputFunctionCall(typeOutput, prm->value);
+
+            header.type = CSTRINGOID;
+            header.len = strlen(paramStr) + 1;
+            value = paramStr;
+        }
+
+        appendBinaryStringInfo(paramData, (char *) &header, sizeof(header));
+
+        if (header.len > 0)
+            appendBinaryStringInfo(paramData, value, header.len);
+
+        if (paramStr != NULL)
+            pfree(paramStr);
+    }
+}
+
+/*
+ * Format parameters copied by buffer_param_copy() as they would have been
+ * formatted when the entry was logged.  Only extra_float_digits and
+ * bytea_output of the current session can make a difference.
+ */
+static void
+buffer_param_format(const char *paramData, int paramDataLen,
+                    StringInfo paramStr)
+{
+    const char *pData = paramData;
+    int paramIdx;
+
+    for (paramIdx = 0; pData < paramData + paramDataLen; paramIdx++)
+    {
+        AuditBufferParam header;
+
+        memcpy(&header, pData, sizeof(header));
+        pData += sizeof(header);
+
+        /* Add a comma for each param */
+        if (paramIdx != 0)
+            appendStringInfoCharMacro(paramStr, ',');
+
+        if (OidIsValid(header.type))
+        {
+            int16 typeLen;
+            bool typeByVal;
+            Oid typeOutput;
+            bool typeIsVarLena;
+            char *valueCopy;
+            Datum value;
+            char *valueStr;
+
+            /* Copy the value so it is aligned */
+            valueCopy = palloc(header.len);
+            memcpy(valueCopy, pData, header.len);
+
+            get_typlenbyval(header.type, &typeLen, &typeByVal);
+
+            if (typeByVal)
+                memcpy(&value, valueCopy, sizeof(Datum));
+            else
+                value = PointerGetDatum(valueCopy);
+
+            getTypeOutputInfo(header.type, &typeOutput, &typeIsVarLena);
+            valueStr = OidOutputFunctionCall(typeOutput, value);
+
+            append_valid_csv(paramStr, valueStr);
+
+            pfree(valueStr);
+            pfree(valueCopy);
+        }
+
+        pData += header.len;
+    }
+}
+
+/*
+ * Rebuild an entry whose parameters were copied for the buffer, which is
+ * stored as the entry before the parameter field, the entry after it, and the
+ * parameters.
+ */
+static char *
+buffer_entry_format(const AuditBufferSlot *slot)
+{
+    const char *suffixStr = slot->entry + strlen(slot->entry) + 1;
+    const char *paramData = suffixStr + strlen(suffixStr) + 1;
+    StringInfoData paramStr;
+    StringInfoData entryStr;
+
+    initStringInfo(&paramStr);
+    buffer_param_format(paramData, slot->paramDataLen, &paramStr);
+
+    initStringInfo(&entryStr);
+    appendStringInfoString(&entryStr, slot->entry);
+    append_valid_csv(&entryStr, paramStr.data);
+    appendStringInfoString(&entryStr, suffixStr);
+
+    pfree(paramStr.data);
+
+    return entryStr.data;
+}
+
+/*
+ * Return the object type of a relation from its relkind.
+ */
+static const char *
+relation_object_type(char relkind)
+{
+    switch (relkind)
+    {
+        case RELKIND_RELATION:
+            return OBJECT_TYPE_TABLE;
+
+        case RELKIND_INDEX:
+            return OBJECT_TYPE_INDEX;
+
+        case RELKIND_SEQUENCE:
+            return OBJECT_TYPE_SEQUENCE;
+
+        case RELKIND_TOASTVALUE:
+            return OBJECT_TYPE_TOASTVALUE;
+
+        case RELKIND_VIEW:
+            return OBJECT_TYPE_VIEW;
+
+        case RELKIND_COMPOSITE_TYPE:
+            return OBJECT_TYPE_COMPOSITE_TYPE;
+
+        case RELKIND_FOREIGN_TABLE:
+            return OBJECT_TYPE_FOREIGN_TABLE;
+
+        case RELKIND_MATVIEW:
+            return OBJECT_TYPE_MATVIEW;
+
+        default:
+            return OBJECT_TYPE_UNKNOWN;
+    }
+}
+
+/*
+ * Top objects
+ *
+ * Accesses are counted by (database, role, object, command) in a count-min
+ * sketch: AUDIT_TOP_DEPTH rows of counters, each indexed by a different hash
+ * of the key.  Every access increments one counter in each row with an atomic
+ * add and the estimate is the lowest of the key's counters.  The estimate is
+ * only too high when other keys share all of its counters.  The keys with the
+ * highest estimates are kept in a min-heap.  The heap is only locked when an
+ * estimate exceeds the lowest count in the heap and the update is skipped
+ * rather than waiting for the lock, so the heap counts may lag behind the
+ * sketch.
+ */
+#define AUDIT_TOP_DEPTH     4
+#define AUDIT_TOP_WIDTH     4096
+
+/*
+ * Commands that accesses are counted for, the index is stored in the key
+ */
+static const char *const auditTopCommand[] =
+{
+    COMMAND_SELECT,
+    COMMAND_INSERT,
+    COMMAND_UPDATE,
+    COMMAND_DELETE,
+    COMMAND_EXECUTE,
+    COMMAND_UNKNOWN
+};
+
+#define AUDIT_TOP_COMMAND_TOTAL \
+    (sizeof(auditTopCommand) / sizeof(auditTopCommand[0]))
+
+typedef struct AuditTopKey
+{
+    Oid databaseId;
+    Oid roleId;                     /* Session user */
+    Oid classId;                    /* pg_class or pg_proc */
+    Oid objectId;
+    uint32 commandIdx;              /* Index into auditTopCommand */
+} AuditTopKey;
+
+typedef struct AuditTopEntry
+{
+    AuditTopKey key;
+    uint64 count;                   /* Estimate when the entry was updated */
+} AuditTopEntry;
+
+typedef struct AuditTop
+{
+    LWLock *lock;                   /* Protects the heap */
+    pg_atomic_uint64 minCount;      /* Lowest count once the heap is full */
+    pg_atomic_uint64 reset;         /* TimestampTz of the last reset */
+    pg_atomic_uint64 sketch[AUDIT_TOP_DEPTH][AUDIT_TOP_WIDTH];
+    int total;                      /* Entries in the heap */
+    AuditTopEntry entry[FLEXIBLE_ARRAY_MEMBER];
+} AuditTop;
+
+static AuditTop *auditTop = NULL;
+
+/*
+ * Size of the sketch and heap in shared memory, or zero when disabled.
+ */
+static Size
+top_shmem_size(void)
+{
+    if (auditTopObjects == 0)
+        return 0;
+
+    return add_size(offsetof(AuditTop, entry),
+                    mul_size(sizeof(AuditTopEntry), auditTopObjects));
+}
+
+/*
+ * Clear the sketch and heap.  The lock must be held unless shared memory is
+ * being initialized.
+ */
+static void
+top_reset(bool init)
+{
+    int row;
+    int column;
+
+    for (row = 0; row < AUDIT_TOP_DEPTH; row++)
+        for (column = 0; column < AUDIT_TOP_WIDTH; column++)
+            stat_counter_reset(&auditTop->sketch[row][column], init);
+
+    auditTop->total = 0;
+
+    stat_counter_reset(&auditTop->minCount, init);
+    stat_counter_reset(&auditTop->reset, init);
+    pg_atomic_write_u64(&auditTop->reset, (uint64) GetCurrentTimestamp());
+}
+
+/*
+ * Return the counter for the key in a row of the sketch.  The row hashes are
+ * derived from two hashes of the key (h1 + row * h2), which is as good as
+ * independent hashes for a count-min sketch.
+ */
+static pg_atomic_uint64 *
+top_counter(uint32 hash, int row)
+{
+    uint32 hashStep = hash_uint32(hash) | 1;
+
+    return &auditTop->sketch[row][(hash + row * hashStep) % AUDIT_TOP_WIDTH];
+}
+
+/*
+ * Estimate the number of accesses for a key from the sketch.
+ */
+static uint64
+top_estimate(AuditTopKey *key)
+{
+    uint32 hash = DatumGetUInt32(hash_any((unsigned char *) key,
+                                          sizeof(AuditTopKey)));
+    uint64 estimate = PG_UINT64_MAX;
+    int row;
+
+    for (row = 0; row < AUDIT_TOP_DEPTH; row++)
+        estimate = Min(estimate,
+                       pg_atomic_read_u64(top_counter(hash, row)));
+
+    return estimate;
+}
+
+/*
+ * Move a heap entry toward the root while it is lower than its parent.
+ */
+static void
+top_heap_up(int entryIdx)
+{
+    AuditTopEntry *entry = auditTop->entry;
+
+    while (entryIdx > 0)
+    {
+        int parentIdx = (entryIdx - 1) / 2;
+        AuditTopEntry swap;
+
+        if (entry[parentIdx].count <= entry[entryIdx].count)
+            break;
+
+        swap = entry[parentIdx];
+        entry[parentIdx] = entry[entryIdx];
+        entry[entryIdx] = swap;
+        entryIdx = parentIdx;
+    }
+}
+
+/*
+ * Move a heap entry toward the leaves while it is higher than a child.
+ */
+static void
+top_heap_down(int entryIdx)
+{
+    AuditTopEntry *entry = auditTop->entry;
+
+    for (;;)
+    {
+        int childIdx = entryIdx * 2 + 1;
+        AuditTopEntry swap;
+
+        if (childIdx >= auditTop->total)
+            break;
+
+        if (childIdx + 1 < auditTop->total &&
+            entry[childIdx + 1].count < entry[childIdx].count)
+            childIdx++;
+
+        if (entry[entryIdx].count <= entry[childIdx].count)
+            break;
+
+        swap = entry[childIdx];
+        entry[childIdx] = entry[entryIdx];
+        entry[entryIdx] = swap;
+        entryIdx = childIdx;
+    }
+}
+
+/*
+ * Update the heap with the estimate for a key.  The lock must be held.
+ */
+static void
+top_heap_update(AuditTopKey *key, uint64 estimate)
+{
+    int entryIdx;
+
+    /* Update the count if the key is already in the heap */
+    for (entryIdx = 0; entryIdx < auditTop->total; entryIdx++)
+    {
+        if (memcmp(&auditTop->entry[entryIdx].key, key,
+                   sizeof(AuditTopKey)) == 0)
+        {
+            if (estimate > auditTop->entry[entryIdx].count)
+            {
+                auditTop->entry[entryIdx].count = estimate;
+                top_heap_down(entryIdx);
+            }
+
+            break;
+        }
+    }
+
+    /* Else add it, replacing the lowest entry if the heap is full */
+    if (entryIdx == auditTop->total)
+    {
+        if (auditTop->total < auditTopObjects)
+        {
+            auditTop->entry[auditTop->total].key = *key;
+            auditTop->entry[auditTop->total].count = estimate;
+            top_heap_up(auditTop->total++);
+        }
+        else if (estimate > auditTop->entry[0].count)
+        {
+            auditTop->entry[0].key = *key;
+            auditTop->entry[0].count = estimate;
+            top_heap_down(0);
+        }
+    }
+
+    if (auditTop->total == auditTopObjects)
+        pg_atomic_write_u64(&auditTop->minCount, auditTop->entry[0].count);
+}
+
+/*
+ * Count an access to a relation or function by the session user.
+ */
+static void
+top_add(Oid classId, Oid objectId, const char *command)
+{
+    AuditTopKey key;
+    uint32 hash;
+    uint64 estimate = PG_UINT64_MAX;
+    int row;
+
+    if (auditTop == NULL)
+        return;
+
+    /* Zero the whole key since it is hashed and compared as bytes */
+    memset(&key, 0, sizeof(AuditTopKey));
+
+    key.databaseId = MyDatabaseId;
+    key.roleId = GetSessionUserId();
+    key.classId = classId;
+    key.objectId = objectId;
+
+    /* Commands that are not in the list are counted as UNKNOWN */
+    while (key.commandIdx < AUDIT_TOP_COMMAND_TOTAL - 1 &&
+           strcmp(command, auditTopCommand[key.commandIdx]) != 0)
+        key.commandIdx++;
+
+    /* Increment the counters and estimate from the new values */
+    hash = DatumGetUInt32(hash_any((unsigned char *) &key,
+                                   sizeof(AuditTopKey)));
+
+    for (row = 0; row < AUDIT_TOP_DEPTH; row++)
+        estimate = Min(estimate,
+                       pg_atomic_fetch_add_u64(top_counter(hash, row), 1) + 1);
+
+    /* Most accesses are not to the top objects and stop here */
+    if (estimate <= pg_atomic_read_u64(&auditTop->minCount))
+        return;
+
+    /* Don't wait for the lock, a later access will update the heap */
+    if (!LWLockConditionalAcquire(auditTop->lock, LW_EXCLUSIVE))
+        return;
+
+    top_heap_update(&key, estimate);
+
+    LWLockRelease(auditTop->lock);
+}
+
+/*
+ * Capture
+ *
+ * When pgaudit.log_destination is not server, entries are written to the
+ * destination by log_audit_emit() and the emit_log_hook keeps them out of the
+ * server log.  They cannot be written by the hook since core only calls it for
+ * messages at or above log_min_messages.  Entries are recognized by
+ * auditEmitting, which is only set while log_audit_emit() reports an entry,
+ * rather than by the message text since any statement can contain the prefix.
+ * An entry that cannot be written to the destination is left in the server log
+ * rather than lost.
+ *
+ * Entries written to the file are only reported at all if they must also go to
+ * the client or to the buffer, so binary entries are not formatted as CSV
+ * otherwise.  auditEmittingWritten tells the hook that the entry has already
+ * been written.
+ */
+static bool auditEmitting = false;
+static bool auditEmittingWritten = false;
+
+/*
+ * Descriptor for pgaudit.log_file, opened when the first entry is written, and
+ * the device and inode of the file so a rotation that renames it is noticed.
+ */
+static int auditLogFileFd = -1;
+static dev_t auditLogFileDev;
+static ino_t auditLogFileIno;
+
+/*
+ * Names defined in the binary file by this process, see pgaudit_binary.h.  Ids
+ * only have meaning in the file they were defined in, so the table is dropped
+ * when the file is opened and when any process finds that the file has been
+ * truncated, which is counted by fileEpoch in shared memory.  Long names and
+ * names beyond the size of the table are written in full in each entry.
+ */
+#define AUDIT_BINARY_NAME_SIZE      (NAMEDATALEN * 2)
+#define AUDIT_BINARY_NAME_MAX       1024
+
+typedef struct AuditBinaryName
+{
+    char name[AUDIT_BINARY_NAME_SIZE];  /* Hash key */
+    uint64 id;
+} AuditBinaryName;
+
+static HTAB *auditBinaryName = NULL;
+static uint32 auditBinaryEpoch = 0;
+
+/*
+ * Open pgaudit.log_file if it is not open, or open it again if the path no
+ * longer leads to the open file, e.g. because the file was renamed by a log
+ * rotation.  Returns false if the file could not be opened.
+ */
+static bool
+capture_file_open(void)
+{
+    char path[MAXPGPATH];
+    struct stat fileStat;
+
+    /* Relative paths are in log_directory */
+    if (is_absolute_path(auditLogFile))
+        strlcpy(path, auditLogFile, sizeof(path));
+    else
+        join_path_components(path, Log_directory, auditLogFile);
+
+    if (auditLogFileFd >= 0)
+    {
+        if (stat(path, &fileStat) == 0 &&
+            fileStat.st_dev == auditLogFileDev &&
+            fileStat.st_ino == auditLogFileIno)
+            return true;
+
+        close(auditLogFileFd);
+        auditLogFileFd = -1;
+    }
+
+    auditLogFileFd = open(path, O_WRONLY | O_APPEND | O_CREAT | PG_BINARY,
+                          S_IRUSR | S_IWUSR);
+
+    if (auditLogFileFd < 0)
+        return false;
+
+    if (fstat(auditLogFileFd, &fileStat) != 0)
+    {
+        close(auditLogFileFd);
+        auditLogFileFd = -1;
+        return false;
+    }
+
+    auditLogFileDev = fileStat.st_dev;
+    auditLogFileIno = fileStat.st_ino;
+
+    /* Names must be defined again in the file */
+    if (auditBinaryName != NULL)
+    {
+        hash_destroy(auditBinaryName);
+        auditBinaryName = NULL;
+    }
+
+    return true;
+}
+
+/*
+ * Frame being filled for pgaudit.log_file when pgaudit.log_file_compression
+ * is set.  auditCompressInput is the number of bytes compressed into the
+ * frame, zero when no frame is open.  The frame is ended and written at the
+ * end of each transaction, when AUDIT_COMPRESS_FRAME_MAX bytes have been
+ * compressed into it, and when the process exits.
+ */
+#define AUDIT_COMPRESS_FRAME_MAX    (64 * 1024)
+
+static int auditCompressInput = 0;
+
+#ifdef USE_ZSTD
+static ZSTD_CCtx *auditCompressCtx = NULL;
+static StringInfoData auditCompressFrame;
+
+/*
+ * Drop the open frame, if any, and start the next one afresh.
+ */
+static void
+capture_compress_reset(void)
+{
+    ZSTD_CCtx_reset(auditCompressCtx, ZSTD_reset_session_only);
+    resetStringInfo(&auditCompressFrame);
+    auditCompressInput = 0;
+}
+
+/*
+ * Compress input into the open frame until it has all been taken, or until
+ * the frame is complete when directive is ZSTD_e_end.  Returns false if zstd
+ * failed, in which case the frame is dropped.
+ */
+static bool
+capture_compress_stream(ZSTD_inBuffer *input, ZSTD_EndDirective directive)
+{
+    size_t remaining;
+
+    do
+    {
+        ZSTD_outBuffer output;
+
+        enlargeStringInfo(&auditCompressFrame, (int) ZSTD_CStreamOutSize());
+
+        output.dst = auditCompressFrame.data + auditCompressFrame.len;
+        output.size = auditCompressFrame.maxlen - auditCompressFrame.len - 1;
+        output.pos = 0;
+
+        remaining = ZSTD_compressStream2(auditCompressCtx, &output, input,
+                                         directive);
+
+        if (ZSTD_isError(remaining))
+        {
+            ereport(WARNING,
+                    (errmsg("could not compress audit entries: %s",
+                            ZSTD_getErrorName(remaining))));
+
+            capture_compress_reset();
+            return false;
+        }
+
+        auditCompressFrame.len += (int) output.pos;
+        auditCompressFrame.data[auditCompressFrame.len] = '\0';
+    }
+    while (directive == ZSTD_e_end ? remaining != 0 :
+           input->pos < input->size);
+
+    return true;
+}
+#endif
+
+/*
+ * End the open frame and write it to pgaudit.log_file in a single append.
+ * Returns false if it could not be written, in which case the entries in it
+ * are lost and a warning is raised, since they were reported as written when
+ * they were compressed.  Nothing is done when no frame is open.
+ */
+static bool
+capture_compress_flush(void)
+{
+    bool result = true;
+
+#ifdef USE_ZSTD
+    ZSTD_inBuffer input = {NULL, 0, 0};
+
+    if (auditCompressInput == 0)
+        return true;
+
+    if (!capture_compress_stream(&input, ZSTD_e_end))
+        return false;
+
+    if (!capture_file_open() ||
+        write(auditLogFileFd, auditCompressFrame.data,
+              auditCompressFrame.len) != auditCompressFrame.len)
+    {
+        ereport(WARNING,
+                (errcode_for_file_access(),
+                 errmsg("could not write audit entries to \"%s\": %m",
+                        auditLogFile)));
+        result = false;
+    }
+
+    capture_compress_reset();
+#endif
+
+    return result;
+}
+
+#ifdef USE_ZSTD
+/*
+ * Write the open frame when the process exits.
+ */
+static void
+capture_compress_exit(int code, Datum arg)
+{
+    capture_compress_flush();
+}
+#endif
+
+/*
+ * Compress data into the open frame, opening one if needed, and write the
+ * frame when it is full.  Returns false if the data could not be compressed
+ * or the full frame could not be written.
+ */
+static bool
+capture_compress_append(const char *data, int len)
+{
+#ifdef USE_ZSTD
+    ZSTD_inBuffer input;
+
+    if (auditCompressCtx == NULL)
+    {
+        MemoryContext contextOld;
+
+        auditCompressCtx = ZSTD_createCCtx();
+
+        if (auditCompressCtx == NULL)
+            return false;
+
+        /* Let readers tell a damaged frame from a good one */
+        ZSTD_CCtx_setParameter(auditCompressCtx, ZSTD_c_checksumFlag, 1);
+
+        contextOld = MemoryContextSwitchTo(TopMemoryContext);
+        initStringInfo(&auditCompressFrame);
+        MemoryContextSwitchTo(contextOld);
+
+        before_shmem_exit(capture_compress_exit, (Datum) 0);
+    }
+
+    input.src = data;
+    input.size = len;
+    input.pos = 0;
+
+    if (!capture_compress_stream(&input, ZSTD_e_continue))
+        return false;
+
+    auditCompressInput += len;
+
+    if (auditCompressInput >= AUDIT_COMPRESS_FRAME_MAX)
+        return capture_compress_flush();
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Append data to pgaudit.log_file, or compress it into the open frame when
+ * pgaudit.log_file_compression is set.  Returns false if the data could not
+ * be written.
+ */
+static bool
+capture_file_append(const char *data, int len)
+{
+    if (auditLogFileCompression != AUDIT_COMPRESSION_NONE)
+        return capture_compress_append(data, len);
+
+    /* Entries compressed before compression was turned off go first */
+    capture_compress_flush();
+
+    if (!capture_file_open())
+        return false;
+
+    /* A single append so entries from different processes do not interleave */
+    return write(auditLogFileFd, data, len) == len;
+}
+
+/*
+ * Write an entry to pgaudit.log_file, preceded by the fields the server log
+ * would get from log_line_prefix: time, process id, user, and database.  The
+ * time has the same format as in csvlog.  Returns false if the entry could not
+ * be written, in which case it is left in the server log.
+ */
+static bool
+capture_file_write(const char *entry)
+{
+    StringInfoData line;
+    struct timeval timeNow;
+    pg_time_t stampTime;
+    char timeStr[128];
+    char msecStr[8];
+    bool result;
+
+    /* Paste the milliseconds into place, as elog.c does */
+    gettimeofday(&timeNow, NULL);
+    stampTime = (pg_time_t) timeNow.tv_sec;
+
+    pg_strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S     %Z",
+                pg_localtime(&stampTime, log_timezone));
+    sprintf(msecStr, ".%03d", (int) (timeNow.tv_usec / 1000));
+    memcpy(timeStr + 19, msecStr, 4);
+
+    initStringInfo(&line);
+    appendStringInfo(&line, "%s,%d,", timeStr, MyProcPid);
+
+    if (MyProcPort != NULL)
+    {
+        append_valid_csv(&line, MyProcPort->user_name);
+        appendStringInfoCharMacro(&line, ',');
+        append_valid_csv(&line, MyProcPort->database_name);
+    }
+    else
+        appendStringInfoCharMacro(&line, ',');
+
+    appendStringInfoCharMacro(&line, ',');
+    appendStringInfoString(&line, entry);
+    appendStringInfoCharMacro(&line, '\n');
+
+    result = capture_file_append(line.data, line.len);
+
+    pfree(line.data);
+
+    return result;
+}
+
+/*
+ * Append a record to the binary file buffer in a frame: the sync marker, the
+ * length, the record, and the checksum of the length and the record.
+ */
+static void
+capture_binary_record(StringInfo line, StringInfo record)
+{
+    pg_crc32c crc;
+    int checkStart;
+    unsigned char checksum[AUDIT_BINARY_CHECKSUM_LEN];
+
+    appendBinaryStringInfo(line, AUDIT_BINARY_SYNC, AUDIT_BINARY_SYNC_LEN);
+
+    checkStart = line->len;
+    append_binary_varint(line, (uint64) record->len);
+    appendBinaryStringInfo(line, record->data, record->len);
+
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, line->data + checkStart, line->len - checkStart);
+    FIN_CRC32C(crc);
+
+    checksum[0] = (unsigned char) crc;
+    checksum[1] = (unsigned char) (crc >> 8);
+    checksum[2] = (unsigned char) (crc >> 16);
+    checksum[3] = (unsigned char) (crc >> 24);
+
+    appendBinaryStringInfo(line, (char *) checksum, sizeof(checksum));
+}
+
+/*
+ * Append a name to an entry record.  A name that has not been defined yet is
+ * given the next id and a NAME record is appended to the file buffer, where it
+ * will come before the entry.
+ */
+static void
+capture_binary_name(StringInfo line, StringInfo record, const char *name)
+{
+    AuditBinaryName *binaryName;
+    StringInfoData nameRecord;
+
+    if (name == NULL)
+    {
+        append_binary_varint(record, AUDIT_BINARY_NAME_NULL);
+        return;
+    }
+
+    binaryName = NULL;
+
+    if (strlen(name) < AUDIT_BINARY_NAME_SIZE)
+    {
+        binaryName = hash_search(auditBinaryName, name, HASH_FIND, NULL);
+
+        if (binaryName == NULL &&
+            hash_get_num_entries(auditBinaryName) <
+            AUDIT_BINARY_CODE_TOTAL + AUDIT_BINARY_NAME_MAX)
+        {
+            binaryName = hash_search(auditBinaryName, name, HASH_ENTER, NULL);
+            binaryName->id = AUDIT_BINARY_CODE_FIRST +
+                             hash_get_num_entries(auditBinaryName) - 1;
+
+            initStringInfo(&nameRecord);
+            appendStringInfoCharMacro(&nameRecord, AUDIT_BINARY_NAME);
+            append_binary_varint(&nameRecord, (uint64) MyProcPid);
+            append_binary_varint(&nameRecord, binaryName->id);
+            append_binary_text(&nameRecord, name);
+
+            capture_binary_record(line, &nameRecord);
+            pfree(nameRecord.data);
+        }
+    }
+
+    /* Write the name in full when it cannot be interned */
+    if (binaryName == NULL)
+    {
+        append_binary_varint(record, AUDIT_BINARY_NAME_TEXT);
+        append_binary_text(record, name);
+    }
+    else
+        append_binary_varint(record, binaryName->id);
+}
+
+/*
+ * Append an OPEN record to the binary file buffer and create the name table
+ * with the ids of the code table.
+ */
+static void
+capture_binary_open(StringInfo line)
+{
+    HASHCTL hashCtl;
+    StringInfoData record;
+    int codeIdx;
+
+    memset(&hashCtl, 0, sizeof(hashCtl));
+    hashCtl.keysize = AUDIT_BINARY_NAME_SIZE;
+    hashCtl.entrysize = sizeof(AuditBinaryName);
+    hashCtl.hcxt = TopMemoryContext;
+
+    auditBinaryName = hash_create("pgaudit binary names", 256, &hashCtl,
+                                  HASH_ELEM | HASH_CONTEXT);
+
+    for (codeIdx = 0; codeIdx < AUDIT_BINARY_CODE_TOTAL; codeIdx++)
+    {
+        AuditBinaryName *binaryName;
+
+        binaryName = hash_search(auditBinaryName, auditBinaryCode[codeIdx],
+                                 HASH_ENTER, NULL);
+        binaryName->id = AUDIT_BINARY_CODE_FIRST + codeIdx;
+    }
+
+    initStringInfo(&record);
+    appendStringInfoCharMacro(&record, AUDIT_BINARY_OPEN);
+    appendStringInfoString(&record, AUDIT_BINARY_MAGIC);
+    append_binary_varint(&record, AUDIT_BINARY_VERSION);
+    append_binary_varint(&record, (uint64) MyProcPid);
+
+    capture_binary_record(line, &record);
+    pfree(record.data);
+}
+
+/*
+ * Append an ENTRY record to the binary file buffer, preceded by the NAME
+ * records it needs.
+ */
+static void
+capture_binary_entry(StringInfo line, const AuditEntry *entry)
+{
+    StringInfoData record;
+    struct timeval timeNow;
+
+    gettimeofday(&timeNow, NULL);
+
+    initStringInfo(&record);
+    appendStringInfoCharMacro(&record, AUDIT_BINARY_ENTRY);
+    append_binary_varint(&record, (uint64) MyProcPid);
+    append_binary_varint(&record, (uint64) timeNow.tv_sec * 1000000 +
+                         timeNow.tv_usec);
+    append_binary_varint(&record, (uint64) entry->flags);
+    append_binary_varint(&record, (uint64) entry->statementId);
+    append_binary_varint(&record, (uint64) entry->substatementId);
+
+    capture_binary_name(line, &record, entry->className);
+    capture_binary_name(line, &record,
+                        MyProcPort != NULL ? MyProcPort->user_name : NULL);
+    capture_binary_name(line, &record,
+                        MyProcPort != NULL ? MyProcPort->database_name : NULL);
+    capture_binary_name(line, &record, entry->command);
+    capture_binary_name(line, &record, entry->objectType);
+    capture_binary_name(line, &record, entry->objectName);
+
+    if (entry->flags & AUDIT_ENTRY_STATEMENT)
+    {
+        append_binary_text(&record, entry->commandText);
+
+        if (entry->flags & AUDIT_ENTRY_PARAMETER)
+            append_binary_text(&record, log_audit_param_text(entry));
+    }
+
+    if (entry->flags & AUDIT_ENTRY_ROWS_KNOWN)
+        append_binary_varint(&record, entry->rows);
+
+    if (entry->flags & AUDIT_ENTRY_DURATION_KNOWN)
+        append_binary_varint(&record, entry->duration);
+
+    capture_binary_record(line, &record);
+    pfree(record.data);
+}
+
+/*
+ * Compress an entry into the open frame in the binary format.  Each frame
+ * starts with an OPEN record and defines the names it uses so it can be read
+ * without the frames before it.  Truncation does not need to be counted since
+ * frames are only written whole.  Returns the number of bytes compressed, or
+ * zero if the entry could not be.
+ */
+static int
+capture_binary_compress(const AuditEntry *entry)
+{
+    StringInfoData line;
+    int result = 0;
+
+    initStringInfo(&line);
+
+    if (auditCompressInput == 0 || auditBinaryName == NULL)
+    {
+        if (auditBinaryName != NULL)
+            hash_destroy(auditBinaryName);
+
+        capture_binary_open(&line);
+    }
+
+    capture_binary_entry(&line, entry);
+
+    if (capture_compress_append(line.data, line.len))
+        result = line.len;
+
+    pfree(line.data);
+
+    return result;
+}
+
+/*
+ * Write an entry to pgaudit.log_file in the binary format.  The OPEN and NAME
+ * records that the entry needs are written with it in a single append.
+ * Returns the number of bytes written, or zero if the entry could not be
+ * written.
+ *
+ * A process that writes at the start of the file cannot tell whether the file
+ * is new or has been truncated by a copy and truncate rotation, so it counts a
+ * truncation in fileEpoch and every process defines its names again.  If the
+ * entry used names defined before the truncation it is written again after
+ * them.
+ */
+static int
+capture_binary_write(const AuditEntry *entry)
+{
+    StringInfoData line;
+    uint32 fileEpoch = 0;
+    bool opened = false;
+    int result = 0;
+
+    if (auditLogFileCompression != AUDIT_COMPRESSION_NONE)
+        return capture_binary_compress(entry);
+
+    /* Entries compressed before compression was turned off go first */
+    capture_compress_flush();
+
+    if (!capture_file_open())
+        return 0;
+
+    if (auditSharedState != NULL)
+        fileEpoch = pg_atomic_read_u32(&auditSharedState->fileEpoch);
+
+    initStringInfo(&line);
+
+    for (;;)
+    {
+        if (auditBinaryName == NULL || fileEpoch != auditBinaryEpoch)
+        {
+            if (auditBinaryName != NULL)
+                hash_destroy(auditBinaryName);
+
+            capture_binary_open(&line);
+            auditBinaryEpoch = fileEpoch;
+            opened = true;
+        }
+
+        capture_binary_entry(&line, entry);
+
+        /*
+         * Part of the entry may have been written, which readers skip since
+         * the frame is incomplete.  The names defined in the part cannot be
+         * relied on, so open the file and define them again for the next
+         * entry.
+         */
+        if (write(auditLogFileFd, line.data, line.len) != line.len)
+        {
+            close(auditLogFileFd);
+            auditLogFileFd = -1;
+
+            hash_destroy(auditBinaryName);
+            auditBinaryName = NULL;
+            break;
+        }
+
+        result += line.len;
+
+        /* Done unless the entry was written at the start of the file */
+        if (lseek(auditLogFileFd, 0, SEEK_CUR) != line.len)
+            break;
+
+        if (auditSharedState != NULL)
+            fileEpoch = pg_atomic_fetch_add_u32(&auditSharedState->fileEpoch,
+                                                1) + 1;
+
+        auditBinaryEpoch = fileEpoch;
+
+        if (opened)
+            break;
+
+        /* Write the entry again with its names defined */
+        hash_destroy(auditBinaryName);
+        auditBinaryName = NULL;
+        resetStringInfo(&line);
+    }
+
+    pfree(line.data);
+
+    return result;
+}
+
+/*
+ * Tag an error raised by an audited statement with the statement and
+ * substatement IDs of its entries so the error can still be linked to them
+ * when they are not in the server log.  The tag is added to the context.
+ */
+static void
+capture_tag_error(ErrorData *edata)
+{
+    AuditEventStackItem *stackItem;
+    int64 substatementId = 0;
+    StringInfoData context;
+
+    /* Nothing has been logged for the statement */
+    if (auditEventStack == NULL || !statementLogged)
+        return;
+
+    /* Use the innermost substatement that was logged */
+    for (stackItem = auditEventStack; stackItem != NULL;
+         stackItem = stackItem->next)
+    {
+        if (stackItem->auditEvent.substatementId != 0)
+        {
+            substatementId = stackItem->auditEvent.substatementId;
+            break;
+        }
+    }
+
+    initStringInfo(&context);
+
+    if (edata->context != NULL)
+        appendStringInfo(&context, "%s\n", edata->context);
+
+    appendStringInfo(&context,
+                     "audited statement " INT64_FORMAT ", substatement "
+                     INT64_FORMAT, statementTotal, substatementId);
+
+    edata->context = context.data;
+}
+
+/*
+ * Stack functions
+ *
+ * Audit events can go down to multiple levels so a stack is maintained to keep
+ * track of them.
+ */
+
+/*
+ * Copy a field of an entry, which may be NULL, into the current memory context.
+ */
+static const char *
+log_audit_strdup(const char *field)
+{
+    return field == NULL ? NULL : pstrdup(field);
+}
+
+/*
+ * Return the parameter field of an entry, formatting the parameters if they
+ * were copied for the buffer but the entry is written elsewhere after all.
+ */
+static const char *
+log_audit_param_text(const AuditEntry *entry)
+{
+    StringInfoData paramStr;
+
+    if (entry->paramText != NULL)
+        return entry->paramText;
+
+    initStringInfo(&paramStr);
+    buffer_param_format(entry->paramData, entry->paramDataLen, &paramStr);
+
+    return paramStr.data;
+}
+
+/*
+ * Format an entry as CSV, as it is written to the server log.  If suffixStr is
+ * not NULL and the parameters were copied for the buffer, the parameter field
+ * is left out and the fields after it go to suffixStr.
+ */
+static void
+log_audit_format(const AuditEntry *entry, StringInfo auditStr,
+                 StringInfo suffixStr)
+{
+    /*
+     * Note: use of INT64_FORMAT here is bad for translatability, but we
+     * currently haven't got translation support in pgaudit anyway.
+     */
+    appendStringInfo(auditStr,
+                     AUDIT_PREFIX "%s," INT64_FORMAT "," INT64_FORMAT ",%s,",
+                     entry->flags & AUDIT_ENTRY_OBJECT ?
+                     AUDIT_TYPE_OBJECT : AUDIT_TYPE_SESSION,
+                     entry->statementId, entry->substatementId,
+                     entry->className);
+
+    append_valid_csv(auditStr, entry->command);
+
+    appendStringInfoCharMacro(auditStr, ',');
+    append_valid_csv(auditStr, entry->objectType);
+
+    appendStringInfoCharMacro(auditStr, ',');
+    append_valid_csv(auditStr, entry->objectName);
+
+    appendStringInfoCharMacro(auditStr, ',');
+
+    if (entry->flags & AUDIT_ENTRY_STATEMENT)
+    {
+        append_valid_csv(auditStr, entry->commandText);
+
+        appendStringInfoCharMacro(auditStr, ',');
+
+        if (!(entry->flags & AUDIT_ENTRY_PARAMETER))
+            appendStringInfoString(auditStr, "<not logged>");
+        else if (suffixStr != NULL && entry->paramText == NULL)
+            auditStr = suffixStr;
+        else
+            append_valid_csv(auditStr, log_audit_param_text(entry));
+    }
+    else
+        appendStringInfoString(auditStr,
+                               "<previously logged>,<previously logged>");
+
+    if (entry->flags & AUDIT_ENTRY_ROWS)
+    {
+        if (entry->flags & AUDIT_ENTRY_ROWS_KNOWN)
+            appendStringInfo(auditStr, "," UINT64_FORMAT, entry->rows);
+        else
+            appendStringInfoString(auditStr, ",<unknown>");
+    }
+
+    if (entry->flags & AUDIT_ENTRY_DURATION)
+    {
+        if (entry->flags & AUDIT_ENTRY_DURATION_KNOWN)
+            appendStringInfo(auditStr, ",%.3f",
+                             (double) entry->duration / 1000000);
+        else
+            appendStringInfoString(auditStr, ",<unknown>");
+    }
+}
+
+/*
+ * Check if an entry reported at pgaudit.log_level would be sent to the client,
+ * by the same rules as elog.c.
+ */
+static bool
+log_audit_client(void)
+{
+    return whereToSendOutput == DestRemote &&
+           (auditLogLevel >= client_min_messages || auditLogLevel == INFO);
+}
+
+/*
+ * Write an entry to the log and to the recent entries buffer.  Returns the
+ * number of bytes logged.
+ *
+ * Entries for pgaudit.log_file are written here and only reported if they must
+ * also go to the client or if they could not be written.  In the binary format
+ * they are only formatted as CSV if they must also go to the client or the
+ * buffer.  Entries that only go to the buffer are not reported
+ * when their parameters were copied for the buffer, see
+ * pgaudit.buffer_defer_format.
+ */
+static int
+log_audit_emit(const AuditEntry *entry)
+{
+    StringInfoData auditStr;
+    int written = 0;
+    int result;
+
+    /* Add entries with copied parameters to the buffer, if they fit */
+    if (auditLogDestination == AUDIT_DESTINATION_BUFFER &&
+        auditBuffer != NULL && entry->paramData != NULL &&
+        !log_audit_client())
+    {
+        StringInfoData suffixStr;
+        bool added;
+
+        initStringInfo(&auditStr);
+        initStringInfo(&suffixStr);
+        log_audit_format(entry, &auditStr, &suffixStr);
+
+        added = buffer_add(auditStr.data, suffixStr.data, entry->paramData,
+                           entry->paramDataLen);
+        result = auditStr.len + suffixStr.len + entry->paramDataLen;
+
+        pfree(auditStr.data);
+        pfree(suffixStr.data);
+
+        if (added)
+            return result;
+    }
+
+    if (auditLogDestination == AUDIT_DESTINATION_FILE &&
+        auditLogFileFormat == AUDIT_FILE_FORMAT_BINARY)
+    {
+        written = capture_binary_write(entry);
+
+        if (written > 0 && auditBuffer == NULL && !log_audit_client())
+            return written;
+    }
+
+    initStringInfo(&auditStr);
+    log_audit_format(entry, &auditStr, NULL);
+
+    if (auditLogDestination == AUDIT_DESTINATION_FILE &&
+        auditLogFileFormat == AUDIT_FILE_FORMAT_CSV &&
+        capture_file_write(auditStr.data + strlen(AUDIT_PREFIX)))
+        written = auditStr.len;
+
+    if (written == 0 || log_audit_client())
+    {
+        /*
+         * Tag the message so the emit_log_hook can divert it.  The tag must be
+         * cleared if the hook raises an error or later messages would be taken
+         * for entries.
+         */
+        auditEmitting = true;
+        auditEmittingWritten = written > 0;
+
+        PG_TRY();
+        {
+            ereport(auditLogLevel,
+                    (errmsg("%s", auditStr.data),
+                     errhidestmt(true),
+                     errhidecontext(true)));
+        }
+        PG_CATCH();
+        {
+            auditEmitting = false;
+            auditEmittingWritten = false;
+            PG_RE_THROW();
+        }
+        PG_END_TRY();
+
+        auditEmitting = false;
+        auditEmittingWritten = false;
+    }
+
+    buffer_add(auditStr.data, NULL, NULL, 0);
+
+    result = written > 0 ? written : auditStr.len;
+    pfree(auditStr.data);
+
+    return result;
+}
+
+/*
+ * Emit deferred entries with the rows processed and the duration, skipping
+ * READ and WRITE entries when fewer than minRows rows were processed.
+ */
+static void
+log_audit_deferred(List *logDeferred, int flags, uint64 rows,
+                   uint64 duration, uint64 minRows)
+{
+    ListCell *lc;
+
+    foreach(lc, logDeferred)
     {
-            /* All mods go in WRITE class, except EXECUTE */
-        case LOGSTMT_MOD:
-            className = CLASS_WRITE;
-            class = LOG_WRITE;
+        AuditDeferredEntry *deferredEntry = (AuditDeferredEntry *) lfirst(lc);
+        AuditEntry *entry = &deferredEntry->entry;
+        int bytes;
 
-            switch (stackItem->auditEvent.commandTag)
-            {
-                    /* Currently, only EXECUTE is different */
-                case T_ExecuteStmt:
-                    className = CLASS_MISC;
-                    class = LOG_MISC;
-                    break;
-                default:
-                    break;
-            }
-            break;
+        /* Skip READ and WRITE entries when too few rows were processed */
+        if (deferredEntry->filterRows && rows < minRows)
+        {
+            stat_add(statClass[deferredEntry->classIdx].suppressed, 1);
+            continue;
+        }
 
-            /* These are DDL, unless they are ROLE */
-        case LOGSTMT_DDL:
-            className = CLASS_DDL;
-            class = LOG_DDL;
+        entry->flags |= flags;
+        entry->rows = rows;
+        entry->duration = duration;
 
-            /* Identify role statements */
-            switch (stackItem->auditEvent.commandTag)
-            {
-                /* In the case of create and alter role redact all text in the
-                 * command after the password token for security.  This doesn't
-                 * cover all possible cases where passwords can be leaked but
-                 * should take care of the most common usage.
-                 */
-                case T_CreateRoleStmt:
-                case T_AlterRoleStmt:
+        bytes = log_audit_emit(entry);
 
-                    if (stackItem->auditEvent.commandText != NULL)
-                    {
-                        char *commandStr;
-                        char *passwordToken;
-                        int i;
-                        int passwordPos;
+        stat_add(statClass[deferredEntry->classIdx].events[
+                 entry->flags & AUDIT_ENTRY_OBJECT ?
+                 AUDIT_TYPE_INDEX_OBJECT : AUDIT_TYPE_INDEX_SESSION], 1);
+        stat_add(statClass[deferredEntry->classIdx].bytes, bytes);
+    }
+}
 
-                        /* Copy the command string and convert to lower case */
-                        commandStr = pstrdup(stackItem->auditEvent.commandText);
+/*
+ * Emit the entries that were deferred until the statement completed, adding
+ * the rows processed and the duration and applying the row threshold.
+ */
+static void
+log_audit_complete(AuditEventStackItem *stackItem)
+{
+    MemoryContext contextOld;
+    int flags = 0;
+    uint64 duration = 0;
 
-                        for (i = 0; commandStr[i]; i++)
-                            commandStr[i] =
-                                (char)pg_tolower((unsigned char)commandStr[i]);
+    if (stackItem->logDeferred == NIL)
+        return;
 
-                        /* Find index of password token */
-                        passwordToken = strstr(commandStr, TOKEN_PASSWORD);
+    contextOld = MemoryContextSwitchTo(stackItem->contextAudit);
 
-                        if (passwordToken != NULL)
-                        {
-                            /* Copy command string up to password token */
-                            passwordPos = (passwordToken - commandStr) +
-                                          strlen(TOKEN_PASSWORD);
+    /* The fields are the same for every entry of the statement */
+    if (stackItem->logRows)
+        flags |= AUDIT_ENTRY_ROWS | AUDIT_ENTRY_ROWS_KNOWN;
 
-                            commandStr = palloc(passwordPos + 1 +
-                                                strlen(TOKEN_REDACTED) + 1);
+    if (stackItem->logDuration)
+    {
+        flags |= AUDIT_ENTRY_DURATION | AUDIT_ENTRY_DURATION_KNOWN;
+        duration = stat_clock() - stackItem->auditEvent.timeStart;
+    }
 
-                            strncpy(commandStr,
-                                    stackItem->auditEvent.commandText,
-                                    passwordPos);
+    log_audit_deferred(stackItem->logDeferred, flags,
+                       stackItem->auditEvent.rows, duration,
+                       (uint64) stackItem->logMinRows);
 
-                            /* And append redacted token */
-                            commandStr[passwordPos] = ' ';
+    MemoryContextSwitchTo(contextOld);
 
-                            strcpy(commandStr + passwordPos + 1, TOKEN_REDACTED);
+    MemoryContextDelete(stackItem->contextDeferred);
+    stackItem->contextDeferred = NULL;
+    stackItem->logDeferred = NIL;
+}
 
-                            /* Assign new command string */
-                            stackItem->auditEvent.commandText = commandStr;
-                        }
-                    }
+/*
+ * Emit the entries of statements that did not complete.  The rows are unknown
+ * but the entries are still logged since the statements were attempted.
+ * Called at the end of transactions and subtransactions, after the error has
+ * been handled, and when the next statement ends in case the stack item
+ * outlived the transaction callback.
+ */
+static void
+log_audit_failed(void)
+{
+    while (auditFailed != NULL)
+    {
+        AuditFailed *failed = auditFailed;
+        MemoryContext contextOld;
 
-                /* Classify role statements */
-                case T_GrantStmt:
-                case T_GrantRoleStmt:
-                case T_DropRoleStmt:
-                case T_AlterRoleSetStmt:
-                case T_AlterDefaultPrivilegesStmt:
-                    className = CLASS_ROLE;
-                    class = LOG_ROLE;
-                    break;
-
-                    /*
-                     * Rename and Drop are general and therefore we have to do
-                     * an additional check against the command string to see
-                     * if they are role or regular DDL.
-                     */
-                case T_RenameStmt:
-                case T_DropStmt:
-                    if (pg_strcasecmp(stackItem->auditEvent.command,
-                                      COMMAND_ALTER_ROLE) == 0 ||
-                        pg_strcasecmp(stackItem->auditEvent.command,
-                                      COMMAND_DROP_ROLE) == 0)
-                    {
-                        className = CLASS_ROLE;
-                        class = LOG_ROLE;
-                    }
-                    break;
+        /* Take the statement off first so an error cannot log it twice */
+        auditFailed = failed->next;
 
-                default:
-                    break;
-            }
-            break;
+        if (auditFailed == NULL)
+            auditFailedTail = &auditFailed;
+
+        contextOld = MemoryContextSwitchTo(failed->contextDeferred);
+        log_audit_deferred(failed->logDeferred, failed->flags, 0,
+                           failed->duration, 0);
+        MemoryContextSwitchTo(contextOld);
+
+        MemoryContextDelete(failed->contextDeferred);
+    }
+}
+
+/*
+ * Keep the deferred entries of a statement whose stack item is being freed
+ * before they were logged, e.g. because the statement raised an error.  This
+ * runs in a memory context callback, where nothing may be logged, so the
+ * entries are left for log_audit_failed().
+ */
+static void
+stack_fail(AuditEventStackItem *stackItem)
+{
+    AuditFailed *failed;
+
+    if (stackItem->logDeferred == NIL)
+        return;
+
+    failed = MemoryContextAlloc(stackItem->contextDeferred,
+                                sizeof(AuditFailed));
+    failed->next = NULL;
+    failed->contextDeferred = stackItem->contextDeferred;
+    failed->logDeferred = stackItem->logDeferred;
+    failed->flags = stackItem->logRows ? AUDIT_ENTRY_ROWS : 0;
+    failed->duration = 0;
+
+    if (stackItem->logDuration)
+    {
+        failed->flags |= AUDIT_ENTRY_DURATION | AUDIT_ENTRY_DURATION_KNOWN;
+        failed->duration = stat_clock() - stackItem->auditEvent.timeStart;
+    }
+
+    *auditFailedTail = failed;
+    auditFailedTail = &failed->next;
+
+    stackItem->contextDeferred = NULL;
+    stackItem->logDeferred = NIL;
+}
+
+/*
+ * Respond to callbacks registered with MemoryContextRegisterResetCallback().
+ * Removes the event(s) off the stack that have become obsolete once the
+ * MemoryContext has been freed.  The callback should always be freeing the top
+ * of the stack, but the code is tolerant of out-of-order callbacks.
+ */
+static void
+stack_free(void *stackFree)
+{
+    AuditEventStackItem *nextItem = auditEventStack;
+
+    /* Only process if the stack contains items */
+    while (nextItem != NULL)
+    {
+        /* Check if this item matches the item to be freed */
+        if (nextItem == (AuditEventStackItem *) stackFree)
+        {
+            /* Keep entries for a statement that did not complete */
+            stack_fail(nextItem);
 
-            /* Classify the rest */
-        case LOGSTMT_ALL:
-            switch (stackItem->auditEvent.commandTag)
+            /* Move top of stack to the item after the freed item */
+            auditEventStack = nextItem->next;
+
+            /* If the stack is not empty */
+            if (auditEventStack == NULL)
             {
-                    /* READ statements */
-                case T_CopyStmt:
-                case T_SelectStmt:
-                case T_PrepareStmt:
-                case T_PlannedStmt:
-                    className = CLASS_READ;
-                    class = LOG_READ;
-                    break;
-
-                    /* FUNCTION statements */
-                case T_DoStmt:
-                    className = CLASS_FUNCTION;
-                    class = LOG_FUNCTION;
-                    break;
-
-                default:
-                    break;
+                /*
+                 * Reset internal statement to false.  Normally this will be
+                 * reset but in case of an error it might be left set.
+                 */
+                internalStatement = false;
+
+                /*
+                 * Reset sub statement total so the next statement will start
+                 * from 1.
+                 */
+                substatementTotal = 0;
+
+                /*
+                 * Reset statement logged so that next statement will be
+                 * logged.
+                 */
+                statementLogged = false;
             }
-            break;
 
-        case LOGSTMT_NONE:
-            break;
+            return;
+        }
+
+        nextItem = nextItem->next;
     }
+}
+
+/*
+ * Push a new audit event onto the stack and create a new memory context to
+ * store it.
+ */
+static AuditEventStackItem *
+stack_push()
+{
+    MemoryContext contextAudit;
+    MemoryContext contextOld;
+    AuditEventStackItem *stackItem;
+
+    /*
+     * Create a new memory context to contain the stack item.  This will be
+     * free'd on stack_pop, or by our callback when the parent context is
+     * destroyed.
+     */
+    contextAudit = AllocSetContextCreate(CurrentMemoryContext,
+                                         "pgaudit stack context",
+                                         ALLOCSET_DEFAULT_MINSIZE,
+                                         ALLOCSET_DEFAULT_INITSIZE,
+                                         ALLOCSET_DEFAULT_MAXSIZE);
+
+    /* Save the old context to switch back to at the end */
+    contextOld = MemoryContextSwitchTo(contextAudit);
+
+    /* Create our new stack item in our context */
+    stackItem = palloc0(sizeof(AuditEventStackItem));
+    stackItem->contextAudit = contextAudit;
+    stackItem->stackId = ++stackTotal;
+
+    /*
+     * Setup a callback in case an error happens.  stack_free() will truncate
+     * the stack at this item.
+     */
+    stackItem->contextCallback.func = stack_free;
+    stackItem->contextCallback.arg = (void *) stackItem;
+    MemoryContextRegisterResetCallback(contextAudit,
+                                       &stackItem->contextCallback);
+
+    /* Push new item onto the stack */
+    if (auditEventStack != NULL)
+        stackItem->next = auditEventStack;
+    else
+        stackItem->next = NULL;
+
+    auditEventStack = stackItem;
+
+    MemoryContextSwitchTo(contextOld);
+
+    return stackItem;
+}
+
+/*
+ * Mark a statement's stack item to defer its entries until the statement
+ * completes, if rows or duration are logged or a row threshold is set.  Only
+ * the clock read needed for the duration is done at the start of the
+ * statement.
+ */
+static void
+stack_defer(AuditEventStackItem *stackItem)
+{
+    stackItem->logRows = auditLogRows;
+    stackItem->logDuration = auditLogDuration;
+    stackItem->logMinRows = auditLogMinRows;
+    stackItem->logDefer = auditLogRows || auditLogDuration ||
+                          auditLogMinRows > 0 ||
+                          auditLogMinRowsRelation != NULL;
+
+    if (stackItem->logDuration)
+        stackItem->auditEvent.timeStart = stat_clock();
+}
+
+/*
+ * Pop an audit event from the stack by deleting the memory context that
+ * contains it.  The callback to stack_free() does the actual pop.
+ */
+static void
+stack_pop(int64 stackId)
+{
+    /* Make sure what we want to delete is at the top of the stack */
+    if (auditEventStack != NULL && auditEventStack->stackId == stackId)
+        MemoryContextDelete(auditEventStack->contextAudit);
+    else
+        elog(ERROR, "pgaudit stack item " INT64_FORMAT " not found on top - cannot pop",
+             stackId);
+}
+
+/*
+ * Check that an item is on the stack.  If not, an error will be raised since
+ * this is a bad state to be in and it might mean audit records are being lost.
+ */
+static void
+stack_valid(int64 stackId)
+{
+    AuditEventStackItem *nextItem = auditEventStack;
+
+    /* Look through the stack for the stack entry */
+    while (nextItem != NULL && nextItem->stackId != stackId)
+        nextItem = nextItem->next;
+
+    /* If we didn't find it, something went wrong. */
+    if (nextItem == NULL)
+        elog(ERROR, "pgaudit stack item " INT64_FORMAT
+             " not found - top of stack is " INT64_FORMAT "",
+             stackId,
+             auditEventStack == NULL ? (int64) -1 : auditEventStack->stackId);
+}
+
+/*
+ * Takes an AuditEvent, classifies it, then logs it if appropriate.
+ *
+ * Logging is decided based on if the statement is in one of the classes being
+ * logged or if an object used has been marked for auditing.
+ *
+ * Objects are marked for auditing by the auditor role being granted access
+ * to the object.  The kind of access (INSERT, UPDATE, etc) is also considered
+ * and logging is only performed when the kind of access matches the granted
+ * right on the object.
+ *
+ * This will need to be updated if new kinds of GRANTs are added.
+ */
+static void
+log_audit_event(AuditEventStackItem *stackItem)
+{
+    int class;
+    const char *className;
+    int classIdx;
+    MemoryContext contextOld;
+    AuditEntry entry;
+    AuditEventStackItem *deferItem;
+    AuditTiming timing;
+
+    /* If this event has already been logged don't log it again */
+    if (stackItem->auditEvent.logged)
+        return;
+
+    /* Classify the statement using log stmt level and the command tag */
+    class = audit_classify(stackItem->auditEvent.logStmtLevel,
+                           stackItem->auditEvent.commandTag,
+                           stackItem->auditEvent.command, &className);
 
     /*----------
      * Only log the statement if:
@@ -624,8 +2715,19 @@ log_audit_event(AuditEventStackItem *stackItem)
      * If neither of these is true, return.
      *----------
      */
+    /* Find the statistics index of the class (only one bit is ever set) */
+    classIdx = 0;
+
+    while ((1 << classIdx) != class)
+        classIdx++;
+
     if (!stackItem->auditEvent.granted && !(auditLogBitmap & class))
+    {
+        stat_add(statClass[classIdx].suppressed, 1);
         return;
+    }
+
+    stat_timing_start(&timing);
 
     /*
      * Use audit memory context in case something is not free'd while
@@ -633,6 +2735,16 @@ log_audit_event(AuditEventStackItem *stackItem)
      */
     contextOld = MemoryContextSwitchTo(stackItem->contextAudit);
 
+    /*
+     * Redact passwords from role, foreign server, and user mapping commands.
+     * Other commands are returned as is.
+     */
+    if (stackItem->auditEvent.commandText != NULL)
+        stackItem->auditEvent.commandText =
+            audit_redact_password(stackItem->auditEvent.commandTag,
+                                  stackItem->auditEvent.commandText,
+                                  standard_conforming_strings);
+
     /* Set statement and substatement IDs */
     if (stackItem->auditEvent.statementId == 0)
     {
@@ -647,104 +2759,183 @@ log_audit_event(AuditEventStackItem *stackItem)
         stackItem->auditEvent.substatementId = ++substatementTotal;
     }
 
-    /*
-     * Create the audit substring
-     *
-     * The type-of-audit-log and statement/substatement ID are handled below,
-     * this string is everything else.
-     */
-    initStringInfo(&auditStr);
-    append_valid_csv(&auditStr, stackItem->auditEvent.command);
-
-    appendStringInfoCharMacro(&auditStr, ',');
-    append_valid_csv(&auditStr, stackItem->auditEvent.objectType);
-
-    appendStringInfoCharMacro(&auditStr, ',');
-    append_valid_csv(&auditStr, stackItem->auditEvent.objectName);
+    /* Collect the fields of the entry */
+    memset(&entry, 0, sizeof(entry));
+    entry.flags = stackItem->auditEvent.granted ? AUDIT_ENTRY_OBJECT : 0;
+    entry.statementId = stackItem->auditEvent.statementId;
+    entry.substatementId = stackItem->auditEvent.substatementId;
+    entry.className = className;
+    entry.command = stackItem->auditEvent.command;
+    entry.objectType = stackItem->auditEvent.objectType;
+    entry.objectName = stackItem->auditEvent.objectName;
 
     /*
      * If auditLogStatmentOnce is true, then only log the statement and
      * parameters if they have not already been logged for this substatement.
      */
-    appendStringInfoCharMacro(&auditStr, ',');
     if (!stackItem->auditEvent.statementLogged || !auditLogStatementOnce)
     {
-        append_valid_csv(&auditStr, stackItem->auditEvent.commandText);
+        entry.flags |= AUDIT_ENTRY_STATEMENT;
+        entry.commandText = stackItem->auditEvent.commandText;
+
+        /* Handle parameter logging, if enabled. */
+        if (auditLogParameter)
+        {
+            /*
+             * Format the parameters only the first time they are needed.
+             * Statements that log more than one entry (object or relation
+             * logging) reuse the result rather than calling the type output
+             * functions again for every entry.
+             */
+            if (stackItem->auditEvent.paramText == NULL &&
+                stackItem->auditEvent.paramData == NULL)
+            {
+                int paramIdx;
+                int numParams;
+                StringInfoData paramStrResult;
+                ParamListInfo paramList = stackItem->auditEvent.paramList;
 
-        appendStringInfoCharMacro(&auditStr, ',');
+                numParams = paramList == NULL ? 0 : paramList->numParams;
+
+                /*
+                 * Copy the parameters to be formatted when the buffer is read
+                 * if that is the only place the entry is going.
+                 */
+                if (numParams > 0 && auditBufferDeferFormat &&
+                    auditLogDestination == AUDIT_DESTINATION_BUFFER &&
+                    auditBuffer != NULL && !log_audit_client())
+                {
+                    StringInfoData paramData;
+
+                    initStringInfo(&paramData);
+                    buffer_param_copy(paramList, &paramData);
+
+                    stackItem->auditEvent.paramData = paramData.data;
+                    stackItem->auditEvent.paramDataLen = paramData.len;
+                }
+                else if (numParams == 0)
+                    stackItem->auditEvent.paramText = pstrdup("<none>");
+                else
+                {
+                    /* Create the param substring */
+                    initStringInfo(&paramStrResult);
+
+                    /* Iterate through all params */
+                    for (paramIdx = 0; paramIdx < numParams; paramIdx++)
+                    {
+                        ParamExternData *prm = &paramList->params[paramIdx];
+                        Oid typeOutput;
+                        bool typeIsVarLena;
+                        char *paramStr;
+
+                        /* Add a comma for each param */
+                        if (paramIdx != 0)
+                            appendStringInfoCharMacro(&paramStrResult, ',');
+
+                        /* Skip if null or if oid is invalid */
+                        if (prm->isnull || !OidIsValid(prm->ptype))
+                            continue;
+
+                        /* Output the string */
+                        getTypeOutputInfo(prm->ptype, &typeOutput,
+                                          &typeIsVarLena);
+                        paramStr = OidOutputFunctionCall(typeOutput,
+                                                         prm->value);
+
+                        append_valid_csv(&paramStrResult, paramStr);
+                        pfree(paramStr);
+                    }
+
+                    stackItem->auditEvent.paramText = paramStrResult.data;
+                }
+            }
+
+            entry.flags |= AUDIT_ENTRY_PARAMETER;
+            entry.paramText = stackItem->auditEvent.paramText;
+            entry.paramData = stackItem->auditEvent.paramData;
+            entry.paramDataLen = stackItem->auditEvent.paramDataLen;
+        }
+
+        stackItem->auditEvent.statementLogged = true;
+    }
+
+    /*
+     * Defer the entry to the statement that will complete it when rows or
+     * duration are logged or a row threshold is set.  Function calls are
+     * logged on a stack item of their own so the statement may be further
+     * down the stack.
+     */
+    for (deferItem = stackItem; deferItem != NULL; deferItem = deferItem->next)
+        if (deferItem->logDefer)
+            break;
 
-        /* Handle parameter logging, if enabled. */
-        if (auditLogParameter)
+    if (deferItem != NULL)
+    {
+        AuditDeferredEntry *deferredEntry;
+
+        /* Entries outlive the stack item if the statement fails */
+        if (deferItem->contextDeferred == NULL)
+            deferItem->contextDeferred = AllocSetContextCreate(
+                                             TopMemoryContext,
+                                             "pgaudit deferred context",
+                                             ALLOCSET_SMALL_MINSIZE,
+                                             ALLOCSET_SMALL_INITSIZE,
+                                             ALLOCSET_SMALL_MAXSIZE);
+
+        MemoryContextSwitchTo(deferItem->contextDeferred);
+
+        /* Copy the fields, which may not outlive this stack item */
+        deferredEntry = palloc(sizeof(AuditDeferredEntry));
+        deferredEntry->entry = entry;
+        deferredEntry->entry.command = log_audit_strdup(entry.command);
+        deferredEntry->entry.objectType = log_audit_strdup(entry.objectType);
+        deferredEntry->entry.objectName = log_audit_strdup(entry.objectName);
+        deferredEntry->entry.commandText = log_audit_strdup(entry.commandText);
+        deferredEntry->entry.paramText = log_audit_strdup(entry.paramText);
+
+        if (entry.paramData != NULL)
         {
-            int paramIdx;
-            int numParams;
-            StringInfoData paramStrResult;
-            ParamListInfo paramList = stackItem->auditEvent.paramList;
-
-            numParams = paramList == NULL ? 0 : paramList->numParams;
+            char *paramData = palloc(entry.paramDataLen);
 
-            /* Create the param substring */
-            initStringInfo(&paramStrResult);
+            memcpy(paramData, entry.paramData, entry.paramDataLen);
+            deferredEntry->entry.paramData = paramData;
+        }
 
-            /* Iterate through all params */
-            for (paramIdx = 0; paramList != NULL && paramIdx < numParams;
-                 paramIdx++)
-            {
-                ParamExternData *prm = &paramList->params[paramIdx];
-                Oid typeOutput;
-                bool typeIsVarLena;
-                char *paramStr;
+        deferredEntry->classIdx = classIdx;
+        deferredEntry->filterRows = !stackItem->auditEvent.granted &&
+                                    (class == LOG_READ || class == LOG_WRITE);
 
-                /* Add a comma for each param */
-                if (paramIdx != 0)
-                    appendStringInfoCharMacro(&paramStrResult, ',');
+        deferItem->logDeferred = lappend(deferItem->logDeferred,
+                                         deferredEntry);
 
-                /* Skip if null or if oid is invalid */
-                if (prm->isnull || !OidIsValid(prm->ptype))
-                    continue;
+        MemoryContextSwitchTo(stackItem->contextAudit);
+    }
+    /* Else log the audit entry */
+    else
+    {
+        int bytes;
 
-                /* Output the string */
-                getTypeOutputInfo(prm->ptype, &typeOutput, &typeIsVarLena);
-                paramStr = OidOutputFunctionCall(typeOutput, prm->value);
+        /* Rows and duration are not known if enabled after the start */
+        if (auditLogRows)
+            entry.flags |= AUDIT_ENTRY_ROWS;
 
-                append_valid_csv(&paramStrResult, paramStr);
-                pfree(paramStr);
-            }
+        if (auditLogDuration)
+            entry.flags |= AUDIT_ENTRY_DURATION;
 
-            if (numParams == 0)
-                appendStringInfoString(&auditStr, "<none>");
-            else
-                append_valid_csv(&auditStr, paramStrResult.data);
-        }
-        else
-            appendStringInfoString(&auditStr, "<not logged>");
+        bytes = log_audit_emit(&entry);
 
-        stackItem->auditEvent.statementLogged = true;
+        stat_add(statClass[classIdx].events[stackItem->auditEvent.granted ?
+                 AUDIT_TYPE_INDEX_OBJECT : AUDIT_TYPE_INDEX_SESSION], 1);
+        stat_add(statClass[classIdx].bytes, bytes);
     }
-    else
-        /* we were asked to not log it */
-        appendStringInfoString(&auditStr,
-                               "<previously logged>,<previously logged>");
 
-    /*
-     * Log the audit entry.  Note: use of INT64_FORMAT here is bad for
-     * translatability, but we currently haven't got translation support in
-     * pgaudit anyway.
-     */
-    ereport(auditLogLevel,
-            (errmsg("AUDIT: %s," INT64_FORMAT "," INT64_FORMAT ",%s,%s",
-                    stackItem->auditEvent.granted ?
-                    AUDIT_TYPE_OBJECT : AUDIT_TYPE_SESSION,
-                    stackItem->auditEvent.statementId,
-                    stackItem->auditEvent.substatementId,
-                    className,
-                    auditStr.data),
-                    errhidestmt(true),
-                    errhidecontext(true)));
+    stat_add(statHook[AUDIT_HOOK_LOG_AUDIT_EVENT].calls, 1);
 
     stackItem->auditEvent.logged = true;
 
     MemoryContextSwitchTo(contextOld);
+
+    stat_timing_end(AUDIT_HOOK_LOG_AUDIT_EVENT, &timing);
 }
 
 /*
@@ -814,138 +3005,627 @@ audit_on_acl(Datum aclDatum,
         }
     }
 
-    /* if we have a detoasted copy, free it */
-    if (acl && (Pointer) acl != DatumGetPointer(aclDatum))
-        pfree(acl);
+    /* if we have a detoasted copy, free it */
+    if (acl && (Pointer) acl != DatumGetPointer(aclDatum))
+        pfree(acl);
+
+    return result;
+}
+
+/*
+ * Check if a role has any of the permissions in the mask on a relation.
+ */
+static bool
+audit_on_relation(Oid relOid,
+                  Oid auditOid,
+                  AclMode mask)
+{
+    bool result = false;
+    HeapTuple tuple;
+    Datum aclDatum;
+    bool isNull;
+
+    stat_add(statHook[AUDIT_HOOK_EXECUTOR_CHECK_PERMS].aclChecks, 1);
+
+    /* Get relation tuple from pg_class */
+    tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relOid));
+    if (!HeapTupleIsValid(tuple))
+        return false;
+
+    /* Get the relation's ACL */
+    aclDatum = SysCacheGetAttr(RELOID, tuple, Anum_pg_class_relacl,
+                               &isNull);
+
+    /* Only check if non-NULL, since NULL means no permissions */
+    if (!isNull)
+        result = audit_on_acl(aclDatum, auditOid, mask);
+
+    /* Free the relation tuple */
+    ReleaseSysCache(tuple);
+
+    return result;
+}
+
+/*
+ * Check if a role has any of the permissions in the mask on a column.
+ */
+static bool
+audit_on_attribute(Oid relOid,
+                   AttrNumber attNum,
+                   Oid auditOid,
+                   AclMode mask)
+{
+    bool result = false;
+    HeapTuple attTuple;
+    Datum aclDatum;
+    bool isNull;
+
+    stat_add(statHook[AUDIT_HOOK_EXECUTOR_CHECK_PERMS].aclChecks, 1);
+
+    /* Get the attribute's ACL */
+    attTuple = SearchSysCache2(ATTNUM,
+                               ObjectIdGetDatum(relOid),
+                               Int16GetDatum(attNum));
+    if (!HeapTupleIsValid(attTuple))
+        return false;
+
+    /* Only consider attributes that have not been dropped */
+    if (!((Form_pg_attribute) GETSTRUCT(attTuple))->attisdropped)
+    {
+        aclDatum = SysCacheGetAttr(ATTNUM, attTuple, Anum_pg_attribute_attacl,
+                                   &isNull);
+
+        if (!isNull)
+            result = audit_on_acl(aclDatum, auditOid, mask);
+    }
+
+    /* Free attribute */
+    ReleaseSysCache(attTuple);
+
+    return result;
+}
+
+/*
+ * Check if a role has any of the permissions in the mask on a column in
+ * the provided set.  If the set is empty, then all valid columns in the
+ * relation will be tested.
+ */
+static bool
+audit_on_any_attribute(Oid relOid,
+                       Oid auditOid,
+                       Bitmapset *attributeSet,
+                       AclMode mode)
+{
+    bool result = false;
+    AttrNumber col;
+    Bitmapset *tmpSet;
+
+    /* If bms is empty then check for any column match */
+    if (bms_is_empty(attributeSet))
+    {
+        HeapTuple classTuple;
+        AttrNumber nattrs;
+        AttrNumber curr_att;
+
+        /* Get relation to determine total columns */
+        classTuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relOid));
+
+        if (!HeapTupleIsValid(classTuple))
+            return false;
+
+        nattrs = ((Form_pg_class) GETSTRUCT(classTuple))->relnatts;
+        ReleaseSysCache(classTuple);
+
+        /* Check each column */
+        for (curr_att = 1; curr_att <= nattrs; curr_att++)
+            if (audit_on_attribute(relOid, curr_att, auditOid, mode))
+                return true;
+    }
+
+    /* bms_first_member is destructive, so make a copy before using it. */
+    tmpSet = bms_copy(attributeSet);
+
+    /* Check each column */
+    while ((col = bms_first_member(tmpSet)) >= 0)
+    {
+        col += FirstLowInvalidHeapAttributeNumber;
+
+        if (col != InvalidAttrNumber &&
+            audit_on_attribute(relOid, col, auditOid, mode))
+        {
+            result = true;
+            break;
+        }
+    }
+
+    bms_free(tmpSet);
+
+    return result;
+}
+
+/*
+ * Plan Cache
+ *
+ * Prepared statements execute the same plan many times, and each execution
+ * would otherwise reopen every relation in the range table to find its object
+ * type and name and repeat the object audit ACL checks.  The results are
+ * cached per range table, which belongs to the plan and so is the same list
+ * on every execution of a cached plan.
+ *
+ * A range table is only cached the second time it is seen so that one-shot
+ * statements, which get a new range table every time, only pay for a hash
+ * lookup.  A list can be freed and its address reused by another plan, so
+ * every RTE is compared with the cached relation, required permissions, and
+ * columns before an entry is used.
+ *
+ * Invalidation callbacks can run in the middle of log_select_dml() (e.g.
+ * while an ACL check reads the catalog) so they only mark entries as invalid.
+ * Invalid entries are rebuilt, or the cache reset, on the next lookup.
+ * Entries are invalidated when one of their relations is invalidated (e.g.
+ * renamed or GRANTs changed), and the whole cache when schemas, roles, or role
+ * memberships change or when it grows beyond AUDIT_PLAN_CACHE_MAX entries.
+ */
+#define AUDIT_PLAN_CACHE_MAX        1024
+
+/* Audit metadata for an RTE_RELATION range table entry */
+typedef struct AuditPlanRelation
+{
+    /* Copied from the RTE and compared on every lookup */
+    Oid relOid;
+    char relKind;
+    AclMode requiredPerms;
+    Bitmapset *selectedCols;
+    Bitmapset *insertedCols;
+    Bitmapset *updatedCols;
+
+    /* Derived from the RTE and the relation */
+    LogStmtLevel logStmtLevel;
+    NodeTag commandTag;
+    const char *command;
+    const char *objectType;
+    bool systemRelation;        /* In a system namespace */
+    Oid namespaceOid;
+    NameData relationName;
+    char *objectName;           /* Built the first time it is needed */
+
+    /* Object audit result for the audit role of the entry */
+    bool grantedValid;
+    bool granted;
+} AuditPlanRelation;
+
+typedef struct AuditPlanEntry
+{
+    List *rangeTable;           /* Hash key */
+    bool populated;             /* Relations have been filled in */
+    bool invalid;               /* Must be rebuilt before use */
+    Oid auditOid;               /* Audit role used for granted */
+    int relationTotal;
+    AuditPlanRelation *relation;
+} AuditPlanEntry;
+
+static HTAB *auditPlanCache = NULL;
+static MemoryContext auditPlanCacheContext = NULL;
+static bool auditPlanCacheReset = false;
+
+/*
+ * Fill in audit metadata for a relation RTE.  The column sets are copied into
+ * the current memory context when the relation is to be cached.
+ */
+static void
+plan_relation_init(AuditPlanRelation *relation, RangeTblEntry *rte,
+                   bool copy)
+{
+    Relation rel;
+
+    relation->relOid = rte->relid;
+    relation->relKind = rte->relkind;
+    relation->requiredPerms = rte->requiredPerms;
+    relation->selectedCols =
+        copy ? bms_copy(rte->selectedCols) : rte->selectedCols;
+    relation->insertedCols =
+        copy ? bms_copy(rte->insertedCols) : rte->insertedCols;
+    relation->updatedCols =
+        copy ? bms_copy(rte->updatedCols) : rte->updatedCols;
+
+    /*
+     * We don't have access to the parsetree here, so we have to generate
+     * the node type, object type, and command tag by decoding
+     * rte->requiredPerms and rte->relkind.
+     */
+    if (rte->requiredPerms & ACL_INSERT)
+    {
+        relation->logStmtLevel = LOGSTMT_MOD;
+        relation->commandTag = T_InsertStmt;
+        relation->command = COMMAND_INSERT;
+    }
+    else if (rte->requiredPerms & ACL_UPDATE)
+    {
+        relation->logStmtLevel = LOGSTMT_MOD;
+        relation->commandTag = T_UpdateStmt;
+        relation->command = COMMAND_UPDATE;
+    }
+    else if (rte->requiredPerms & ACL_DELETE)
+    {
+        relation->logStmtLevel = LOGSTMT_MOD;
+        relation->commandTag = T_DeleteStmt;
+        relation->command = COMMAND_DELETE;
+    }
+    else if (rte->requiredPerms & ACL_SELECT)
+    {
+        relation->logStmtLevel = LOGSTMT_ALL;
+        relation->commandTag = T_SelectStmt;
+        relation->command = COMMAND_SELECT;
+    }
+    else
+    {
+        relation->logStmtLevel = LOGSTMT_ALL;
+        relation->commandTag = T_Invalid;
+        relation->command = COMMAND_UNKNOWN;
+    }
+
+    relation->objectType = relation_object_type(rte->relkind);
+
+    /* Get the namespace and name, the qualified name is built when needed */
+    rel = relation_open(rte->relid, NoLock);
+
+    relation->namespaceOid = RelationGetNamespace(rel);
+    relation->systemRelation = IsSystemNamespace(relation->namespaceOid);
+    namestrcpy(&relation->relationName, RelationGetRelationName(rel));
+
+    relation_close(rel, NoLock);
+
+    relation->objectName = NULL;
+    relation->grantedValid = false;
+    relation->granted = false;
+}
+
+/*
+ * Check if the audit role has any of the permissions required on a relation,
+ * either on the relation itself or on any of the columns used.
+ */
+static bool
+plan_relation_granted(AuditPlanRelation *relation, Oid auditOid)
+{
+    bool granted = false;
+    AclMode auditPerms =
+        (ACL_SELECT | ACL_UPDATE | ACL_INSERT | ACL_DELETE) &
+        relation->requiredPerms;
+
+    /*
+     * If any of the required permissions for the relation are granted
+     * to the audit role then audit the relation
+     */
+    if (audit_on_relation(relation->relOid, auditOid, auditPerms))
+        granted = true;
+
+    /*
+     * Else check if the audit role has column-level permissions for
+     * select, insert, or update.
+     */
+    else if (auditPerms != 0)
+    {
+        /*
+         * Check the select columns
+         */
+        if (auditPerms & ACL_SELECT)
+            granted = audit_on_any_attribute(relation->relOid, auditOid,
+                                             relation->selectedCols,
+                                             ACL_SELECT);
+
+        /*
+         * Check the insert columns
+         */
+        if (!granted && auditPerms & ACL_INSERT)
+            granted = audit_on_any_attribute(relation->relOid, auditOid,
+                                             relation->insertedCols,
+                                             auditPerms);
+
+        /*
+         * Check the update columns
+         */
+        if (!granted && auditPerms & ACL_UPDATE)
+            granted = audit_on_any_attribute(relation->relOid, auditOid,
+                                             relation->updatedCols,
+                                             auditPerms);
+    }
+
+    return granted;
+}
+
+/*
+ * Free the relations of a cache entry.
+ */
+static void
+plan_cache_entry_free(AuditPlanEntry *entry)
+{
+    int relationIdx;
+
+    for (relationIdx = 0; relationIdx < entry->relationTotal; relationIdx++)
+    {
+        AuditPlanRelation *relation = &entry->relation[relationIdx];
+
+        bms_free(relation->selectedCols);
+        bms_free(relation->insertedCols);
+        bms_free(relation->updatedCols);
+
+        if (relation->objectName != NULL)
+            pfree(relation->objectName);
+    }
+
+    if (entry->relation != NULL)
+        pfree(entry->relation);
+
+    entry->relation = NULL;
+    entry->relationTotal = 0;
+    entry->populated = false;
+    entry->invalid = false;
+}
+
+/*
+ * Fill in a cache entry from the range table.  The relations are built in a
+ * local array and only assigned to the entry once they are all initialized,
+ * so an error part way through leaves the entry empty.
+ */
+static void
+plan_cache_entry_populate(AuditPlanEntry *entry, List *rangeTable)
+{
+    MemoryContext contextOld;
+    ListCell *lr;
+    AuditPlanRelation *relation;
+    int relationTotal = 0;
+    int relationIdx = 0;
+
+    foreach(lr, rangeTable)
+        if (((RangeTblEntry *) lfirst(lr))->rtekind == RTE_RELATION)
+            relationTotal++;
+
+    contextOld = MemoryContextSwitchTo(auditPlanCacheContext);
+
+    relation = relationTotal == 0 ? NULL :
+        palloc(sizeof(AuditPlanRelation) * relationTotal);
+
+    foreach(lr, rangeTable)
+    {
+        RangeTblEntry *rte = lfirst(lr);
+
+        if (rte->rtekind == RTE_RELATION)
+            plan_relation_init(&relation[relationIdx++], rte, true);
+    }
+
+    MemoryContextSwitchTo(contextOld);
+
+    entry->relation = relation;
+    entry->relationTotal = relationTotal;
+    entry->populated = true;
+}
+
+/*
+ * Check that a cache entry was built from a range table like this one.
+ */
+static bool
+plan_cache_entry_match(AuditPlanEntry *entry, List *rangeTable)
+{
+    ListCell *lr;
+    int relationIdx = 0;
+
+    foreach(lr, rangeTable)
+    {
+        RangeTblEntry *rte = lfirst(lr);
+        AuditPlanRelation *relation;
+
+        if (rte->rtekind != RTE_RELATION)
+            continue;
+
+        if (relationIdx == entry->relationTotal)
+            return false;
 
-    return result;
+        relation = &entry->relation[relationIdx++];
+
+        if (relation->relOid != rte->relid ||
+            relation->relKind != rte->relkind ||
+            relation->requiredPerms != rte->requiredPerms ||
+            !bms_equal(relation->selectedCols, rte->selectedCols) ||
+            !bms_equal(relation->insertedCols, rte->insertedCols) ||
+            !bms_equal(relation->updatedCols, rte->updatedCols))
+            return false;
+    }
+
+    return relationIdx == entry->relationTotal;
 }
 
 /*
- * Check if a role has any of the permissions in the mask on a relation.
+ * Invalidate entries that contain a relation, or all entries when the
+ * relation is InvalidOid.
  */
-static bool
-audit_on_relation(Oid relOid,
-                  Oid auditOid,
-                  AclMode mask)
+static void
+plan_cache_relcache_callback(Datum arg, Oid relOid)
 {
-    bool result = false;
-    HeapTuple tuple;
-    Datum aclDatum;
-    bool isNull;
+    HASH_SEQ_STATUS hashSeq;
+    AuditPlanEntry *entry;
 
-    /* Get relation tuple from pg_class */
-    tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relOid));
-    if (!HeapTupleIsValid(tuple))
-        return false;
+    if (auditPlanCache == NULL)
+        return;
 
-    /* Get the relation's ACL */
-    aclDatum = SysCacheGetAttr(RELOID, tuple, Anum_pg_class_relacl,
-                               &isNull);
+    if (relOid == InvalidOid)
+    {
+        auditPlanCacheReset = true;
+        return;
+    }
 
-    /* Only check if non-NULL, since NULL means no permissions */
-    if (!isNull)
-        result = audit_on_acl(aclDatum, auditOid, mask);
+    hash_seq_init(&hashSeq, auditPlanCache);
 
-    /* Free the relation tuple */
-    ReleaseSysCache(tuple);
+    while ((entry = hash_seq_search(&hashSeq)) != NULL)
+    {
+        int relationIdx;
 
-    return result;
+        for (relationIdx = 0; relationIdx < entry->relationTotal;
+             relationIdx++)
+        {
+            if (entry->relation[relationIdx].relOid == relOid)
+            {
+                entry->invalid = true;
+                break;
+            }
+        }
+    }
 }
 
 /*
- * Check if a role has any of the permissions in the mask on a column.
+ * Invalidate all entries when a namespace, role, or role membership changes.
  */
-static bool
-audit_on_attribute(Oid relOid,
-                   AttrNumber attNum,
-                   Oid auditOid,
-                   AclMode mask)
+static void
+plan_cache_syscache_callback(Datum arg, int cacheId, uint32 hashValue)
 {
-    bool result = false;
-    HeapTuple attTuple;
-    Datum aclDatum;
-    bool isNull;
+    auditPlanCacheReset = true;
+}
 
-    /* Get the attribute's ACL */
-    attTuple = SearchSysCache2(ATTNUM,
-                               ObjectIdGetDatum(relOid),
-                               Int16GetDatum(attNum));
-    if (!HeapTupleIsValid(attTuple))
-        return false;
+/*
+ * Create the cache, or empty it if a reset is pending.
+ */
+static void
+plan_cache_init(void)
+{
+    HASHCTL hashCtl;
 
-    /* Only consider attributes that have not been dropped */
-    if (!((Form_pg_attribute) GETSTRUCT(attTuple))->attisdropped)
+    if (auditPlanCacheContext == NULL)
     {
-        aclDatum = SysCacheGetAttr(ATTNUM, attTuple, Anum_pg_attribute_attacl,
-                                   &isNull);
-
-        if (!isNull)
-            result = audit_on_acl(aclDatum, auditOid, mask);
+        auditPlanCacheContext = AllocSetContextCreate(
+                                    TopMemoryContext,
+                                    "pgaudit plan cache",
+                                    ALLOCSET_DEFAULT_MINSIZE,
+                                    ALLOCSET_DEFAULT_INITSIZE,
+                                    ALLOCSET_DEFAULT_MAXSIZE);
+
+        CacheRegisterRelcacheCallback(plan_cache_relcache_callback,
+                                      (Datum) 0);
+        CacheRegisterSyscacheCallback(NAMESPACEOID,
+                                      plan_cache_syscache_callback,
+                                      (Datum) 0);
+        CacheRegisterSyscacheCallback(AUTHOID,
+                                      plan_cache_syscache_callback,
+                                      (Datum) 0);
+        CacheRegisterSyscacheCallback(AUTHMEMROLEMEM,
+                                      plan_cache_syscache_callback,
+                                      (Datum) 0);
     }
+    else
+        MemoryContextReset(auditPlanCacheContext);
 
-    /* Free attribute */
-    ReleaseSysCache(attTuple);
+    memset(&hashCtl, 0, sizeof(hashCtl));
+    hashCtl.keysize = sizeof(List *);
+    hashCtl.entrysize = sizeof(AuditPlanEntry);
+    hashCtl.hcxt = auditPlanCacheContext;
 
-    return result;
+    auditPlanCache = hash_create("pgaudit plan cache", 64, &hashCtl,
+                                 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    auditPlanCacheReset = false;
 }
 
 /*
- * Check if a role has any of the permissions in the mask on a column in
- * the provided set.  If the set is empty, then all valid columns in the
- * relation will be tested.
+ * Find the cache entry for a range table.  Returns NULL when the range table
+ * has not been seen before, in which case the caller must build the audit
+ * metadata itself.
  */
-static bool
-audit_on_any_attribute(Oid relOid,
-                       Oid auditOid,
-                       Bitmapset *attributeSet,
-                       AclMode mode)
+static AuditPlanEntry *
+plan_cache_lookup(List *rangeTable, Oid auditOid)
 {
-    bool result = false;
-    AttrNumber col;
-    Bitmapset *tmpSet;
+    AuditPlanEntry *entry;
+    bool found;
 
-    /* If bms is empty then check for any column match */
-    if (bms_is_empty(attributeSet))
+    if (auditPlanCache == NULL || auditPlanCacheReset)
+        plan_cache_init();
+
+    entry = hash_search(auditPlanCache, &rangeTable, HASH_ENTER, &found);
+
+    /* Remember the range table but don't cache it until it is seen again */
+    if (!found)
     {
-        HeapTuple classTuple;
-        AttrNumber nattrs;
-        AttrNumber curr_att;
+        entry->populated = false;
+        entry->invalid = false;
+        entry->auditOid = InvalidOid;
+        entry->relationTotal = 0;
+        entry->relation = NULL;
 
-        /* Get relation to determine total columns */
-        classTuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relOid));
+        stat_add(statHook[AUDIT_HOOK_EXECUTOR_CHECK_PERMS].cacheMisses, 1);
 
-        if (!HeapTupleIsValid(classTuple))
-            return false;
+        /* Start over when the cache is full */
+        if (hash_get_num_entries(auditPlanCache) > AUDIT_PLAN_CACHE_MAX)
+            auditPlanCacheReset = true;
 
-        nattrs = ((Form_pg_class) GETSTRUCT(classTuple))->relnatts;
-        ReleaseSysCache(classTuple);
+        return NULL;
+    }
 
-        /* Check each column */
-        for (curr_att = 1; curr_att <= nattrs; curr_att++)
-            if (audit_on_attribute(relOid, curr_att, auditOid, mode))
-                return true;
+    /* Rebuild the entry if it was invalidated or belonged to another plan */
+    if (entry->populated &&
+        (entry->invalid || !plan_cache_entry_match(entry, rangeTable)))
+        plan_cache_entry_free(entry);
+
+    if (entry->populated)
+        stat_add(statHook[AUDIT_HOOK_EXECUTOR_CHECK_PERMS].cacheHits, 1);
+    else
+    {
+        stat_add(statHook[AUDIT_HOOK_EXECUTOR_CHECK_PERMS].cacheMisses, 1);
+        plan_cache_entry_populate(entry, rangeTable);
     }
 
-    /* bms_first_member is destructive, so make a copy before using it. */
-    tmpSet = bms_copy(attributeSet);
+    /* Grants must be checked again if the audit role has changed */
+    if (entry->auditOid != auditOid)
+    {
+        int relationIdx;
 
-    /* Check each column */
-    while ((col = bms_first_member(tmpSet)) >= 0)
+        for (relationIdx = 0; relationIdx < entry->relationTotal;
+             relationIdx++)
+            entry->relation[relationIdx].grantedValid = false;
+
+        entry->auditOid = auditOid;
+    }
+
+    return entry;
+}
+
+/*
+ * Return the row threshold for a relation from pgaudit.log_min_rows_relation,
+ * or pgaudit.log_min_rows when the relation is not listed.  The schema name
+ * is only looked up when a listed relation name matches.
+ */
+static int
+log_min_rows_relation(AuditPlanRelation *relation)
+{
+    int relationIdx;
+    char *schemaName = NULL;
+    int minRows = auditLogMinRows;
+
+    if (auditLogMinRowsRelation == NULL)
+        return minRows;
+
+    for (relationIdx = 0; relationIdx < auditLogMinRowsRelation->total;
+         relationIdx++)
     {
-        col += FirstLowInvalidHeapAttributeNumber;
+        AuditMinRowsRelation *minRowsRelation =
+            &auditLogMinRowsRelation->relation[relationIdx];
 
-        if (col != InvalidAttrNumber &&
-            audit_on_attribute(relOid, col, auditOid, mode))
+        if (strcmp(minRowsRelation->relationName,
+                   NameStr(relation->relationName)) != 0)
+            continue;
+
+        if (minRowsRelation->schemaName[0] != '\0')
         {
-            result = true;
-            break;
+            if (schemaName == NULL)
+                schemaName = get_namespace_name(relation->namespaceOid);
+
+            if (schemaName == NULL ||
+                strcmp(minRowsRelation->schemaName, schemaName) != 0)
+                continue;
         }
+
+        minRows = minRowsRelation->minRows;
+        break;
     }
 
-    bms_free(tmpSet);
+    if (schemaName != NULL)
+        pfree(schemaName);
 
-    return result;
+    return minRows;
 }
 
 /*
@@ -957,16 +3637,23 @@ log_select_dml(Oid auditOid, List *rangeTabls)
     ListCell *lr;
     bool first = true;
     bool found = false;
+    AuditPlanEntry *planEntry;
+    int relationIdx = 0;
+    int minRows = -1;
+    bool logging = auditOid != InvalidOid || auditLogBitmap != 0;
 
     /* Do not log if this is an internal statement */
     if (internalStatement)
         return;
 
+    /* Get cached audit metadata for the range table, if any */
+    planEntry = plan_cache_lookup(rangeTabls, auditOid);
+
     foreach(lr, rangeTabls)
     {
-        Oid relOid;
-        Relation rel;
         RangeTblEntry *rte = lfirst(lr);
+        AuditPlanRelation relationLocal;
+        AuditPlanRelation *relation;
 
         /* We only care about tables, and can ignore subqueries etc. */
         if (rte->rtekind != RTE_RELATION)
@@ -983,17 +3670,37 @@ log_select_dml(Oid auditOid, List *rangeTabls)
         if (!is_member_of_role(GetSessionUserId(), GetUserId()))
             return;
 
+        /* Use the cached metadata for the relation or build it */
+        if (planEntry != NULL)
+            relation = &planEntry->relation[relationIdx++];
+        else
+        {
+            relation = &relationLocal;
+            plan_relation_init(relation, rte, false);
+        }
+
+        /* Count the access, system relations are never counted */
+        if (auditTopObjects > 0 && !relation->systemRelation)
+            top_add(RelationRelationId, relation->relOid, relation->command);
+
+        /* Nothing more to do if the relations are only being counted */
+        if (!logging)
+            continue;
+
         /*
          * If we are not logging all-catalog queries (auditLogCatalog is
          * false) then filter out any system relations here.
          */
-        relOid = rte->relid;
-        rel = relation_open(relOid, NoLock);
+        if (!auditLogCatalog && relation->systemRelation)
+            continue;
 
-        if (!auditLogCatalog && IsSystemNamespace(RelationGetNamespace(rel)))
+        /* The statement's row threshold is the lowest of its relations */
+        if (auditEventStack->logDefer)
         {
-            relation_close(rel, NoLock);
-            continue;
+            int relationMinRows = log_min_rows_relation(relation);
+
+            if (minRows < 0 || relationMinRows < minRows)
+                minRows = relationMinRows;
         }
 
         /*
@@ -1013,140 +3720,48 @@ log_select_dml(Oid auditOid, List *rangeTabls)
             first = false;
         }
 
-        /*
-         * We don't have access to the parsetree here, so we have to generate
-         * the node type, object type, and command tag by decoding
-         * rte->requiredPerms and rte->relkind.
-         */
-        if (rte->requiredPerms & ACL_INSERT)
-        {
-            auditEventStack->auditEvent.logStmtLevel = LOGSTMT_MOD;
-            auditEventStack->auditEvent.commandTag = T_InsertStmt;
-            auditEventStack->auditEvent.command = COMMAND_INSERT;
-        }
-        else if (rte->requiredPerms & ACL_UPDATE)
-        {
-            auditEventStack->auditEvent.logStmtLevel = LOGSTMT_MOD;
-            auditEventStack->auditEvent.commandTag = T_UpdateStmt;
-            auditEventStack->auditEvent.command = COMMAND_UPDATE;
-        }
-        else if (rte->requiredPerms & ACL_DELETE)
-        {
-            auditEventStack->auditEvent.logStmtLevel = LOGSTMT_MOD;
-            auditEventStack->auditEvent.commandTag = T_DeleteStmt;
-            auditEventStack->auditEvent.command = COMMAND_DELETE;
-        }
-        else if (rte->requiredPerms & ACL_SELECT)
-        {
-            auditEventStack->auditEvent.logStmtLevel = LOGSTMT_ALL;
-            auditEventStack->auditEvent.commandTag = T_SelectStmt;
-            auditEventStack->auditEvent.command = COMMAND_SELECT;
-        }
-        else
-        {
-            auditEventStack->auditEvent.logStmtLevel = LOGSTMT_ALL;
-            auditEventStack->auditEvent.commandTag = T_Invalid;
-            auditEventStack->auditEvent.command = COMMAND_UNKNOWN;
-        }
+        auditEventStack->auditEvent.logStmtLevel = relation->logStmtLevel;
+        auditEventStack->auditEvent.commandTag = relation->commandTag;
+        auditEventStack->auditEvent.command = relation->command;
+        auditEventStack->auditEvent.objectType = relation->objectType;
 
-        /* Use the relation type to assign object type */
-        switch (rte->relkind)
+        /* Perform object auditing only if the audit role is valid */
+        if (auditOid != InvalidOid)
         {
-            case RELKIND_RELATION:
-                auditEventStack->auditEvent.objectType = OBJECT_TYPE_TABLE;
-                break;
-
-            case RELKIND_INDEX:
-                auditEventStack->auditEvent.objectType = OBJECT_TYPE_INDEX;
-                break;
-
-            case RELKIND_SEQUENCE:
-                auditEventStack->auditEvent.objectType = OBJECT_TYPE_SEQUENCE;
-                break;
-
-            case RELKIND_TOASTVALUE:
-                auditEventStack->auditEvent.objectType = OBJECT_TYPE_TOASTVALUE;
-                break;
-
-            case RELKIND_VIEW:
-                auditEventStack->auditEvent.objectType = OBJECT_TYPE_VIEW;
-                break;
-
-            case RELKIND_COMPOSITE_TYPE:
-                auditEventStack->auditEvent.objectType = OBJECT_TYPE_COMPOSITE_TYPE;
-                break;
-
-            case RELKIND_FOREIGN_TABLE:
-                auditEventStack->auditEvent.objectType = OBJECT_TYPE_FOREIGN_TABLE;
-                break;
-
-            case RELKIND_MATVIEW:
-                auditEventStack->auditEvent.objectType = OBJECT_TYPE_MATVIEW;
-                break;
+            if (!relation->grantedValid)
+            {
+                relation->granted = plan_relation_granted(relation, auditOid);
+                relation->grantedValid = true;
+            }
 
-            default:
-                auditEventStack->auditEvent.objectType = OBJECT_TYPE_UNKNOWN;
-                break;
+            auditEventStack->auditEvent.granted = relation->granted;
         }
 
-        /* Get a copy of the relation name and assign it to object name */
-        auditEventStack->auditEvent.objectName =
-            quote_qualified_identifier(get_namespace_name(
-                                           RelationGetNamespace(rel)),
-                                       RelationGetRelationName(rel));
-        relation_close(rel, NoLock);
-
-        /* Perform object auditing only if the audit role is valid */
-        if (auditOid != InvalidOid)
+        /*
+         * Build the qualified relation name, but only if a relation level
+         * entry is going to be logged.  It requires a catalog lookup and is
+         * wasted effort for relations that are not logged.
+         */
+        if ((auditEventStack->auditEvent.granted || auditLogRelation) &&
+            relation->objectName == NULL)
         {
-            AclMode auditPerms =
-                (ACL_SELECT | ACL_UPDATE | ACL_INSERT | ACL_DELETE) &
-                rte->requiredPerms;
-
-            /*
-             * If any of the required permissions for the relation are granted
-             * to the audit role then audit the relation
-             */
-            if (audit_on_relation(relOid, auditOid, auditPerms))
-                auditEventStack->auditEvent.granted = true;
+            MemoryContext contextOld = NULL;
+            char *namespaceName;
 
-            /*
-             * Else check if the audit role has column-level permissions for
-             * select, insert, or update.
-             */
-            else if (auditPerms != 0)
-            {
-                /*
-                 * Check the select columns
-                 */
-                if (auditPerms & ACL_SELECT)
-                    auditEventStack->auditEvent.granted =
-                        audit_on_any_attribute(relOid, auditOid,
-                                               rte->selectedCols,
-                                               ACL_SELECT);
+            if (planEntry != NULL)
+                contextOld = MemoryContextSwitchTo(auditPlanCacheContext);
 
-                /*
-                 * Check the insert columns
-                 */
-                if (!auditEventStack->auditEvent.granted &&
-                    auditPerms & ACL_INSERT)
-                    auditEventStack->auditEvent.granted =
-                        audit_on_any_attribute(relOid, auditOid,
-                                               rte->insertedCols,
-                                               auditPerms);
+            namespaceName = get_namespace_name(relation->namespaceOid);
+            relation->objectName = quote_qualified_identifier(
+                namespaceName, NameStr(relation->relationName));
+            pfree(namespaceName);
 
-                /*
-                 * Check the update columns
-                 */
-                if (!auditEventStack->auditEvent.granted &&
-                    auditPerms & ACL_UPDATE)
-                    auditEventStack->auditEvent.granted =
-                        audit_on_any_attribute(relOid, auditOid,
-                                               rte->updatedCols,
-                                               auditPerms);
-            }
+            if (planEntry != NULL)
+                MemoryContextSwitchTo(contextOld);
         }
 
+        auditEventStack->auditEvent.objectName = relation->objectName;
+
         /* Do relation level logging if a grant was found */
         if (auditEventStack->auditEvent.granted)
         {
@@ -1162,15 +3777,22 @@ log_select_dml(Oid auditOid, List *rangeTabls)
             log_audit_event(auditEventStack);
         }
 
-        pfree(auditEventStack->auditEvent.objectName);
+        /* The name belongs to the cache or is freed here */
+        auditEventStack->auditEvent.objectName = NULL;
+
+        if (planEntry == NULL && relation->objectName != NULL)
+            pfree(relation->objectName);
     }
 
+    if (minRows >= 0)
+        auditEventStack->logMinRows = minRows;
+
     /*
      * If no tables were found that means that RangeTbls was empty or all
      * relations were in the system schema.  In that case still log a session
      * record.
      */
-    if (!found)
+    if (!found && logging)
     {
         auditEventStack->auditEvent.granted = false;
         auditEventStack->auditEvent.logged = false;
@@ -1208,8 +3830,19 @@ log_function_execute(Oid objectId)
         return;
     }
 
+    if (auditTopObjects > 0)
+        top_add(ProcedureRelationId, objectId, COMMAND_EXECUTE);
+
+    /* Nothing more to do if the function is only being counted */
+    if (!(auditLogBitmap & LOG_FUNCTION))
+    {
+        ReleaseSysCache(proctup);
+        return;
+    }
+
     /* Push audit event onto the stack */
     stackItem = stack_push();
+    stat_add(statHook[AUDIT_HOOK_OBJECT_ACCESS].stackPushes, 1);
 
     /* Generate the fully-qualified function name. */
     stackItem->auditEvent.objectName =
@@ -1237,6 +3870,9 @@ static ExecutorCheckPerms_hook_type next_ExecutorCheckPerms_hook = NULL;
 static ProcessUtility_hook_type next_ProcessUtility_hook = NULL;
 static object_access_hook_type next_object_access_hook = NULL;
 static ExecutorStart_hook_type next_ExecutorStart_hook = NULL;
+static ExecutorEnd_hook_type next_ExecutorEnd_hook = NULL;
+static shmem_startup_hook_type next_shmem_startup_hook = NULL;
+static emit_log_hook_type next_emit_log_hook = NULL;
 
 /*
  * Hook ExecutorStart to get the query text and basic command type for queries
@@ -1247,11 +3883,31 @@ static void
 pgaudit_ExecutorStart_hook(QueryDesc *queryDesc, int eflags)
 {
     AuditEventStackItem *stackItem = NULL;
+    AuditTiming timing;
+
+    /*
+     * Parallel workers execute part of a plan that the leader has already
+     * started, so the leader alone audits the statement.  Skip everything,
+     * including statistics, so that the hook costs workers nothing.
+     */
+    if (IsParallelWorker())
+    {
+        if (next_ExecutorStart_hook)
+            next_ExecutorStart_hook(queryDesc, eflags);
+        else
+            standard_ExecutorStart(queryDesc, eflags);
+
+        return;
+    }
+
+    stat_timing_start(&timing);
+    stat_add(statHook[AUDIT_HOOK_EXECUTOR_START].calls, 1);
 
     if (!internalStatement)
     {
         /* Push the audit even onto the stack */
         stackItem = stack_push();
+        stat_add(statHook[AUDIT_HOOK_EXECUTOR_START].stackPushes, 1);
 
         /* Initialize command using queryDesc->operation */
         switch (queryDesc->operation)
@@ -1290,8 +3946,13 @@ pgaudit_ExecutorStart_hook(QueryDesc *queryDesc, int eflags)
         /* Initialize the audit event */
         stackItem->auditEvent.commandText = queryDesc->sourceText;
         stackItem->auditEvent.paramList = queryDesc->params;
+
+        /* Defer logging to ExecutorEnd if rows or duration are logged */
+        stack_defer(stackItem);
     }
 
+    stat_timing_end(AUDIT_HOOK_EXECUTOR_START, &timing);
+
     /* Call the previous hook or standard function */
     if (next_ExecutorStart_hook)
         next_ExecutorStart_hook(queryDesc, eflags);
@@ -1317,21 +3978,98 @@ static bool
 pgaudit_ExecutorCheckPerms_hook(List *rangeTabls, bool abort)
 {
     Oid auditOid;
+    AuditTiming timing;
+
+    /* The leader has already checked and logged the relations */
+    if (IsParallelWorker())
+        return next_ExecutorCheckPerms_hook == NULL ||
+               (*next_ExecutorCheckPerms_hook) (rangeTabls, abort);
+
+    stat_timing_start(&timing);
+    stat_add(statHook[AUDIT_HOOK_EXECUTOR_CHECK_PERMS].calls, 1);
 
     /* Get the audit oid if the role exists */
     auditOid = get_role_oid(auditRole, true);
 
-    /* Log DML if the audit role is valid or session logging is enabled */
-    if ((auditOid != InvalidOid || auditLogBitmap != 0) &&
+    /*
+     * Log DML if the audit role is valid or session logging is enabled, or
+     * count the accesses if top objects are tracked.
+     */
+    if ((auditOid != InvalidOid || auditLogBitmap != 0 ||
+         auditTopObjects > 0) &&
         !IsAbortedTransactionBlockState())
         log_select_dml(auditOid, rangeTabls);
 
+    stat_timing_end(AUDIT_HOOK_EXECUTOR_CHECK_PERMS, &timing);
+
     /* Call the next hook function */
     if (next_ExecutorCheckPerms_hook &&
         !(*next_ExecutorCheckPerms_hook) (rangeTabls, abort))
         return false;
 
-    return true;
+    return true;
+}
+
+/*
+ * Hook ExecutorEnd to log entries that were deferred until the rows processed
+ * and the duration of the statement are known.
+ */
+static void
+pgaudit_ExecutorEnd_hook(QueryDesc *queryDesc)
+{
+    AuditEventStackItem *stackItem;
+    AuditTiming timing;
+
+    if (!IsParallelWorker())
+    {
+        stat_timing_start(&timing);
+        stat_add(statHook[AUDIT_HOOK_EXECUTOR_END].calls, 1);
+
+        /* Statements that failed come before this one */
+        log_audit_failed();
+
+        /*
+         * Find the stack item pushed by ExecutorStart for this query, which
+         * was moved to the query memory context.  It is usually on top but
+         * a cursor may be closed while another statement is running.
+         */
+        for (stackItem = auditEventStack; stackItem != NULL;
+             stackItem = stackItem->next)
+        {
+            if (stackItem->contextAudit->parent ==
+                queryDesc->estate->es_query_cxt)
+            {
+                stackItem->auditEvent.rows = queryDesc->estate->es_processed;
+                log_audit_complete(stackItem);
+                break;
+            }
+        }
+
+        stat_timing_end(AUDIT_HOOK_EXECUTOR_END, &timing);
+    }
+
+    /* Call the previous hook or standard function */
+    if (next_ExecutorEnd_hook)
+        next_ExecutorEnd_hook(queryDesc);
+    else
+        standard_ExecutorEnd(queryDesc);
+}
+
+/*
+ * Return the rows processed by a utility statement from the count at the end
+ * of its completion tag, e.g. "COPY 10", or zero when there is no count.
+ */
+static uint64
+utility_rows(const char *completionTag)
+{
+    const char *rowsStr;
+
+    if (completionTag == NULL ||
+        (rowsStr = strrchr(completionTag, ' ')) == NULL ||
+        !isdigit((unsigned char) rowsStr[1]))
+        return 0;
+
+    return (uint64) strtoull(rowsStr + 1, NULL, 10);
 }
 
 /*
@@ -1347,6 +4085,10 @@ pgaudit_ProcessUtility_hook(Node *parsetree,
 {
     AuditEventStackItem *stackItem = NULL;
     int64 stackId = 0;
+    AuditTiming timing;
+
+    stat_timing_start(&timing);
+    stat_add(statHook[AUDIT_HOOK_PROCESS_UTILITY].calls, 1);
 
     /*
      * Don't audit substatements.  All the substatements we care about should
@@ -1366,12 +4108,17 @@ pgaudit_ProcessUtility_hook(Node *parsetree,
         else
             stackItem = stack_push();
 
+        stat_add(statHook[AUDIT_HOOK_PROCESS_UTILITY].stackPushes, 1);
+
         stackId = stackItem->stackId;
         stackItem->auditEvent.logStmtLevel = GetCommandLogLevel(parsetree);
         stackItem->auditEvent.commandTag = nodeTag(parsetree);
         stackItem->auditEvent.command = CreateCommandTag(parsetree);
         stackItem->auditEvent.commandText = queryString;
 
+        /* Defer logging to completion if rows or duration are logged */
+        stack_defer(stackItem);
+
         /*
          * If this is a DO block log it before calling the next ProcessUtility
          * hook.
@@ -1382,6 +4129,9 @@ pgaudit_ProcessUtility_hook(Node *parsetree,
             log_audit_event(stackItem);
     }
 
+    /* Don't include the rest of the chain in the timing */
+    stat_timing_pause(&timing);
+
     /* Call the standard process utility chain. */
     if (next_ProcessUtility_hook)
         (*next_ProcessUtility_hook) (parsetree, queryString, context,
@@ -1390,6 +4140,8 @@ pgaudit_ProcessUtility_hook(Node *parsetree,
         standard_ProcessUtility(parsetree, queryString, context,
                                 params, dest, completionTag);
 
+    stat_timing_resume(&timing);
+
     /*
      * Process the audit event if there is one.  Also check that this event
      * was not popped off the stack by a memory context being free'd
@@ -1410,9 +4162,48 @@ pgaudit_ProcessUtility_hook(Node *parsetree,
          */
         if (auditLogBitmap != 0 && !stackItem->auditEvent.logged)
             log_audit_event(stackItem);
+
+        /*
+         * Log deferred entries.  Utility statements that process rows (e.g.
+         * COPY, FETCH, CREATE TABLE AS) report the count in the completion
+         * tag.
+         */
+        stackItem->auditEvent.rows = utility_rows(completionTag);
+        log_audit_complete(stackItem);
+    }
+
+    stat_timing_end(AUDIT_HOOK_PROCESS_UTILITY, &timing);
+}
+
+/*
+ * Log the entries of statements that failed once the transaction has been
+ * aborted, when the error has been handled, and write the open compressed
+ * frame at the end of each transaction so entries reach the file in good
+ * time.  Entries are logged before the frame is written so they go in it.
+ */
+static void
+pgaudit_xact_callback(XactEvent event, void *arg)
+{
+    if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT ||
+        event == XACT_EVENT_PREPARE)
+    {
+        log_audit_failed();
+        capture_compress_flush();
     }
 }
 
+/*
+ * Log the entries of statements that failed in a subtransaction once it has
+ * been aborted, e.g. in a PL/pgSQL exception block.
+ */
+static void
+pgaudit_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                         SubTransactionId parentSubid, void *arg)
+{
+    if (event == SUBXACT_EVENT_ABORT_SUB)
+        log_audit_failed();
+}
+
 /*
  * Hook object_access_hook to provide fully-qualified object names for function
  * calls.
@@ -1424,14 +4215,63 @@ pgaudit_object_access_hook(ObjectAccessType access,
                             int subId,
                             void *arg)
 {
-    if (auditLogBitmap & LOG_FUNCTION && access == OAT_FUNCTION_EXECUTE &&
-        auditEventStack && !IsAbortedTransactionBlockState())
-        log_function_execute(objectId);
+    AuditTiming timing;
+
+    /*
+     * Functions are not logged in parallel workers.  The leader initializes
+     * the whole plan, including the part run by workers, and logs them then.
+     */
+    if (!IsParallelWorker())
+    {
+        stat_timing_start(&timing);
+        stat_add(statHook[AUDIT_HOOK_OBJECT_ACCESS].calls, 1);
+
+        if ((auditLogBitmap & LOG_FUNCTION || auditTopObjects > 0) &&
+            access == OAT_FUNCTION_EXECUTE &&
+            auditEventStack && !IsAbortedTransactionBlockState())
+            log_function_execute(objectId);
+
+        stat_timing_end(AUDIT_HOOK_OBJECT_ACCESS, &timing);
+    }
 
     if (next_object_access_hook)
         (*next_object_access_hook) (access, classId, objectId, subId, arg);
 }
 
+/*
+ * Hook emit_log to keep entries that log_audit_emit() has written to
+ * pgaudit.log_destination out of the server log and to tag errors raised by
+ * audited statements.  Only messages that are written to the server log reach
+ * the hook.
+ */
+static void
+pgaudit_emit_log_hook(ErrorData *edata)
+{
+    if (auditLogDestination != AUDIT_DESTINATION_SERVER)
+    {
+        if (auditEmitting)
+        {
+            bool captured;
+
+            /* log_audit_emit() adds the entry to the buffer */
+            if (auditLogDestination == AUDIT_DESTINATION_BUFFER)
+                captured = auditBuffer != NULL;
+            /* log_audit_emit() wrote the entry to the file unless it failed */
+            else
+                captured = auditEmittingWritten;
+
+            /* Suppress the entry from the server log once captured */
+            if (captured)
+                edata->output_to_server = false;
+        }
+        else if (edata->elevel >= ERROR)
+            capture_tag_error(edata);
+    }
+
+    if (next_emit_log_hook)
+        (*next_emit_log_hook) (edata);
+}
+
 /*
  * Event trigger functions
  */
@@ -1628,13 +4468,564 @@ pgaudit_sql_drop(PG_FUNCTION_ARGS)
     /* Complete the query */
     SPI_finish();
 
-    MemoryContextSwitchTo(contextOld);
-    MemoryContextDelete(contextQuery);
+    MemoryContextSwitchTo(contextOld);
+    MemoryContextDelete(contextQuery);
+
+    /* No longer in an internal statement */
+    internalStatement = false;
+
+    PG_RETURN_NULL();
+}
+
+/*
+ * Statistics functions
+ */
+
+/*
+ * Prepare a tuplestore to return the rows of a set-returning function in
+ * materialize mode.
+ */
+static Tuplestorestate *
+stat_tuplestore_init(FunctionCallInfo fcinfo, TupleDesc *tupDesc)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Tuplestorestate *tupStore;
+    MemoryContext contextOld;
+
+    /* Shared memory must have been initialized */
+    if (auditSharedState == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pgaudit must be loaded via shared_preload_libraries")));
+
+    /* Check to see if caller supports us returning a tuplestore */
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("set-valued function called in context that cannot "
+                        "accept a set")));
+
+    if (!(rsinfo->allowedModes & SFRM_Materialize))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("materialize mode required, but it is not allowed in "
+                        "this context")));
+
+    /* Build a tuple descriptor for our result type */
+    if (get_call_result_type(fcinfo, NULL, tupDesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    /* Create the tuplestore in the per-query context */
+    contextOld =
+        MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+    tupStore = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupStore;
+    rsinfo->setDesc = *tupDesc;
+
+    MemoryContextSwitchTo(contextOld);
+
+    return tupStore;
+}
+
+/*
+ * Return the statistics for each log class.
+ */
+Datum
+pgaudit_stat_class(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupDesc;
+    Tuplestorestate *tupStore;
+    int classIdx;
+
+    tupStore = stat_tuplestore_init(fcinfo, &tupDesc);
+
+    for (classIdx = 0; classIdx < AUDIT_CLASS_TOTAL; classIdx++)
+    {
+        AuditStatClass *statClass = &auditSharedState->statClass[classIdx];
+        Datum values[6];
+        bool nulls[6] = {false};
+
+        values[0] = CStringGetTextDatum(auditClassName[classIdx]);
+        values[1] = Int64GetDatum((int64) pg_atomic_read_u64(
+            &statClass->events[AUDIT_TYPE_INDEX_SESSION]));
+        values[2] = Int64GetDatum((int64) pg_atomic_read_u64(
+            &statClass->events[AUDIT_TYPE_INDEX_OBJECT]));
+        values[3] = Int64GetDatum((int64) pg_atomic_read_u64(
+            &statClass->suppressed));
+        values[4] = Int64GetDatum((int64) pg_atomic_read_u64(
+            &statClass->bytes));
+        values[5] = TimestampTzGetDatum((TimestampTz) pg_atomic_read_u64(
+            &auditSharedState->statReset));
+
+        tuplestore_putvalues(tupStore, tupDesc, values, nulls);
+    }
+
+    tuplestore_donestoring(tupStore);
+
+    return (Datum) 0;
+}
+
+/*
+ * Return the statistics for each hook.
+ */
+Datum
+pgaudit_stat_hook(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupDesc;
+    Tuplestorestate *tupStore;
+    int hookIdx;
+
+    tupStore = stat_tuplestore_init(fcinfo, &tupDesc);
+
+    /* Include this backend's timings */
+    stat_flush_local();
+
+    for (hookIdx = 0; hookIdx < AUDIT_HOOK_TOTAL; hookIdx++)
+    {
+        AuditStatHook *statHook = &auditSharedState->statHook[hookIdx];
+        Datum values[7];
+        bool nulls[7] = {false};
+
+        values[0] = CStringGetTextDatum(auditHookName[hookIdx]);
+        values[1] = Int64GetDatum((int64) pg_atomic_read_u64(
+            &statHook->calls));
+        values[2] = Int64GetDatum((int64) pg_atomic_read_u64(
+            &statHook->stackPushes));
+        values[3] = Int64GetDatum((int64) pg_atomic_read_u64(
+            &statHook->aclChecks));
+        values[4] = Int64GetDatum((int64) pg_atomic_read_u64(
+            &statHook->cacheHits));
+        values[5] = Int64GetDatum((int64) pg_atomic_read_u64(
+            &statHook->cacheMisses));
+
+        /* Time is stored in nanoseconds but reported in milliseconds */
+        values[6] = Float8GetDatum((double) pg_atomic_read_u64(
+            &statHook->time) / 1000000.0);
+
+        tuplestore_putvalues(tupStore, tupDesc, values, nulls);
+    }
+
+    tuplestore_donestoring(tupStore);
+
+    return (Datum) 0;
+}
+
+/*
+ * Return the latency histogram for each hook.  Only buckets that contain at
+ * least one call are returned.  Bucket bounds are reported in microseconds.
+ */
+Datum
+pgaudit_stat_hook_histogram(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupDesc;
+    Tuplestorestate *tupStore;
+    int hookIdx;
+    int bucketIdx;
+
+    tupStore = stat_tuplestore_init(fcinfo, &tupDesc);
+
+    /* Include this backend's timings */
+    stat_flush_local();
+
+    for (hookIdx = 0; hookIdx < AUDIT_HOOK_TOTAL; hookIdx++)
+    {
+        AuditStatHook *statHook = &auditSharedState->statHook[hookIdx];
+
+        for (bucketIdx = 0; bucketIdx < AUDIT_HISTOGRAM_TOTAL; bucketIdx++)
+        {
+            uint64 calls = pg_atomic_read_u64(&statHook->histogram[bucketIdx]);
+            Datum values[4];
+            bool nulls[4] = {false};
+
+            if (calls == 0)
+                continue;
+
+            values[0] = CStringGetTextDatum(auditHookName[hookIdx]);
+
+            /* The first bucket starts at zero, the last has no upper bound */
+            values[1] = Float8GetDatum(bucketIdx == 0 ? 0.0 :
+                (double) (UINT64CONST(1) << bucketIdx) / 1000.0);
+
+            if (bucketIdx == AUDIT_HISTOGRAM_TOTAL - 1)
+                nulls[2] = true;
+            else
+                values[2] = Float8GetDatum(
+                    (double) (UINT64CONST(1) << (bucketIdx + 1)) / 1000.0);
+
+            values[3] = Int64GetDatum((int64) calls);
+
+            tuplestore_putvalues(tupStore, tupDesc, values, nulls);
+        }
+    }
+
+    tuplestore_donestoring(tupStore);
+
+    return (Datum) 0;
+}
+
+/*
+ * Reset all statistics.
+ */
+Datum
+pgaudit_stat_reset(PG_FUNCTION_ARGS)
+{
+    if (auditSharedState == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pgaudit must be loaded via shared_preload_libraries")));
+
+    stat_reset(false);
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * Number of fields parsed from an entry in the buffer, from AUDIT_TYPE to
+ * PARAMETER.
+ */
+#define AUDIT_BUFFER_FIELD_TOTAL    9
+
+/*
+ * Return the entries in the recent entries buffer, oldest first, optionally
+ * filtered by backend pid, session user, and object name.  The buffer is read
+ * without locks, entries that are overwritten while being read are skipped.
+ * Parameters copied for the buffer are formatted here.
+ */
+Datum
+pgaudit_recent(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupDesc;
+    Tuplestorestate *tupStore;
+    Oid roleId = InvalidOid;
+    char *objectName = NULL;
+    AuditBufferSlot *slotCopy;
+    uint64 eventTotal;
+    uint64 eventId;
+
+    tupStore = stat_tuplestore_init(fcinfo, &tupDesc);
+
+    /* A role that does not exist has no entries */
+    if (!PG_ARGISNULL(1))
+    {
+        roleId = get_role_oid(text_to_cstring(PG_GETARG_TEXT_PP(1)), true);
+
+        if (!OidIsValid(roleId))
+        {
+            tuplestore_donestoring(tupStore);
+            return (Datum) 0;
+        }
+    }
+
+    if (!PG_ARGISNULL(2))
+        objectName = text_to_cstring(PG_GETARG_TEXT_PP(2));
+
+    /* Nothing to return when the buffer is disabled */
+    if (auditBuffer == NULL)
+    {
+        tuplestore_donestoring(tupStore);
+        return (Datum) 0;
+    }
+
+    slotCopy = palloc(sizeof(AuditBufferSlot));
+    eventTotal = pg_atomic_read_u64(&auditBuffer->eventTotal);
+
+    for (eventId = eventTotal > (uint64) auditBufferSize ?
+         eventTotal - auditBufferSize : 0; eventId < eventTotal; eventId++)
+    {
+        AuditBufferSlot *slot = &auditBuffer->slot[eventId % auditBufferSize];
+        uint32 sequence = pg_atomic_read_u32(&slot->sequence);
+        char *field[AUDIT_BUFFER_FIELD_TOTAL];
+        char *entry;
+        const char *pField;
+        char *name;
+        int fieldIdx;
+        Datum values[16];
+        bool nulls[16] = {false};
+
+        /* Skip the slot if it is being written */
+        if (sequence & 1)
+            continue;
+
+        pg_read_barrier();
+        memcpy(slotCopy, slot, sizeof(AuditBufferSlot));
+        pg_read_barrier();
+
+        /*
+         * Skip the slot if it was written while being copied or it does not
+         * hold this entry yet.
+         */
+        if (pg_atomic_read_u32(&slot->sequence) != sequence ||
+            slotCopy->eventId != eventId + 1)
+            continue;
+
+        if ((!PG_ARGISNULL(0) && slotCopy->pid != PG_GETARG_INT32(0)) ||
+            (OidIsValid(roleId) && slotCopy->roleId != roleId))
+            continue;
+
+        /* Format the parameters if they were copied for the buffer */
+        if (slotCopy->paramDataLen > 0)
+            entry = buffer_entry_format(slotCopy);
+        else
+            entry = slotCopy->entry;
+
+        /* Split the entry into fields */
+        pField = entry;
+
+        for (fieldIdx = 0; fieldIdx < AUDIT_BUFFER_FIELD_TOTAL; fieldIdx++)
+            field[fieldIdx] = buffer_field_next(&pField);
+
+        if (objectName != NULL &&
+            (field[6] == NULL || strcmp(field[6], objectName) != 0))
+            continue;
+
+        values[0] = Int64GetDatum((int64) slotCopy->eventId);
+        values[1] = TimestampTzGetDatum(slotCopy->logTime);
+        values[2] = Int32GetDatum(slotCopy->pid);
+
+        if ((name = GetUserNameFromId(slotCopy->roleId, true)) != NULL)
+            values[3] = CStringGetTextDatum(name);
+        else
+            nulls[3] = true;
+
+        if ((name = get_database_name(slotCopy->databaseId)) != NULL)
+            values[4] = CStringGetTextDatum(name);
+        else
+            nulls[4] = true;
+
+        /* Statement and substatement IDs are numbers, the rest text */
+        for (fieldIdx = 0; fieldIdx < AUDIT_BUFFER_FIELD_TOTAL; fieldIdx++)
+        {
+            if (field[fieldIdx] == NULL)
+                nulls[fieldIdx + 5] = true;
+            else if (fieldIdx == 1 || fieldIdx == 2)
+                values[fieldIdx + 5] =
+                    Int64GetDatum(strtoll(field[fieldIdx], NULL, 10));
+            else
+                values[fieldIdx + 5] = CStringGetTextDatum(field[fieldIdx]);
+        }
+
+        values[14] = CStringGetTextDatum(entry);
+        values[15] = BoolGetDatum(slotCopy->truncated);
+
+        tuplestore_putvalues(tupStore, tupDesc, values, nulls);
+    }
+
+    tuplestore_donestoring(tupStore);
+
+    return (Datum) 0;
+}
+
+/*
+ * Sort top objects by accesses, highest first.
+ */
+static int
+top_entry_cmp(const void *entry1, const void *entry2)
+{
+    uint64 count1 = ((const AuditTopEntry *) entry1)->count;
+    uint64 count2 = ((const AuditTopEntry *) entry2)->count;
+
+    return count1 < count2 ? 1 : (count1 > count2 ? -1 : 0);
+}
+
+/*
+ * Return the most accessed objects, highest first.  The heap is copied under
+ * a shared lock and the accesses are then estimated from the sketch, which is
+ * more current than the heap.  Object names are only available for objects in
+ * the current database.
+ */
+Datum
+pgaudit_stat_top_object(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupDesc;
+    Tuplestorestate *tupStore;
+    AuditTopEntry *entryCopy;
+    int entryTotal;
+    int entryIdx;
+
+    tupStore = stat_tuplestore_init(fcinfo, &tupDesc);
+
+    /* Nothing to return when tracking is disabled */
+    if (auditTop == NULL)
+    {
+        tuplestore_donestoring(tupStore);
+        return (Datum) 0;
+    }
+
+    entryCopy = palloc(sizeof(AuditTopEntry) * auditTopObjects);
+
+    LWLockAcquire(auditTop->lock, LW_SHARED);
+    entryTotal = auditTop->total;
+    memcpy(entryCopy, auditTop->entry, sizeof(AuditTopEntry) * entryTotal);
+    LWLockRelease(auditTop->lock);
+
+    for (entryIdx = 0; entryIdx < entryTotal; entryIdx++)
+        entryCopy[entryIdx].count = top_estimate(&entryCopy[entryIdx].key);
+
+    qsort(entryCopy, entryTotal, sizeof(AuditTopEntry), top_entry_cmp);
+
+    for (entryIdx = 0; entryIdx < entryTotal; entryIdx++)
+    {
+        AuditTopKey *key = &entryCopy[entryIdx].key;
+        const char *objectType = NULL;
+        char *objectName = NULL;
+        char *name;
+        Datum values[8];
+        bool nulls[8] = {false};
+
+        if ((name = get_database_name(key->databaseId)) != NULL)
+            values[0] = CStringGetTextDatum(name);
+        else
+            nulls[0] = true;
+
+        if ((name = GetUserNameFromId(key->roleId, true)) != NULL)
+            values[1] = CStringGetTextDatum(name);
+        else
+            nulls[1] = true;
+
+        /* Look up the object, which may have been dropped */
+        if (key->databaseId == MyDatabaseId)
+        {
+            Oid namespaceOid = InvalidOid;
+
+            name = NULL;
+
+            if (key->classId == RelationRelationId)
+            {
+                char relKind = get_rel_relkind(key->objectId);
+
+                if (relKind != '\0')
+                {
+                    objectType = relation_object_type(relKind);
+                    namespaceOid = get_rel_namespace(key->objectId);
+                    name = get_rel_name(key->objectId);
+                }
+            }
+            else if ((name = get_func_name(key->objectId)) != NULL)
+            {
+                objectType = OBJECT_TYPE_FUNCTION;
+                namespaceOid = get_func_namespace(key->objectId);
+            }
+
+            if (OidIsValid(namespaceOid))
+            {
+                char *namespaceName = get_namespace_name(namespaceOid);
+
+                if (namespaceName != NULL && name != NULL)
+                    objectName = quote_qualified_identifier(namespaceName,
+                                                            name);
+            }
+        }
+
+        values[2] = ObjectIdGetDatum(key->objectId);
+
+        if (objectType != NULL)
+            values[3] = CStringGetTextDatum(objectType);
+        else
+            nulls[3] = true;
+
+        if (objectName != NULL)
+            values[4] = CStringGetTextDatum(objectName);
+        else
+            nulls[4] = true;
+
+        values[5] = CStringGetTextDatum(auditTopCommand[key->commandIdx]);
+        values[6] = Int64GetDatum((int64) entryCopy[entryIdx].count);
+        values[7] = TimestampTzGetDatum(
+            (TimestampTz) pg_atomic_read_u64(&auditTop->reset));
+
+        tuplestore_putvalues(tupStore, tupDesc, values, nulls);
+    }
+
+    tuplestore_donestoring(tupStore);
+
+    return (Datum) 0;
+}
+
+/*
+ * Reset the top objects.
+ */
+Datum
+pgaudit_stat_top_object_reset(PG_FUNCTION_ARGS)
+{
+    if (auditSharedState == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pgaudit must be loaded via shared_preload_libraries")));
+
+    if (auditTop != NULL)
+    {
+        LWLockAcquire(auditTop->lock, LW_EXCLUSIVE);
+        top_reset(false);
+        LWLockRelease(auditTop->lock);
+    }
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * Shared memory
+ */
+
+/*
+ * Size of the shared memory required by pgaudit.
+ */
+static Size
+pgaudit_shmem_size(void)
+{
+    return add_size(add_size(MAXALIGN(sizeof(AuditSharedState)),
+                             MAXALIGN(buffer_shmem_size())),
+                    MAXALIGN(top_shmem_size()));
+}
+
+/*
+ * Allocate or attach to shared memory.
+ */
+static void
+pgaudit_shmem_startup_hook(void)
+{
+    bool found;
+
+    if (next_shmem_startup_hook)
+        (*next_shmem_startup_hook) ();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    auditSharedState = ShmemInitStruct("pgaudit", sizeof(AuditSharedState),
+                                       &found);
+
+    /* Initialize the counters if shared memory was just created */
+    if (!found)
+    {
+        stat_reset(true);
+        pg_atomic_init_u32(&auditSharedState->fileEpoch, 0);
+    }
+
+    /* Initialize the recent entries buffer, if enabled */
+    if (auditBufferSize > 0)
+    {
+        auditBuffer = ShmemInitStruct("pgaudit buffer", buffer_shmem_size(),
+                                      &found);
+
+        if (!found)
+            buffer_init();
+    }
+
+    /* Initialize the top objects, if enabled */
+    if (auditTopObjects > 0)
+    {
+        auditTop = ShmemInitStruct("pgaudit top objects", top_shmem_size(),
+                                   &found);
 
-    /* No longer in an internal statement */
-    internalStatement = false;
+        if (!found)
+        {
+            auditTop->lock = LWLockAssign();
+            top_reset(true);
+        }
+    }
 
-    PG_RETURN_NULL();
+    LWLockRelease(AddinShmemInitLock);
 }
 
 /*
@@ -1739,6 +5130,163 @@ assign_pgaudit_log(const char *newVal, void *extra)
         auditLogBitmap = *(int *) extra;
 }
 
+/*
+ * Take a pgaudit.log_destination value such as "file" and check that it is
+ * valid.  The buffer destination requires the buffer to be enabled.  Return
+ * the destination so it does not have to be checked again in the assign
+ * function.
+ */
+static bool
+check_pgaudit_log_destination(char **newVal, void **extra, GucSource source)
+{
+    int *destination;
+
+    /* Allocate memory to store the destination */
+    if (!(destination = (int *) malloc(sizeof(int))))
+        return false;
+
+    if (pg_strcasecmp(*newVal, "server") == 0)
+        *destination = AUDIT_DESTINATION_SERVER;
+    else if (pg_strcasecmp(*newVal, "file") == 0)
+        *destination = AUDIT_DESTINATION_FILE;
+    else if (pg_strcasecmp(*newVal, "buffer") == 0 && auditBufferSize > 0)
+        *destination = AUDIT_DESTINATION_BUFFER;
+
+    /* Error if the destination is not found */
+    else
+    {
+        if (pg_strcasecmp(*newVal, "buffer") == 0)
+            GUC_check_errdetail("pgaudit.buffer_size must be set to use the "
+                                "buffer destination.");
+
+        free(destination);
+        return false;
+    }
+
+    *extra = destination;
+
+    return true;
+}
+
+/*
+ * Set pgaudit.log_destination from extra (ignore newVal, which has already
+ * been converted to an enum above).
+ */
+static void
+assign_pgaudit_log_destination(const char *newVal, void *extra)
+{
+    if (extra)
+        auditLogDestination = *(int *) extra;
+}
+
+/*
+ * Close pgaudit.log_file when it changes so the next entry opens the new file.
+ */
+static void
+assign_pgaudit_log_file(const char *newVal, void *extra)
+{
+    if (auditLogFileFd >= 0)
+    {
+        close(auditLogFileFd);
+        auditLogFileFd = -1;
+    }
+}
+
+/*
+ * Take a pgaudit.log_file_format value such as "binary" and check that it is
+ * valid.  Return the format so it does not have to be checked again in the
+ * assign function.
+ */
+static bool
+check_pgaudit_log_file_format(char **newVal, void **extra, GucSource source)
+{
+    int *format;
+
+    /* Allocate memory to store the format */
+    if (!(format = (int *) malloc(sizeof(int))))
+        return false;
+
+    if (pg_strcasecmp(*newVal, "csv") == 0)
+        *format = AUDIT_FILE_FORMAT_CSV;
+    else if (pg_strcasecmp(*newVal, "binary") == 0)
+        *format = AUDIT_FILE_FORMAT_BINARY;
+
+    /* Error if the format is not found */
+    else
+    {
+        free(format);
+        return false;
+    }
+
+    *extra = format;
+
+    return true;
+}
+
+/*
+ * Set pgaudit.log_file_format from extra and close pgaudit.log_file so the
+ * next entry opens it again, which starts a binary file afresh.
+ */
+static void
+assign_pgaudit_log_file_format(const char *newVal, void *extra)
+{
+    if (extra)
+        auditLogFileFormat = *(int *) extra;
+
+    assign_pgaudit_log_file(newVal, NULL);
+}
+
+/*
+ * Take a pgaudit.log_file_compression value such as "zstd" and check that it
+ * is valid and was built in.  Return the compression so it does not have to
+ * be checked again in the assign function.
+ */
+static bool
+check_pgaudit_log_file_compression(char **newVal, void **extra,
+                                   GucSource source)
+{
+    int *compression;
+
+    /* Allocate memory to store the compression */
+    if (!(compression = (int *) malloc(sizeof(int))))
+        return false;
+
+    if (pg_strcasecmp(*newVal, "none") == 0)
+        *compression = AUDIT_COMPRESSION_NONE;
+    else if (pg_strcasecmp(*newVal, "zstd") == 0)
+    {
+#ifdef USE_ZSTD
+        *compression = AUDIT_COMPRESSION_ZSTD;
+#else
+        GUC_check_errdetail("pgaudit was built without zstd support.");
+        free(compression);
+        return false;
+#endif
+    }
+
+    /* Error if the compression is not found */
+    else
+    {
+        free(compression);
+        return false;
+    }
+
+    *extra = compression;
+
+    return true;
+}
+
+/*
+ * Set pgaudit.log_file_compression from extra.  A frame that is open when
+ * compression is turned off is written before the next entry.
+ */
+static void
+assign_pgaudit_log_file_compression(const char *newVal, void *extra)
+{
+    if (extra)
+        auditLogFileCompression = *(int *) extra;
+}
+
 /*
  * Take a pgaudit.log_level value such as "debug" and check that is is valid.
  * Return the enum value so it does not have to be checked again in the assign
@@ -1800,6 +5348,145 @@ assign_pgaudit_log_level(const char *newVal, void *extra)
         auditLogLevel = *(int *) extra;
 }
 
+/*
+ * Take a pgaudit.log_min_rows_relation value such as
+ * "public.customers=1000000, orders=1000" and check that it is valid.  The
+ * names are folded to lower case like unquoted identifiers.  Return the list
+ * of thresholds so it does not have to be parsed again in the assign
+ * function.
+ */
+static bool
+check_pgaudit_log_min_rows_relation(char **newVal, void **extra,
+                                    GucSource source)
+{
+    char *rawVal;
+    char *token;
+    char *tokenNext;
+    int relationMax = 1;
+    AuditMinRowsRelationList *relationList;
+
+    /* The list must be a single allocation so size it for every entry */
+    for (token = *newVal; *token; token++)
+        if (*token == ',')
+            relationMax++;
+
+    relationList = (AuditMinRowsRelationList *)
+        malloc(offsetof(AuditMinRowsRelationList, relation) +
+               sizeof(AuditMinRowsRelation) * relationMax);
+
+    if (relationList == NULL)
+        return false;
+
+    relationList->total = 0;
+    rawVal = pstrdup(*newVal);
+
+    for (token = rawVal; token != NULL; token = tokenNext)
+    {
+        AuditMinRowsRelation *relation =
+            &relationList->relation[relationList->total];
+        char *entry;
+        char *rowsStr;
+        char *relationName;
+        char *endPtr;
+        long minRows;
+
+        if ((tokenNext = strchr(token, ',')) != NULL)
+            *tokenNext++ = '\0';
+
+        /* Skip empty entries, e.g. when the list is empty */
+        while (isspace((unsigned char) *token))
+            token++;
+
+        if (*token == '\0')
+            continue;
+
+        /* Keep the entry as written for error messages */
+        entry = pstrdup(token);
+
+        /* Split the name from the number of rows */
+        if ((rowsStr = strchr(token, '=')) == NULL)
+        {
+            GUC_check_errdetail("Entry \"%s\" must have the form "
+                                "[schema.]relation=rows.", entry);
+            pfree(rawVal);
+            free(relationList);
+            return false;
+        }
+
+        *rowsStr++ = '\0';
+
+        errno = 0;
+        minRows = strtol(rowsStr, &endPtr, 10);
+
+        while (isspace((unsigned char) *endPtr))
+            endPtr++;
+
+        if (endPtr == rowsStr || *endPtr != '\0' || errno != 0 ||
+            minRows < 0 || minRows > INT_MAX)
+        {
+            GUC_check_errdetail("Rows in entry \"%s\" must be an integer "
+                                "between 0 and %d.", entry, INT_MAX);
+            pfree(rawVal);
+            free(relationList);
+            return false;
+        }
+
+        /* Split the schema from the relation */
+        for (endPtr = token + strlen(token);
+             endPtr > token && isspace((unsigned char) endPtr[-1]); endPtr--)
+            endPtr[-1] = '\0';
+
+        relation->schemaName[0] = '\0';
+
+        if ((relationName = strchr(token, '.')) != NULL)
+        {
+            *relationName++ = '\0';
+            strlcpy(relation->schemaName,
+                    downcase_truncate_identifier(token, strlen(token), false),
+                    NAMEDATALEN);
+        }
+        else
+            relationName = token;
+
+        if (*relationName == '\0' ||
+            (relation->schemaName[0] == '\0' && relationName != token))
+        {
+            GUC_check_errdetail("Entry \"%s\" must have the form "
+                                "[schema.]relation=rows.", entry);
+            pfree(rawVal);
+            free(relationList);
+            return false;
+        }
+
+        strlcpy(relation->relationName,
+                downcase_truncate_identifier(relationName,
+                                             strlen(relationName), false),
+                NAMEDATALEN);
+        relation->minRows = (int) minRows;
+        relationList->total++;
+    }
+
+    pfree(rawVal);
+
+    /* Return the list for assign_pgaudit_log_min_rows_relation */
+    *extra = relationList;
+
+    return true;
+}
+
+/*
+ * Set the relation thresholds from extra.  An empty list is stored as NULL so
+ * the hooks can check it cheaply.
+ */
+static void
+assign_pgaudit_log_min_rows_relation(const char *newVal, void *extra)
+{
+    if (extra)
+        auditLogMinRowsRelation =
+            ((AuditMinRowsRelationList *) extra)->total == 0 ?
+            NULL : (AuditMinRowsRelationList *) extra;
+}
+
 /*
  * Define GUC variables and install hooks upon module load.
  */
@@ -1817,6 +5504,37 @@ _PG_init(void)
         ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
                 errmsg("pgaudit must be loaded via shared_preload_libraries")));
 
+    /* Define pgaudit.buffer_size */
+    DefineCustomIntVariable(
+        "pgaudit.buffer_size",
+
+        "Specifies the number of recent entries to keep in shared memory for "
+        "pgaudit_recent().  Zero disables the buffer.",
+
+        NULL,
+        &auditBufferSize,
+        0,
+        0,
+        1048576,
+        PGC_POSTMASTER,
+        GUC_NOT_IN_SAMPLE,
+        NULL, NULL, NULL);
+
+    /* Define pgaudit.buffer_defer_format */
+    DefineCustomBoolVariable(
+        "pgaudit.buffer_defer_format",
+
+        "Specifies that parameters of entries that only go to the recent "
+        "entries buffer are formatted when the buffer is read rather than "
+        "when the entry is logged.",
+
+        NULL,
+        &auditBufferDeferFormat,
+        false,
+        PGC_SUSET,
+        GUC_NOT_IN_SAMPLE,
+        NULL, NULL, NULL);
+
     /* Define pgaudit.log */
     DefineCustomStringVariable(
         "pgaudit.log",
@@ -1851,6 +5569,86 @@ _PG_init(void)
         GUC_NOT_IN_SAMPLE,
         NULL, NULL, NULL);
 
+    /* Define pgaudit.log_destination */
+    DefineCustomStringVariable(
+        "pgaudit.log_destination",
+
+        "Specifies where audit entries are written: server (the server log), "
+        "file (pgaudit.log_file), or buffer (the recent entries buffer only).",
+
+        NULL,
+        &auditLogDestinationString,
+        "server",
+        PGC_SUSET,
+        GUC_NOT_IN_SAMPLE,
+        check_pgaudit_log_destination,
+        assign_pgaudit_log_destination,
+        NULL);
+
+    /* Define pgaudit.log_duration */
+    DefineCustomBoolVariable(
+        "pgaudit.log_duration",
+
+        "Specifies that audit logging should include the duration of the "
+        "statement in milliseconds.  Entries are logged when the statement "
+        "completes.",
+
+        NULL,
+        &auditLogDuration,
+        false,
+        PGC_SUSET,
+        GUC_NOT_IN_SAMPLE,
+        NULL, NULL, NULL);
+
+    /* Define pgaudit.log_file */
+    DefineCustomStringVariable(
+        "pgaudit.log_file",
+
+        "Specifies the file that audit entries are written to when "
+        "pgaudit.log_destination is file.  Relative paths are relative to "
+        "log_directory.",
+
+        NULL,
+        &auditLogFile,
+        "pgaudit.log",
+        PGC_SIGHUP,
+        GUC_NOT_IN_SAMPLE,
+        NULL,
+        assign_pgaudit_log_file,
+        NULL);
+
+    /* Define pgaudit.log_file_format */
+    DefineCustomStringVariable(
+        "pgaudit.log_file_format",
+
+        "Specifies the format of pgaudit.log_file: csv, or binary for a "
+        "compact format that is read with pgaudit_decode.",
+
+        NULL,
+        &auditLogFileFormatString,
+        "csv",
+        PGC_SIGHUP,
+        GUC_NOT_IN_SAMPLE,
+        check_pgaudit_log_file_format,
+        assign_pgaudit_log_file_format,
+        NULL);
+
+    /* Define pgaudit.log_file_compression */
+    DefineCustomStringVariable(
+        "pgaudit.log_file_compression",
+
+        "Specifies the compression of pgaudit.log_file: none, or zstd when "
+        "pgaudit is built with USE_ZSTD.",
+
+        NULL,
+        &auditLogFileCompressionString,
+        "none",
+        PGC_SIGHUP,
+        GUC_NOT_IN_SAMPLE,
+        check_pgaudit_log_file_compression,
+        assign_pgaudit_log_file_compression,
+        NULL);
+
     /* Define pgaudit.log_level */
     DefineCustomStringVariable(
         "pgaudit.log_level",
@@ -1870,6 +5668,40 @@ _PG_init(void)
         assign_pgaudit_log_level,
         NULL);
 
+    /* Define pgaudit.log_min_rows */
+    DefineCustomIntVariable(
+        "pgaudit.log_min_rows",
+
+        "Specifies that READ and WRITE session entries are only logged for "
+        "statements that retrieve or affect at least this many rows.  OBJECT "
+        "entries are always logged.  Zero logs every statement.",
+
+        NULL,
+        &auditLogMinRows,
+        0,
+        0,
+        INT_MAX,
+        PGC_SUSET,
+        GUC_NOT_IN_SAMPLE,
+        NULL, NULL, NULL);
+
+    /* Define pgaudit.log_min_rows_relation */
+    DefineCustomStringVariable(
+        "pgaudit.log_min_rows_relation",
+
+        "Specifies pgaudit.log_min_rows for individual relations as a "
+        "comma-separated list of [schema.]relation=rows entries.  A statement "
+        "uses the lowest threshold of the relations it accesses.",
+
+        NULL,
+        &auditLogMinRowsRelationString,
+        "",
+        PGC_SUSET,
+        GUC_LIST_INPUT | GUC_NOT_IN_SAMPLE,
+        check_pgaudit_log_min_rows_relation,
+        assign_pgaudit_log_min_rows_relation,
+        NULL);
+
     /* Define pgaudit.log_parameter */
     DefineCustomBoolVariable(
         "pgaudit.log_parameter",
@@ -1901,6 +5733,21 @@ _PG_init(void)
         GUC_NOT_IN_SAMPLE,
         NULL, NULL, NULL);
 
+    /* Define pgaudit.log_rows */
+    DefineCustomBoolVariable(
+        "pgaudit.log_rows",
+
+        "Specifies that audit logging should include the number of rows "
+        "retrieved or affected by the statement.  Entries are logged when the "
+        "statement completes.",
+
+        NULL,
+        &auditLogRows,
+        false,
+        PGC_SUSET,
+        GUC_NOT_IN_SAMPLE,
+        NULL, NULL, NULL);
+
     /* Define pgaudit.log_statement_once */
     DefineCustomBoolVariable(
         "pgaudit.log_statement_once",
@@ -1936,6 +5783,47 @@ _PG_init(void)
             GUC_NOT_IN_SAMPLE,
             NULL, NULL, NULL);
 
+    /* Define pgaudit.top_objects */
+    DefineCustomIntVariable(
+        "pgaudit.top_objects",
+
+        "Specifies the number of most accessed objects to report in the "
+        "pg_stat_audit_top_object view.  Zero disables counting accesses.",
+
+        NULL,
+        &auditTopObjects,
+        0,
+        0,
+        1000,
+        PGC_POSTMASTER,
+        GUC_NOT_IN_SAMPLE,
+        NULL, NULL, NULL);
+
+    /* Define pgaudit.track_timing */
+    DefineCustomBoolVariable(
+        "pgaudit.track_timing",
+
+        "Specifies that the time spent in each pgaudit hook should be measured "
+        "and reported in the pg_stat_audit_hook view.  This requires reading "
+        "the system clock on entry and exit of each hook.",
+
+        NULL,
+        &auditTrackTiming,
+        false,
+        PGC_SUSET,
+        GUC_NOT_IN_SAMPLE,
+        NULL, NULL, NULL);
+
+    /*
+     * Request shared memory for statistics.  It will be allocated or attached
+     * to in pgaudit_shmem_startup_hook().
+     */
+    RequestAddinShmemSpace(pgaudit_shmem_size());
+
+    /* The top objects heap has its own lock */
+    if (auditTopObjects > 0)
+        RequestAddinLWLocks(1);
+
     /*
      * Install our hook functions after saving the existing pointers to
      * preserve the chains.
@@ -1946,12 +5834,24 @@ _PG_init(void)
     next_ExecutorCheckPerms_hook = ExecutorCheckPerms_hook;
     ExecutorCheckPerms_hook = pgaudit_ExecutorCheckPerms_hook;
 
+    next_ExecutorEnd_hook = ExecutorEnd_hook;
+    ExecutorEnd_hook = pgaudit_ExecutorEnd_hook;
+
     next_ProcessUtility_hook = ProcessUtility_hook;
     ProcessUtility_hook = pgaudit_ProcessUtility_hook;
 
     next_object_access_hook = object_access_hook;
     object_access_hook = pgaudit_object_access_hook;
 
+    next_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = pgaudit_shmem_startup_hook;
+
+    next_emit_log_hook = emit_log_hook;
+    emit_log_hook = pgaudit_emit_log_hook;
+
+    RegisterXactCallback(pgaudit_xact_callback, NULL);
+    RegisterSubXactCallback(pgaudit_subxact_callback, NULL);
+
     /* Log that the extension has completed initialization */
     ereport(LOG, (errmsg("pgaudit extension initialized")));
 
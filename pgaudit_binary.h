@@ -0,0 +1,109 @@
+/*------------------------------------------------------------------------------
+ * pgaudit_binary.h
+ *
+ * Binary format of pgaudit.log_file when pgaudit.log_file_format is binary.
+ * This has no dependencies so that pgaudit_decode can be built without the
+ * server headers.
+ *
+ * The file is a sequence of frames, each holding a record:
+ *
+ * sync          the four bytes of AUDIT_BINARY_SYNC
+ * length        length of the record as a varint
+ * record        the record, which starts with its type
+ * checksum      CRC-32C of the length and the record, as pg_crc32c computes
+ *               it, in four bytes least significant first
+ *
+ * A frame may be incomplete, e.g. when a write ran out of space or the server
+ * crashed while writing.  A reader skips any frame that is incomplete or has
+ * the wrong checksum and looks for the next sync marker.  Varints are unsigned
+ * LEB128: seven bits at a time, least significant first, with the high bit set
+ * on every byte but the last.
+ *
+ * AUDIT_BINARY_OPEN     magic, version, pid
+ * AUDIT_BINARY_NAME     pid, id, text
+ * AUDIT_BINARY_ENTRY    pid, time, flags, statement id, substatement id,
+ *                       class, user, database, command, object type, and
+ *                       object name as names, then statement and parameter
+ *                       as text when flagged, then rows and duration when
+ *                       flagged as known
+ *
+ * Numbers are varints.  A text is its length plus one as a varint followed by
+ * the bytes, or zero for NULL.  A name is a varint that is zero for NULL, one
+ * for a text that follows, or the id of a string in the code table below or of
+ * a NAME record written earlier by the same process.  Time is in microseconds
+ * since the Unix epoch and duration in nanoseconds.
+ *
+ * Each process writes an OPEN record before anything else when it opens the
+ * file or finds that the file has been truncated, and the names it defined
+ * before are forgotten.  The NAME records for an entry are written in the
+ * same write as the entry, before it.  An entry can still refer to names that
+ * are not in the file if it was written while the file was being truncated by
+ * another process, or if the write of its names failed.
+ *
+ * Copyright (c) 2014-2015, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *          contrib/pgaudit/pgaudit_binary.h
+ *------------------------------------------------------------------------------
+ */
+#ifndef PGAUDIT_BINARY_H
+#define PGAUDIT_BINARY_H
+
+/* Start of the OPEN record, the version changes with the format or codes */
+#define AUDIT_BINARY_MAGIC          "PGAUDIT"
+#define AUDIT_BINARY_VERSION        2
+
+/* Start of each frame */
+#define AUDIT_BINARY_SYNC           "\xa5\x5a\xc3\x3c"
+#define AUDIT_BINARY_SYNC_LEN       4
+
+/* Size of the checksum at the end of each frame */
+#define AUDIT_BINARY_CHECKSUM_LEN   4
+
+/* Longest record, a longer length is taken as a damaged frame */
+#define AUDIT_BINARY_RECORD_MAX     0x3fffffff
+
+/* Record types */
+#define AUDIT_BINARY_OPEN           0
+#define AUDIT_BINARY_NAME           1
+#define AUDIT_BINARY_ENTRY          2
+
+/* Values of a name other than an id */
+#define AUDIT_BINARY_NAME_NULL      0
+#define AUDIT_BINARY_NAME_TEXT      1
+
+/* Flags of an entry */
+#define AUDIT_ENTRY_OBJECT          (1 << 0)    /* OBJECT, else SESSION */
+#define AUDIT_ENTRY_STATEMENT       (1 << 1)    /* Not previously logged */
+#define AUDIT_ENTRY_PARAMETER       (1 << 2)    /* Parameters logged */
+#define AUDIT_ENTRY_ROWS            (1 << 3)    /* Rows field present */
+#define AUDIT_ENTRY_ROWS_KNOWN      (1 << 4)    /* Rows value follows */
+#define AUDIT_ENTRY_DURATION        (1 << 5)    /* Duration field present */
+#define AUDIT_ENTRY_DURATION_KNOWN  (1 << 6)    /* Duration value follows */
+
+/*
+ * Strings of the CLASS_*, COMMAND_*, and OBJECT_TYPE_* constants, which have
+ * fixed ids starting from AUDIT_BINARY_CODE_FIRST so they never need a NAME
+ * record.  Only add to the end and increment AUDIT_BINARY_VERSION.  Other
+ * strings, such as the command tags of utility statements, are defined with a
+ * NAME record the first time they are used.
+ */
+#define AUDIT_BINARY_CODE_FIRST     2
+
+static const char *const auditBinaryCode[] =
+{
+    /* CLASS_* */
+    "DDL", "FUNCTION", "MISC", "READ", "ROLE", "WRITE",
+
+    /* COMMAND_*, FUNCTION and UNKNOWN are above or below */
+    "SELECT", "INSERT", "UPDATE", "DELETE", "EXECUTE", "GRANT", "REVOKE",
+
+    /* OBJECT_TYPE_* */
+    "TABLE", "INDEX", "SEQUENCE", "TOAST TABLE", "VIEW", "MATERIALIZED VIEW",
+    "COMPOSITE TYPE", "FOREIGN TABLE", "UNKNOWN"
+};
+
+#define AUDIT_BINARY_CODE_TOTAL \
+    ((int) (sizeof(auditBinaryCode) / sizeof(auditBinaryCode[0])))
+
+#endif   /* PGAUDIT_BINARY_H */
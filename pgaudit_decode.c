@@ -0,0 +1,1017 @@
+/*------------------------------------------------------------------------------
+ * pgaudit_decode.c
+ *
+ * Decodes a pgaudit.log_file written with pgaudit.log_file_format set to
+ * binary.  Entries are written as the same CSV lines that the csv format would
+ * have, or as JSON with one object per line.  See pgaudit_binary.h for the
+ * format.
+ *
+ * Usage: pgaudit_decode [-f csv|json] [file ...]
+ *
+ * Files are read in order, or standard input when there are none.  Time is
+ * shown in the time zone of the TZ environment variable.  Damaged frames,
+ * malformed records, and names that are not defined are reported on standard
+ * error and decoding goes on with the next record.
+ *
+ * Files written with pgaudit.log_file_compression set to zstd are
+ * decompressed when built with USE_ZSTD.  A damaged zstd frame is skipped up
+ * to the next one, and offsets of records are then in the decompressed data.
+ *
+ * Copyright (c) 2014-2015, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *          contrib/pgaudit/pgaudit_decode.c
+ *------------------------------------------------------------------------------
+ */
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "pgaudit_binary.h"
+
+/* Start of a zstd frame, see pgaudit.log_file_compression */
+#define DECODE_ZSTD_MAGIC       "\x28\xb5\x2f\xfd"
+#define DECODE_ZSTD_MAGIC_LEN   4
+
+/* First id defined by a NAME record */
+#define DECODE_NAME_FIRST   (AUDIT_BINARY_CODE_FIRST + AUDIT_BINARY_CODE_TOTAL)
+
+/* Shown for a name that was not defined, e.g. after the file was truncated */
+#define DECODE_UNKNOWN      "<unknown>"
+
+/*
+ * Names defined by a process.  Processes are kept in an open addressing hash
+ * table by pid.  A process id that is reused starts with an OPEN record, which
+ * drops the names of the earlier process.
+ */
+typedef struct DecodeProcess
+{
+    int pid;                    /* Zero when the slot is empty */
+    char **name;                /* Indexed by id - DECODE_NAME_FIRST */
+    uint64_t nameMax;
+} DecodeProcess;
+
+static DecodeProcess *processList = NULL;
+static uint64_t processMax = 0;
+static uint64_t processTotal = 0;
+
+/* Output format */
+static int formatJson = 0;
+
+/* Names that were not defined and bytes that were skipped */
+static uint64_t unknownTotal = 0;
+static uint64_t skipTotal = 0;
+
+/* Where decode_error() returns to */
+static jmp_buf decodeJump;
+
+/* CRC-32C table, see crc_init() */
+static uint32_t crcTable[256];
+
+/* Record being decoded */
+typedef struct DecodeRecord
+{
+    const unsigned char *data;
+    size_t len;
+    size_t cursor;
+    const char *fileName;
+    long offset;                /* Of the record in the file */
+} DecodeRecord;
+
+/*
+ * Allocate memory or exit.
+ */
+static void *
+decode_alloc(void *pointer, size_t size)
+{
+    pointer = realloc(pointer, size == 0 ? 1 : size);
+
+    if (pointer == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    return pointer;
+}
+
+/*
+ * Report a malformed record and skip the rest of it.
+ */
+static void
+decode_error(DecodeRecord *record, const char *message)
+{
+    fprintf(stderr, "%s: record at offset %ld %s\n", record->fileName,
+            record->offset, message);
+    longjmp(decodeJump, 1);
+}
+
+/*
+ * Build the table for CRC-32C (Castagnoli), the same checksum as pg_crc32c.
+ */
+static void
+crc_init(void)
+{
+    uint32_t byte;
+
+    for (byte = 0; byte < 256; byte++)
+    {
+        uint32_t crc = byte;
+        int bit;
+
+        for (bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+
+        crcTable[byte] = crc;
+    }
+}
+
+/*
+ * Compute the CRC-32C of data.
+ */
+static uint32_t
+crc_compute(const unsigned char *data, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+
+    while (len-- > 0)
+        crc = crcTable[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+    return crc ^ 0xFFFFFFFF;
+}
+
+/*
+ * Find a process in the table, adding it if it is not there.
+ */
+static DecodeProcess *
+process_get(int pid)
+{
+    uint64_t slotIdx;
+
+    /* Keep the table at most half full */
+    if ((processTotal + 1) * 2 > processMax)
+    {
+        DecodeProcess *processOld = processList;
+        uint64_t processOldMax = processMax;
+        uint64_t oldIdx;
+
+        processMax = processMax == 0 ? 256 : processMax * 2;
+        processList = decode_alloc(NULL, sizeof(DecodeProcess) * processMax);
+        memset(processList, 0, sizeof(DecodeProcess) * processMax);
+
+        for (oldIdx = 0; oldIdx < processOldMax; oldIdx++)
+        {
+            if (processOld[oldIdx].pid == 0)
+                continue;
+
+            slotIdx = (uint64_t) processOld[oldIdx].pid % processMax;
+
+            while (processList[slotIdx].pid != 0)
+                slotIdx = (slotIdx + 1) % processMax;
+
+            processList[slotIdx] = processOld[oldIdx];
+        }
+
+        free(processOld);
+    }
+
+    slotIdx = (uint64_t) pid % processMax;
+
+    while (processList[slotIdx].pid != 0 && processList[slotIdx].pid != pid)
+        slotIdx = (slotIdx + 1) % processMax;
+
+    if (processList[slotIdx].pid == 0)
+    {
+        processList[slotIdx].pid = pid;
+        processTotal++;
+    }
+
+    return &processList[slotIdx];
+}
+
+/*
+ * Drop the names defined by a process.
+ */
+static void
+process_reset(DecodeProcess *process)
+{
+    uint64_t nameIdx;
+
+    for (nameIdx = 0; nameIdx < process->nameMax; nameIdx++)
+        free(process->name[nameIdx]);
+
+    free(process->name);
+    process->name = NULL;
+    process->nameMax = 0;
+}
+
+/*
+ * Read a varint from a record.
+ */
+static uint64_t
+record_varint(DecodeRecord *record)
+{
+    uint64_t value = 0;
+    int shift;
+
+    for (shift = 0; shift < 64; shift += 7)
+    {
+        unsigned char byte;
+
+        if (record->cursor >= record->len)
+            decode_error(record, "is truncated");
+
+        byte = record->data[record->cursor++];
+        value |= (uint64_t) (byte & 0x7F) << shift;
+
+        if (!(byte & 0x80))
+            return value;
+    }
+
+    decode_error(record, "has a varint that is too long");
+    return 0;
+}
+
+/*
+ * Read a text from a record.  Returns an allocated string or NULL.
+ */
+static char *
+record_text(DecodeRecord *record)
+{
+    uint64_t len = record_varint(record);
+    char *text;
+
+    if (len == 0)
+        return NULL;
+
+    len--;
+
+    if (len > record->len - record->cursor)
+        decode_error(record, "is truncated");
+
+    text = decode_alloc(NULL, len + 1);
+    memcpy(text, record->data + record->cursor, len);
+    text[len] = '\0';
+    record->cursor += len;
+
+    return text;
+}
+
+/*
+ * Read a name from a record.  Returns an allocated string or NULL.
+ */
+static char *
+record_name(DecodeRecord *record, DecodeProcess *process)
+{
+    uint64_t id = record_varint(record);
+    const char *name;
+
+    if (id == AUDIT_BINARY_NAME_NULL)
+        return NULL;
+
+    if (id == AUDIT_BINARY_NAME_TEXT)
+        return record_text(record);
+
+    if (id < DECODE_NAME_FIRST)
+        name = auditBinaryCode[id - AUDIT_BINARY_CODE_FIRST];
+    else if (id - DECODE_NAME_FIRST < process->nameMax &&
+             process->name[id - DECODE_NAME_FIRST] != NULL)
+        name = process->name[id - DECODE_NAME_FIRST];
+    else
+    {
+        fprintf(stderr, "%s: record at offset %ld refers to name %llu, which "
+                "is not defined\n", record->fileName, record->offset,
+                (unsigned long long) id);
+        unknownTotal++;
+        name = DECODE_UNKNOWN;
+    }
+
+    return strcpy(decode_alloc(NULL, strlen(name) + 1), name);
+}
+
+/*
+ * Write a CSV field, quoted only if needed as append_valid_csv() does.
+ */
+static void
+output_csv(const char *field)
+{
+    const char *pChar;
+
+    if (field == NULL)
+        return;
+
+    if (field[strcspn(field, ",\"\n\r")] == '\0')
+    {
+        fputs(field, stdout);
+        return;
+    }
+
+    putchar('"');
+
+    for (pChar = field; *pChar; pChar++)
+    {
+        if (*pChar == '"')
+            putchar('"');
+
+        putchar(*pChar);
+    }
+
+    putchar('"');
+}
+
+/*
+ * Write a JSON member with a string value, or null.
+ */
+static void
+output_json(const char *key, const char *value)
+{
+    const char *pChar;
+
+    printf(",\"%s\":", key);
+
+    if (value == NULL)
+    {
+        fputs("null", stdout);
+        return;
+    }
+
+    putchar('"');
+
+    for (pChar = value; *pChar; pChar++)
+    {
+        unsigned char ch = (unsigned char) *pChar;
+
+        if (ch == '"' || ch == '\\')
+            printf("\\%c", ch);
+        else if (ch == '\n')
+            fputs("\\n", stdout);
+        else if (ch == '\r')
+            fputs("\\r", stdout);
+        else if (ch == '\t')
+            fputs("\\t", stdout);
+        else if (ch < 0x20)
+            printf("\\u%04x", ch);
+        else
+            putchar(ch);
+    }
+
+    putchar('"');
+}
+
+/*
+ * Decode an ENTRY record and write it.
+ */
+static void
+decode_entry(DecodeRecord *record)
+{
+    int pid = (int) record_varint(record);
+    DecodeProcess *process = process_get(pid);
+    uint64_t logTime = record_varint(record);
+    uint64_t flags = record_varint(record);
+    uint64_t statementId = record_varint(record);
+    uint64_t substatementId = record_varint(record);
+    char *className = record_name(record, process);
+    char *userName = record_name(record, process);
+    char *databaseName = record_name(record, process);
+    char *command = record_name(record, process);
+    char *objectType = record_name(record, process);
+    char *objectName = record_name(record, process);
+    char *commandText = NULL;
+    char *paramText = NULL;
+    uint64_t rows = 0;
+    uint64_t duration = 0;
+    const char *statement;
+    const char *parameter;
+    const char *auditType;
+    char timeStr[128];
+    char zoneStr[64];
+    char durationStr[32];
+    time_t stampTime;
+    struct tm *stampTm;
+
+    if (flags & AUDIT_ENTRY_STATEMENT)
+    {
+        commandText = record_text(record);
+
+        if (flags & AUDIT_ENTRY_PARAMETER)
+            paramText = record_text(record);
+    }
+
+    if (flags & AUDIT_ENTRY_ROWS_KNOWN)
+        rows = record_varint(record);
+
+    if (flags & AUDIT_ENTRY_DURATION_KNOWN)
+        duration = record_varint(record);
+
+    /* Time in the same format as csvlog */
+    stampTime = (time_t) (logTime / 1000000);
+    stampTm = localtime(&stampTime);
+
+    strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", stampTm);
+    strftime(zoneStr, sizeof(zoneStr), "%Z", stampTm);
+    sprintf(timeStr + strlen(timeStr), ".%03d %s",
+            (int) (logTime % 1000000 / 1000), zoneStr);
+
+    auditType = flags & AUDIT_ENTRY_OBJECT ? "OBJECT" : "SESSION";
+    sprintf(durationStr, "%.3f", (double) duration / 1000000);
+
+    /* The statement and parameter fields as the csv format has them */
+    if (!(flags & AUDIT_ENTRY_STATEMENT))
+    {
+        statement = "<previously logged>";
+        parameter = "<previously logged>";
+    }
+    else
+    {
+        statement = commandText;
+        parameter = flags & AUDIT_ENTRY_PARAMETER ? paramText : "<not logged>";
+    }
+
+    if (formatJson)
+    {
+        printf("{\"log_time\":\"%s\",\"pid\":%d", timeStr, pid);
+        output_json("user_name", userName);
+        output_json("database_name", databaseName);
+        output_json("audit_type", auditType);
+        printf(",\"statement_id\":%llu,\"substatement_id\":%llu",
+               (unsigned long long) statementId,
+               (unsigned long long) substatementId);
+        output_json("class", className);
+        output_json("command", command);
+        output_json("object_type", objectType);
+        output_json("object_name", objectName);
+        output_json("statement", statement);
+        output_json("parameter", parameter);
+
+        /* Unknown rows and duration are null */
+        if (flags & AUDIT_ENTRY_ROWS)
+        {
+            if (flags & AUDIT_ENTRY_ROWS_KNOWN)
+                printf(",\"rows\":%llu", (unsigned long long) rows);
+            else
+                fputs(",\"rows\":null", stdout);
+        }
+
+        if (flags & AUDIT_ENTRY_DURATION)
+        {
+            if (flags & AUDIT_ENTRY_DURATION_KNOWN)
+                printf(",\"duration\":%s", durationStr);
+            else
+                fputs(",\"duration\":null", stdout);
+        }
+
+        fputs("}\n", stdout);
+    }
+    else
+    {
+        printf("%s,%d,", timeStr, pid);
+        output_csv(userName);
+        putchar(',');
+        output_csv(databaseName);
+        printf(",%s,%llu,%llu,", auditType, (unsigned long long) statementId,
+               (unsigned long long) substatementId);
+        output_csv(className);
+        putchar(',');
+        output_csv(command);
+        putchar(',');
+        output_csv(objectType);
+        putchar(',');
+        output_csv(objectName);
+        putchar(',');
+
+        /* Markers are not quoted */
+        if (flags & AUDIT_ENTRY_STATEMENT)
+            output_csv(statement);
+        else
+            fputs(statement, stdout);
+
+        putchar(',');
+
+        if (flags & AUDIT_ENTRY_PARAMETER)
+            output_csv(parameter);
+        else
+            fputs(parameter, stdout);
+
+        if (flags & AUDIT_ENTRY_ROWS)
+        {
+            if (flags & AUDIT_ENTRY_ROWS_KNOWN)
+                printf(",%llu", (unsigned long long) rows);
+            else
+                fputs(",<unknown>", stdout);
+        }
+
+        if (flags & AUDIT_ENTRY_DURATION)
+            printf(",%s", flags & AUDIT_ENTRY_DURATION_KNOWN ?
+                   durationStr : "<unknown>");
+
+        putchar('\n');
+    }
+
+    free(className);
+    free(userName);
+    free(databaseName);
+    free(command);
+    free(objectType);
+    free(objectName);
+    free(commandText);
+    free(paramText);
+}
+
+/*
+ * Decode a record.
+ */
+static void
+decode_record(DecodeRecord *record)
+{
+    int type;
+
+    if (record->len == 0)
+        decode_error(record, "is empty");
+
+    type = record->data[record->cursor++];
+
+    if (type == AUDIT_BINARY_OPEN)
+    {
+        size_t magicLen = strlen(AUDIT_BINARY_MAGIC);
+        uint64_t version;
+
+        if (record->len - record->cursor < magicLen ||
+            memcmp(record->data + record->cursor, AUDIT_BINARY_MAGIC,
+                   magicLen) != 0)
+            decode_error(record, "is not from a pgaudit binary file");
+
+        record->cursor += magicLen;
+        version = record_varint(record);
+
+        if (version != AUDIT_BINARY_VERSION)
+            decode_error(record, "has an unsupported version");
+
+        /* A new process or a process that opened the file again */
+        process_reset(process_get((int) record_varint(record)));
+    }
+    else if (type == AUDIT_BINARY_NAME)
+    {
+        DecodeProcess *process = process_get((int) record_varint(record));
+        uint64_t id = record_varint(record);
+        char *name = record_text(record);
+        uint64_t nameIdx;
+
+        if (id < DECODE_NAME_FIRST || name == NULL)
+            decode_error(record, "has an invalid name");
+
+        nameIdx = id - DECODE_NAME_FIRST;
+
+        if (nameIdx >= process->nameMax)
+        {
+            uint64_t nameMax = process->nameMax == 0 ? 64 : process->nameMax;
+
+            while (nameIdx >= nameMax)
+                nameMax *= 2;
+
+            process->name = decode_alloc(process->name,
+                                         sizeof(char *) * nameMax);
+            memset(process->name + process->nameMax, 0,
+                   sizeof(char *) * (nameMax - process->nameMax));
+            process->nameMax = nameMax;
+        }
+
+        free(process->name[nameIdx]);
+        process->name[nameIdx] = name;
+    }
+    else if (type == AUDIT_BINARY_ENTRY)
+        decode_entry(record);
+    else
+        decode_error(record, "has an unknown type");
+}
+
+/*
+ * Decode a record, returning here from decode_error() if it is malformed.
+ */
+static void
+decode_record_safe(DecodeRecord *record)
+{
+    if (setjmp(decodeJump) == 0)
+        decode_record(record);
+}
+
+/*
+ * Bytes read from a file that have not been decoded yet, from data + start to
+ * data + end.  offset is the position of data + start in the file.
+ *
+ * When the file is compressed, the bytes that have not been decompressed yet
+ * are from zdata + zstart to zdata + zend, and zoffset is the position of
+ * zdata + zstart in the file.  zframeOffset is the position of the frame being
+ * decompressed, or -1 between frames.
+ */
+typedef struct DecodeInput
+{
+    FILE *file;
+    const char *fileName;
+    unsigned char *data;
+    size_t dataMax;
+    size_t start;
+    size_t end;
+    long offset;
+    int compressed;
+    unsigned char *zdata;
+    size_t zstart;
+    size_t zend;
+    long zoffset;
+    long zframeOffset;
+#ifdef USE_ZSTD
+    ZSTD_DCtx *dctx;
+#endif
+} DecodeInput;
+
+#ifdef USE_ZSTD
+/*
+ * Read until at least len compressed bytes are available.  Returns the number
+ * of bytes available, which is less than len only at the end of the file.
+ */
+static size_t
+input_zfill(DecodeInput *input, size_t len)
+{
+    if (input->zend - input->zstart >= len)
+        return input->zend - input->zstart;
+
+    memmove(input->zdata, input->zdata + input->zstart,
+            input->zend - input->zstart);
+    input->zend -= input->zstart;
+    input->zstart = 0;
+
+    while (input->zend < len)
+    {
+        size_t readLen = fread(input->zdata + input->zend, 1,
+                               ZSTD_DStreamInSize() - input->zend,
+                               input->file);
+
+        if (readLen == 0)
+            break;
+
+        input->zend += readLen;
+    }
+
+    return input->zend - input->zstart;
+}
+
+/*
+ * Skip compressed bytes up to the start of the next zstd frame after a
+ * damaged one.
+ */
+static void
+input_zresync(DecodeInput *input)
+{
+    long skipOffset = input->zoffset;
+
+    for (;;)
+    {
+        size_t avail;
+
+        input->zstart++;
+        input->zoffset++;
+
+        avail = input_zfill(input, DECODE_ZSTD_MAGIC_LEN);
+
+        if (avail < DECODE_ZSTD_MAGIC_LEN)
+        {
+            input->zstart += avail;
+            input->zoffset += (long) avail;
+            break;
+        }
+
+        if (memcmp(input->zdata + input->zstart, DECODE_ZSTD_MAGIC,
+                   DECODE_ZSTD_MAGIC_LEN) == 0)
+            break;
+    }
+
+    fprintf(stderr, "%s: skipped %ld compressed bytes at offset %ld\n",
+            input->fileName, input->zoffset - skipOffset, skipOffset);
+    skipTotal += (uint64_t) (input->zoffset - skipOffset);
+}
+#endif
+
+/*
+ * Read up to len bytes into dest, decompressing them when the file is
+ * compressed.  Returns the number of bytes read, zero at the end of the file.
+ */
+static size_t
+input_read(DecodeInput *input, unsigned char *dest, size_t len)
+{
+#ifdef USE_ZSTD
+    if (!input->compressed)
+        return fread(dest, 1, len, input->file);
+
+    for (;;)
+    {
+        ZSTD_inBuffer zin;
+        ZSTD_outBuffer zout;
+        size_t remaining;
+        int atEnd = input_zfill(input, 1) == 0;
+
+        if (atEnd && input->zframeOffset < 0)
+            return 0;
+
+        if (input->zframeOffset < 0)
+            input->zframeOffset = input->zoffset;
+
+        zin.src = input->zdata;
+        zin.size = input->zend;
+        zin.pos = input->zstart;
+        zout.dst = dest;
+        zout.size = len;
+        zout.pos = 0;
+
+        remaining = ZSTD_decompressStream(input->dctx, &zout, &zin);
+
+        if (ZSTD_isError(remaining))
+        {
+            fprintf(stderr, "%s: compressed frame at offset %ld is damaged: "
+                    "%s\n", input->fileName, input->zframeOffset,
+                    ZSTD_getErrorName(remaining));
+
+            ZSTD_DCtx_reset(input->dctx, ZSTD_reset_session_only);
+            input->zframeOffset = -1;
+
+            if (!atEnd)
+                input_zresync(input);
+
+            continue;
+        }
+
+        input->zoffset += (long) (zin.pos - input->zstart);
+        input->zstart = zin.pos;
+
+        if (remaining == 0)
+            input->zframeOffset = -1;
+
+        if (zout.pos > 0)
+            return zout.pos;
+
+        if (atEnd)
+        {
+            fprintf(stderr, "%s: compressed frame at offset %ld is "
+                    "incomplete\n", input->fileName, input->zframeOffset);
+
+            ZSTD_DCtx_reset(input->dctx, ZSTD_reset_session_only);
+            input->zframeOffset = -1;
+            return 0;
+        }
+    }
+#else
+    return fread(dest, 1, len, input->file);
+#endif
+}
+
+/*
+ * Read until at least len bytes are available.  Returns the number of bytes
+ * available, which is less than len only at the end of the file.
+ */
+static size_t
+input_fill(DecodeInput *input, size_t len)
+{
+    if (input->end - input->start >= len)
+        return input->end - input->start;
+
+    /* Move the bytes that are left to the beginning */
+    memmove(input->data, input->data + input->start,
+            input->end - input->start);
+    input->end -= input->start;
+    input->start = 0;
+
+    while (input->end < len)
+    {
+        size_t readLen;
+
+        /* Grow as the file is read so a damaged length cannot exhaust memory */
+        if (input->end == input->dataMax)
+        {
+            input->dataMax = input->dataMax == 0 ? 65536 : input->dataMax * 2;
+            input->data = decode_alloc(input->data, input->dataMax);
+        }
+
+        readLen = input_read(input, input->data + input->end,
+                             input->dataMax - input->end);
+
+        if (readLen == 0)
+            break;
+
+        input->end += readLen;
+    }
+
+    return input->end - input->start;
+}
+
+/*
+ * Consume bytes that have been read.
+ */
+static void
+input_skip(DecodeInput *input, size_t len)
+{
+    input->start += len;
+    input->offset += (long) len;
+}
+
+/*
+ * Read the length of a frame after the sync marker.  Returns the size of the
+ * varint, or zero if it is incomplete or too long.
+ */
+static size_t
+frame_length(const unsigned char *data, size_t avail, uint64_t *len)
+{
+    size_t byteIdx;
+
+    *len = 0;
+
+    for (byteIdx = 0; byteIdx < avail && byteIdx < 10; byteIdx++)
+    {
+        *len |= (uint64_t) (data[byteIdx] & 0x7F) << (7 * byteIdx);
+
+        if (!(data[byteIdx] & 0x80))
+            return byteIdx + 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Report the bytes skipped since skipOffset, if any.
+ */
+static void
+decode_skipped(const char *fileName, long skipOffset, long offset)
+{
+    if (skipOffset < 0)
+        return;
+
+    fprintf(stderr, "%s: skipped %ld bytes at offset %ld that are not a "
+            "complete record\n", fileName, offset - skipOffset, skipOffset);
+    skipTotal += (uint64_t) (offset - skipOffset);
+}
+
+/*
+ * Decode every record in a file.  Bytes that are not part of a complete frame
+ * with the right checksum are skipped up to the next sync marker.
+ */
+static void
+decode_file(FILE *file, const char *fileName)
+{
+    DecodeInput input;
+    long skipOffset = -1;
+
+    memset(&input, 0, sizeof(input));
+    input.file = file;
+    input.fileName = fileName;
+    input.zframeOffset = -1;
+
+    /* A compressed file starts with a zstd frame, read it from the start */
+    if (input_fill(&input, DECODE_ZSTD_MAGIC_LEN) >= DECODE_ZSTD_MAGIC_LEN &&
+        memcmp(input.data, DECODE_ZSTD_MAGIC, DECODE_ZSTD_MAGIC_LEN) == 0)
+    {
+#ifdef USE_ZSTD
+        input.compressed = 1;
+        input.dctx = ZSTD_createDCtx();
+
+        if (input.dctx == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        input.zdata = decode_alloc(NULL, ZSTD_DStreamInSize());
+        memcpy(input.zdata, input.data, input.end);
+        input.zend = input.end;
+        input.end = 0;
+#else
+        fprintf(stderr, "%s: file is compressed with zstd, which this "
+                "pgaudit_decode was built without\n", fileName);
+        free(input.data);
+        return;
+#endif
+    }
+
+    for (;;)
+    {
+        size_t avail = input_fill(&input, AUDIT_BINARY_SYNC_LEN + 10);
+        const unsigned char *frame = input.data + input.start;
+        uint64_t len;
+        size_t lenLen;
+
+        if (avail == 0)
+            break;
+
+        if (avail >= AUDIT_BINARY_SYNC_LEN &&
+            memcmp(frame, AUDIT_BINARY_SYNC, AUDIT_BINARY_SYNC_LEN) == 0 &&
+            (lenLen = frame_length(frame + AUDIT_BINARY_SYNC_LEN,
+                                   avail - AUDIT_BINARY_SYNC_LEN,
+                                   &len)) > 0 &&
+            len <= AUDIT_BINARY_RECORD_MAX)
+        {
+            size_t frameLen = AUDIT_BINARY_SYNC_LEN + lenLen + (size_t) len +
+                              AUDIT_BINARY_CHECKSUM_LEN;
+
+            if (input_fill(&input, frameLen) >= frameLen)
+            {
+                const unsigned char *checksum;
+                uint32_t crc;
+
+                frame = input.data + input.start;
+                checksum = frame + frameLen - AUDIT_BINARY_CHECKSUM_LEN;
+                crc = (uint32_t) checksum[0] |
+                      (uint32_t) checksum[1] << 8 |
+                      (uint32_t) checksum[2] << 16 |
+                      (uint32_t) checksum[3] << 24;
+
+                if (crc_compute(frame + AUDIT_BINARY_SYNC_LEN,
+                                lenLen + (size_t) len) == crc)
+                {
+                    DecodeRecord record;
+
+                    decode_skipped(fileName, skipOffset, input.offset);
+                    skipOffset = -1;
+
+                    record.data = frame + AUDIT_BINARY_SYNC_LEN + lenLen;
+                    record.len = (size_t) len;
+                    record.cursor = 0;
+                    record.fileName = fileName;
+                    record.offset = input.offset;
+
+                    decode_record_safe(&record);
+
+                    input_skip(&input, frameLen);
+                    continue;
+                }
+            }
+        }
+
+        /* Not a frame, look for the next sync marker */
+        if (skipOffset < 0)
+            skipOffset = input.offset;
+
+        input_skip(&input, 1);
+    }
+
+    decode_skipped(fileName, skipOffset, input.offset);
+
+#ifdef USE_ZSTD
+    if (input.compressed)
+        ZSTD_freeDCtx(input.dctx);
+#endif
+
+    free(input.zdata);
+    free(input.data);
+}
+
+int
+main(int argc, char **argv)
+{
+    int argIdx = 1;
+
+    if (argIdx + 1 < argc && strcmp(argv[argIdx], "-f") == 0)
+    {
+        if (strcmp(argv[argIdx + 1], "json") == 0)
+            formatJson = 1;
+        else if (strcmp(argv[argIdx + 1], "csv") != 0)
+        {
+            fprintf(stderr, "usage: %s [-f csv|json] [file ...]\n", argv[0]);
+            return 1;
+        }
+
+        argIdx += 2;
+    }
+
+    crc_init();
+
+    if (argIdx >= argc)
+        decode_file(stdin, "stdin");
+
+    for (; argIdx < argc; argIdx++)
+    {
+        FILE *file = fopen(argv[argIdx], "rb");
+
+        if (file == NULL)
+        {
+            fprintf(stderr, "unable to open %s\n", argv[argIdx]);
+            return 1;
+        }
+
+        decode_file(file, argv[argIdx]);
+        fclose(file);
+    }
+
+    if (unknownTotal > 0)
+        fprintf(stderr, "%llu names were not defined in the file and are "
+                "shown as " DECODE_UNKNOWN "\n",
+                (unsigned long long) unknownTotal);
+
+    if (skipTotal > 0)
+        fprintf(stderr, "%llu bytes were skipped\n",
+                (unsigned long long) skipTotal);
+
+    return 0;
+}
@@ -0,0 +1,456 @@
+/*------------------------------------------------------------------------------
+ * pgaudit_kernel.c
+ *
+ * Formatting and classification routines that run for every audit event.
+ * Nothing here may depend on catalog access or other server state, see
+ * bench/kernel for the harness that measures these routines outside of the
+ * server.
+ *
+ * Copyright (c) 2014-2015, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *          contrib/pgaudit/pgaudit_kernel.c
+ *------------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <ctype.h>
+
+#include "pgaudit_kernel.h"
+
+/*
+ * String constants for testing role commands.  Rename and drop role statements
+ * are assigned the nodeTag T_RenameStmt and T_DropStmt respectively.  This is
+ * not very useful for classification, so we resort to comparing strings
+ * against the result of CreateCommandTag(parsetree).
+ */
+#define COMMAND_ALTER_ROLE          "ALTER ROLE"
+#define COMMAND_DROP_ROLE           "DROP ROLE"
+
+/*
+ * String constants used for redacting the literal that follows the password
+ * token in CREATE/ALTER ROLE commands and in the options of foreign servers
+ * and user mappings.
+ */
+#define TOKEN_PASSWORD             "password"
+#define TOKEN_REDACTED             "<REDACTED>"
+
+/*
+ * Appends a properly quoted CSV field to StringInfo.
+ *
+ * The string is scanned once with strcspn() to find the first character that
+ * requires quoting.  Most fields (commands, object types, object names) never
+ * need quoting and are copied in a single block.  When quoting is required the
+ * text between double quotes is still copied in blocks rather than one
+ * character at a time.
+ */
+void
+append_valid_csv(StringInfoData *buffer, const char *appendStr)
+{
+    const char *pChar;
+    size_t quoteLen;
+
+    /*
+     * If the append string is null then do nothing.  NULL fields are not
+     * quoted in CSV.
+     */
+    if (appendStr == NULL)
+        return;
+
+    /* Find the first character that requires CSV quoting: ", comma, \n, \r */
+    pChar = appendStr + strcspn(appendStr, ",\"\n\r");
+
+    /* If there is none then just append */
+    if (*pChar == '\0')
+    {
+        appendBinaryStringInfo(buffer, appendStr, pChar - appendStr);
+        return;
+    }
+
+    appendStringInfoCharMacro(buffer, '"');
+
+    /* Copy each run of characters up to and including the next double quote */
+    for (pChar = appendStr; *pChar; pChar += quoteLen)
+    {
+        quoteLen = strcspn(pChar, "\"");
+
+        if (pChar[quoteLen] == '"')
+        {
+            /* Copy the run including the quote, then double the quote */
+            quoteLen++;
+            appendBinaryStringInfo(buffer, pChar, quoteLen);
+            appendStringInfoCharMacro(buffer, '"');
+        }
+        else
+            appendBinaryStringInfo(buffer, pChar, quoteLen);
+    }
+
+    appendStringInfoCharMacro(buffer, '"');
+}
+
+/*
+ * Appends an unsigned varint to StringInfo for the binary file format, see
+ * pgaudit_binary.h.  Most numbers in an entry are small and take one byte.
+ */
+void
+append_binary_varint(StringInfoData *buffer, uint64 value)
+{
+    while (value >= 0x80)
+    {
+        appendStringInfoCharMacro(buffer, (char) (value | 0x80));
+        value >>= 7;
+    }
+
+    appendStringInfoCharMacro(buffer, (char) value);
+}
+
+/*
+ * Appends a text to StringInfo for the binary file format: its length plus one
+ * as a varint followed by the bytes, or zero if the text is null.  Nothing is
+ * quoted so the text is always copied in a single block.
+ */
+void
+append_binary_text(StringInfoData *buffer, const char *appendStr)
+{
+    size_t appendLen;
+
+    if (appendStr == NULL)
+    {
+        append_binary_varint(buffer, 0);
+        return;
+    }
+
+    appendLen = strlen(appendStr);
+
+    append_binary_varint(buffer, (uint64) appendLen + 1);
+    appendBinaryStringInfo(buffer, appendStr, appendLen);
+}
+
+/*
+ * Classify a statement using its log stmt level and command tag.  Returns the
+ * class bit (one of the LOG_* values other than LOG_NONE and LOG_ALL) and sets
+ * className to the name that is written to the log.
+ *
+ * This will need to be updated if new kinds of statements are added.
+ */
+int
+audit_classify(LogStmtLevel logStmtLevel, NodeTag commandTag,
+               const char *command, const char **className)
+{
+    /* By default, put everything in the MISC class. */
+    int class = LOG_MISC;
+
+    *className = CLASS_MISC;
+
+    switch (logStmtLevel)
+    {
+            /* All mods go in WRITE class, except EXECUTE */
+        case LOGSTMT_MOD:
+            *className = CLASS_WRITE;
+            class = LOG_WRITE;
+
+            switch (commandTag)
+            {
+                    /* Currently, only EXECUTE is different */
+                case T_ExecuteStmt:
+                    *className = CLASS_MISC;
+                    class = LOG_MISC;
+                    break;
+                default:
+                    break;
+            }
+            break;
+
+            /* These are DDL, unless they are ROLE */
+        case LOGSTMT_DDL:
+            *className = CLASS_DDL;
+            class = LOG_DDL;
+
+            /* Identify role statements */
+            switch (commandTag)
+            {
+                    /* Classify role statements */
+                case T_CreateRoleStmt:
+                case T_AlterRoleStmt:
+                case T_GrantStmt:
+                case T_GrantRoleStmt:
+                case T_DropRoleStmt:
+                case T_AlterRoleSetStmt:
+                case T_AlterDefaultPrivilegesStmt:
+                    *className = CLASS_ROLE;
+                    class = LOG_ROLE;
+                    break;
+
+                    /*
+                     * Rename and Drop are general and therefore we have to do
+                     * an additional check against the command string to see
+                     * if they are role or regular DDL.
+                     */
+                case T_RenameStmt:
+                case T_DropStmt:
+                    if (pg_strcasecmp(command, COMMAND_ALTER_ROLE) == 0 ||
+                        pg_strcasecmp(command, COMMAND_DROP_ROLE) == 0)
+                    {
+                        *className = CLASS_ROLE;
+                        class = LOG_ROLE;
+                    }
+                    break;
+
+                default:
+                    break;
+            }
+            break;
+
+            /* Classify the rest */
+        case LOGSTMT_ALL:
+            switch (commandTag)
+            {
+                    /* READ statements */
+                case T_CopyStmt:
+                case T_SelectStmt:
+                case T_PrepareStmt:
+                case T_PlannedStmt:
+                    *className = CLASS_READ;
+                    class = LOG_READ;
+                    break;
+
+                    /* FUNCTION statements */
+                case T_DoStmt:
+                    *className = CLASS_FUNCTION;
+                    class = LOG_FUNCTION;
+                    break;
+
+                default:
+                    break;
+            }
+            break;
+
+        case LOGSTMT_NONE:
+            break;
+    }
+
+    return class;
+}
+
+/*
+ * Skip a quoted string or identifier starting at the opening quote and return
+ * the position just after the closing quote (or the end of the command when
+ * the quote is not closed).  A doubled quote does not close.  Backslash
+ * escapes a character only when requested.
+ */
+static const char *
+redact_skip_quoted(const char *pChar, char quote, bool backslash)
+{
+    for (pChar++; *pChar; pChar++)
+    {
+        if (*pChar == '\\' && backslash && pChar[1] != '\0')
+            pChar++;
+        else if (*pChar == quote)
+        {
+            if (pChar[1] != quote)
+                return pChar + 1;
+
+            pChar++;
+        }
+    }
+
+    return pChar;
+}
+
+/*
+ * Return the length of the dollar quote delimiter ($$ or $tag$) starting at
+ * pChar, or zero if pChar does not start a delimiter (e.g. a parameter).
+ */
+static size_t
+redact_dollar_tag(const char *pChar)
+{
+    const char *pTag = pChar + 1;
+
+    if (*pTag != '$' && !isalpha((unsigned char) *pTag) && *pTag != '_' &&
+        !IS_HIGHBIT_SET(*pTag))
+        return 0;
+
+    while (isalnum((unsigned char) *pTag) || *pTag == '_' ||
+           IS_HIGHBIT_SET(*pTag))
+        pTag++;
+
+    return *pTag == '$' ? pTag - pChar + 1 : 0;
+}
+
+/*
+ * Redact the literal following the password token in statements that may
+ * contain passwords: CREATE/ALTER ROLE and the OPTIONS of foreign servers and
+ * user mappings.  Everything else in the command is kept.
+ *
+ * The command is tokenized in a single pass following the same rules as the
+ * core scanner for whitespace, comments, quoted identifiers, and string and
+ * dollar-quoted literals so a password token inside a literal, comment, or
+ * identifier does not match and a quote inside a comment does not hide the
+ * literal.  A string literal (or a series of literals, which the scanner
+ * concatenates) is redacted when the previous token is the keyword or option
+ * name "password".  Returns commandText unchanged, without copying, when the
+ * statement does not carry passwords or there is nothing to redact.
+ *
+ * standardStrings is the value of standard_conforming_strings, which decides
+ * whether backslash escapes apply to regular string literals as they do to
+ * E'' literals.
+ */
+const char *
+audit_redact_password(NodeTag commandTag, const char *commandText,
+                      bool standardStrings)
+{
+    StringInfoData redactStr;
+    const char *pChar = commandText;
+    const char *pCopy = commandText;    /* Start of text not yet copied */
+    bool passwordLast = false;          /* Previous token was "password" */
+    bool redactLast = false;            /* Previous token was redacted */
+
+    switch (commandTag)
+    {
+        case T_CreateRoleStmt:
+        case T_AlterRoleStmt:
+        case T_CreateForeignServerStmt:
+        case T_AlterForeignServerStmt:
+        case T_CreateUserMappingStmt:
+        case T_AlterUserMappingStmt:
+            break;
+
+        default:
+            return commandText;
+    }
+
+    redactStr.data = NULL;
+
+    while (*pChar)
+    {
+        const char *pToken = pChar;
+        bool literal = false;
+        bool password = false;
+        size_t tagLen;
+
+        /* Whitespace and comments do not change the previous token */
+        if (isspace((unsigned char) *pChar))
+        {
+            pChar++;
+            continue;
+        }
+
+        if (pChar[0] == '-' && pChar[1] == '-')
+        {
+            pChar += strcspn(pChar, "\r\n");
+            continue;
+        }
+
+        if (pChar[0] == '/' && pChar[1] == '*')
+        {
+            int depth = 1;
+
+            /* Block comments nest */
+            for (pChar += 2; *pChar && depth > 0; pChar++)
+            {
+                if (pChar[0] == '/' && pChar[1] == '*')
+                {
+                    depth++;
+                    pChar++;
+                }
+                else if (pChar[0] == '*' && pChar[1] == '/')
+                {
+                    depth--;
+                    pChar++;
+                }
+            }
+
+            continue;
+        }
+
+        /* String literals, including E'', N'', B'', X'' and U&'' */
+        if (*pChar == '\'')
+        {
+            pChar = redact_skip_quoted(pChar, '\'', !standardStrings);
+            literal = true;
+        }
+        else if ((*pChar == 'E' || *pChar == 'e') && pChar[1] == '\'')
+        {
+            pChar = redact_skip_quoted(pChar + 1, '\'', true);
+            literal = true;
+        }
+        else if (strchr("NnBbXx", *pChar) != NULL && pChar[1] == '\'')
+        {
+            pChar = redact_skip_quoted(pChar + 1, '\'', !standardStrings);
+            literal = true;
+        }
+        else if ((*pChar == 'U' || *pChar == 'u') && pChar[1] == '&' &&
+                 (pChar[2] == '\'' || pChar[2] == '"'))
+        {
+            literal = pChar[2] == '\'';
+            pChar = redact_skip_quoted(pChar + 2, pChar[2], false);
+        }
+        /* Dollar-quoted literals run to the matching delimiter */
+        else if (*pChar == '$' && (tagLen = redact_dollar_tag(pChar)) > 0)
+        {
+            const char *pEnd = pChar + tagLen;
+
+            while ((pEnd = strchr(pEnd, '$')) != NULL &&
+                   strncmp(pEnd, pChar, tagLen) != 0)
+                pEnd++;
+
+            pChar = pEnd == NULL ? pChar + strlen(pChar) : pEnd + tagLen;
+            literal = true;
+        }
+        /* Quoted identifiers match the option name only when exact */
+        else if (*pChar == '"')
+        {
+            pChar = redact_skip_quoted(pChar, '"', false);
+            password = pChar - pToken == strlen(TOKEN_PASSWORD) + 2 &&
+                       strncmp(pToken + 1, TOKEN_PASSWORD,
+                               strlen(TOKEN_PASSWORD)) == 0;
+        }
+        /* Keywords, identifiers and numbers */
+        else if (isalnum((unsigned char) *pChar) || *pChar == '_' ||
+                 IS_HIGHBIT_SET(*pChar))
+        {
+            while (isalnum((unsigned char) *pChar) || *pChar == '_' ||
+                   *pChar == '$' || IS_HIGHBIT_SET(*pChar))
+                pChar++;
+
+            password = pChar - pToken == strlen(TOKEN_PASSWORD) &&
+                       pg_strncasecmp(pToken, TOKEN_PASSWORD,
+                                      strlen(TOKEN_PASSWORD)) == 0;
+        }
+        /* Everything else is punctuation or an operator */
+        else
+            pChar++;
+
+        if (literal && (passwordLast || redactLast))
+        {
+            if (redactStr.data == NULL)
+                initStringInfo(&redactStr);
+
+            /*
+             * Replace the literal with the redacted token.  Literals that
+             * continue a redacted literal are dropped along with the
+             * whitespace before them.
+             */
+            if (!redactLast)
+            {
+                appendBinaryStringInfo(&redactStr, pCopy, pToken - pCopy);
+                appendStringInfoString(&redactStr, TOKEN_REDACTED);
+            }
+
+            pCopy = pChar;
+            redactLast = true;
+        }
+        else
+            redactLast = false;
+
+        passwordLast = password;
+    }
+
+    /* Nothing was redacted */
+    if (redactStr.data == NULL)
+        return commandText;
+
+    appendStringInfoString(&redactStr, pCopy);
+
+    return redactStr.data;
+}
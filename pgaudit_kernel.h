@@ -0,0 +1,65 @@
+/*------------------------------------------------------------------------------
+ * pgaudit_kernel.h
+ *
+ * Formatting and classification routines that run for every audit event.
+ * These depend only on StringInfo and palloc so that they can be built into
+ * the standalone harness in bench/kernel as well as the extension.
+ *
+ * Copyright (c) 2014-2015, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *          contrib/pgaudit/pgaudit_kernel.h
+ *------------------------------------------------------------------------------
+ */
+#ifndef PGAUDIT_KERNEL_H
+#define PGAUDIT_KERNEL_H
+
+#include "lib/stringinfo.h"
+#include "nodes/nodes.h"
+#include "tcop/utility.h"
+
+/*
+ * Log Classes
+ *
+ * pgAudit categorizes actions into classes (eg: DDL, FUNCTION calls, READ
+ * queries, WRITE queries).  A GUC is provided for the administrator to
+ * configure which class (or classes) of actions to include in the
+ * audit log.  We track the currently active set of classes using
+ * auditLogBitmap.
+ */
+
+/* Bits within auditLogBitmap, defines the classes we understand */
+#define LOG_DDL         (1 << 0)    /* CREATE/DROP/ALTER objects */
+#define LOG_FUNCTION    (1 << 1)    /* Functions and DO blocks */
+#define LOG_MISC        (1 << 2)    /* Statements not covered */
+#define LOG_READ        (1 << 3)    /* SELECTs */
+#define LOG_ROLE        (1 << 4)    /* GRANT/REVOKE, CREATE/ALTER/DROP ROLE */
+#define LOG_WRITE       (1 << 5)    /* INSERT, UPDATE, DELETE, TRUNCATE */
+
+#define LOG_NONE        0               /* nothing */
+#define LOG_ALL         (0xFFFFFFFF)    /* All */
+
+/*
+ * String constants for log classes - used when processing tokens in the
+ * pgaudit.log GUC.
+ */
+#define CLASS_DDL       "DDL"
+#define CLASS_FUNCTION  "FUNCTION"
+#define CLASS_MISC      "MISC"
+#define CLASS_READ      "READ"
+#define CLASS_ROLE      "ROLE"
+#define CLASS_WRITE     "WRITE"
+
+#define CLASS_NONE      "NONE"
+#define CLASS_ALL       "ALL"
+
+extern void append_valid_csv(StringInfoData *buffer, const char *appendStr);
+extern void append_binary_varint(StringInfoData *buffer, uint64 value);
+extern void append_binary_text(StringInfoData *buffer, const char *appendStr);
+extern int audit_classify(LogStmtLevel logStmtLevel, NodeTag commandTag,
+                          const char *command, const char **className);
+extern const char *audit_redact_password(NodeTag commandTag,
+                                         const char *commandText,
+                                         bool standardStrings);
+
+#endif   /* PGAUDIT_KERNEL_H */
@@ -16,6 +16,283 @@ RESET pgaudit.log_level;
 DROP TABLE tmp;
 DROP TABLE tmp2;
 
+--
+-- Check that statistics are collected
+SELECT pgaudit_stat_reset();
+
+SET pgaudit.log = 'read';
+SET pgaudit.log_level = 'notice';
+
+SELECT 1 AS one;
+
+RESET pgaudit.log;
+RESET pgaudit.log_level;
+
+SELECT session_events, object_events, bytes > 0 AS bytes
+  FROM pg_stat_audit
+ WHERE class = 'READ';
+
+--
+-- Check that audit metadata is cached for prepared statements
+CREATE TABLE cache_test (id int);
+
+SELECT pgaudit_stat_reset();
+
+SET pgaudit.log = 'read';
+
+PREPARE cache_select AS SELECT id FROM cache_test;
+EXECUTE cache_select;
+EXECUTE cache_select;
+EXECUTE cache_select;
+
+RESET pgaudit.log;
+
+-- Top objects are tracked so this query is counted as a miss too
+SELECT cache_misses, cache_hits
+  FROM pg_stat_audit_hook
+ WHERE hook = 'executor_check_perms';
+
+DEALLOCATE cache_select;
+DROP TABLE cache_test;
+
+--
+-- Redact passwords in foreign server and user mapping options
+CREATE FOREIGN DATA WRAPPER audit_fdw;
+
+SET pgaudit.log = 'ddl';
+SET pgaudit.log_level = 'notice';
+
+CREATE SERVER audit_server FOREIGN DATA WRAPPER audit_fdw
+	OPTIONS (host 'localhost', password 'secret', port '5432');
+ALTER SERVER audit_server OPTIONS (SET "password" E'new\'secret');
+CREATE USER MAPPING FOR PUBLIC SERVER audit_server
+	OPTIONS (user 'audit', password $pw$secret$pw$);
+ALTER USER MAPPING FOR PUBLIC SERVER audit_server
+	OPTIONS (SET password 'new' /* 'comment' */, ADD sslmode 'require');
+
+RESET pgaudit.log;
+RESET pgaudit.log_level;
+
+DROP SERVER audit_server CASCADE;
+DROP FOREIGN DATA WRAPPER audit_fdw;
+
+--
+-- Make sure parallel workers do not log the statement again.  Parallel query
+-- settings are skipped on versions that do not have them.
+CREATE TABLE parallel_test AS SELECT generate_series(1, 1000) AS id;
+
+BEGIN;
+
+DO $$
+DECLARE
+	setting text[];
+BEGIN
+	FOREACH setting SLICE 1 IN ARRAY ARRAY[
+		['max_parallel_workers_per_gather', '2'],
+		['parallel_setup_cost', '0'],
+		['parallel_tuple_cost', '0'],
+		['min_parallel_relation_size', '0'],
+		['min_parallel_table_scan_size', '0']]
+	LOOP
+		BEGIN
+			PERFORM set_config(setting[1], setting[2], true);
+		EXCEPTION WHEN undefined_object THEN
+			NULL;
+		END;
+	END LOOP;
+END $$;
+
+SET LOCAL pgaudit.log = 'read';
+SET LOCAL pgaudit.log_level = 'notice';
+
+SELECT count(*) FROM parallel_test;
+
+COMMIT;
+
+DROP TABLE parallel_test;
+
+--
+-- Log rows processed when the statement completes
+CREATE TABLE rows_test (id int);
+
+SET pgaudit.log = 'read, write';
+SET pgaudit.log_level = 'notice';
+SET pgaudit.log_rows = on;
+
+INSERT INTO rows_test SELECT generate_series(1, 10);
+UPDATE rows_test SET id = id + 1 WHERE id <= 5;
+SELECT count(*) FROM rows_test;
+
+RESET pgaudit.log;
+RESET pgaudit.log_level;
+RESET pgaudit.log_rows;
+
+DROP TABLE rows_test;
+
+--
+-- Log READ entries only for statements that retrieve enough rows
+CREATE TABLE min_rows_test AS SELECT generate_series(1, 10) AS id;
+
+SET pgaudit.log = 'read';
+SET pgaudit.log_level = 'notice';
+SET pgaudit.log_min_rows = 5;
+
+SELECT id FROM min_rows_test WHERE id = 1;
+SELECT id FROM min_rows_test WHERE id <= 5;
+
+SET pgaudit.log_min_rows_relation = 'min_rows_test';
+SET pgaudit.log_min_rows_relation = 'public.min_rows_test=20, other=0';
+
+SELECT id FROM min_rows_test;
+
+RESET pgaudit.log;
+RESET pgaudit.log_level;
+RESET pgaudit.log_min_rows;
+RESET pgaudit.log_min_rows_relation;
+
+DROP TABLE min_rows_test;
+
+--
+-- Recent entries are kept in shared memory
+CREATE TABLE buffer_test (id int);
+
+SET pgaudit.log = 'write';
+SET pgaudit.log_relation = on;
+
+INSERT INTO buffer_test VALUES (1);
+
+RESET pgaudit.log;
+RESET pgaudit.log_relation;
+
+SELECT audit_type, class, command, object_name, statement, truncated
+  FROM pgaudit_recent(pg_backend_pid(), current_user, 'public.buffer_test');
+
+DROP TABLE buffer_test;
+
+--
+-- Parameters of entries that only go to the buffer are formatted when read
+CREATE TABLE defer_test (id int, name text);
+PREPARE defer_insert (int, text) AS INSERT INTO defer_test VALUES ($1, $2);
+PREPARE defer_regclass (regclass) AS
+    INSERT INTO defer_test VALUES (3, $1::text);
+PREPARE defer_record (record) AS INSERT INTO defer_test VALUES (4, $1::text);
+
+SET pgaudit.log = 'write';
+SET pgaudit.log_destination = 'buffer';
+SET pgaudit.log_parameter = on;
+SET pgaudit.log_relation = on;
+SET pgaudit.buffer_defer_format = on;
+
+EXECUTE defer_insert (1, 'one');
+EXECUTE defer_insert (2, NULL);
+EXECUTE defer_regclass ('defer_test');
+EXECUTE defer_record (ROW(4, 'four'));
+
+RESET pgaudit.log;
+RESET pgaudit.log_destination;
+RESET pgaudit.log_parameter;
+RESET pgaudit.log_relation;
+RESET pgaudit.buffer_defer_format;
+
+-- A regclass or a record is formatted when logged, not when read
+ALTER TABLE defer_test RENAME TO defer_renamed;
+
+SELECT command, object_name, parameter
+  FROM pgaudit_recent(pg_backend_pid(), current_user, 'public.defer_test')
+ ORDER BY event_id;
+
+DEALLOCATE defer_insert;
+DEALLOCATE defer_regclass;
+DEALLOCATE defer_record;
+DROP TABLE defer_renamed;
+
+--
+-- Accesses are counted for the most accessed objects
+CREATE TABLE top_test (id int);
+
+INSERT INTO top_test VALUES (1);
+SELECT count(*) FROM top_test;
+SELECT count(*) FROM top_test;
+
+SELECT object_type, object_name, command, accesses
+  FROM pg_stat_audit_top_object
+ WHERE role_name = current_user
+   AND object_name = 'public.top_test'
+ ORDER BY command;
+
+SELECT pgaudit_stat_top_object_reset();
+
+SELECT count(*)
+  FROM pg_stat_audit_top_object
+ WHERE object_name = 'public.top_test';
+
+DROP TABLE top_test;
+
+--
+-- Entries can be diverted away from the server log
+SET pgaudit.log_destination = 'syslog';
+SET pgaudit.log_destination = 'buffer';
+SHOW pgaudit.log_destination;
+RESET pgaudit.log_destination;
+
+--
+-- Entries are written to pgaudit.log_file, which is in the data directory
+-- since pgaudit.conf sets log_directory.  Errors raised by a logged statement
+-- are tagged with its IDs, which the client sees too.  Reconnect so the
+-- statement IDs start over.
+\connect -
+
+CREATE TABLE file_test (id int);
+INSERT INTO file_test VALUES (1);
+
+SET pgaudit.log = 'read';
+SET pgaudit.log_destination = 'file';
+
+SELECT id FROM file_test;
+
+\set VERBOSITY default
+SELECT 1 / (id - id) FROM file_test;
+\set VERBOSITY terse
+
+-- Entries below log_min_messages are written too
+SET pgaudit.log_level = 'debug1';
+SELECT count(*) FROM file_test;
+RESET pgaudit.log_level;
+
+RESET pgaudit.log;
+RESET pgaudit.log_destination;
+
+SELECT substring(line from ',(SESSION,.*)$') AS entry
+  FROM regexp_split_to_table(pg_read_file('pgaudit.log'), E'\n') AS line
+ WHERE line <> '';
+
+-- The file is opened again when a rotation has renamed it
+COPY (SELECT 1 WHERE false) TO PROGRAM 'mv pgaudit.log pgaudit.log.1';
+
+SET pgaudit.log = 'read';
+SET pgaudit.log_destination = 'file';
+
+SELECT id FROM file_test;
+
+RESET pgaudit.log;
+RESET pgaudit.log_destination;
+
+SELECT substring(line from ',(SESSION,.*)$') AS entry
+  FROM regexp_split_to_table(pg_read_file('pgaudit.log'), E'\n') AS line
+ WHERE line <> '';
+
+DROP TABLE file_test;
+
+--
+-- The binary file format is set in postgresql.conf, see pgaudit_decode
+SHOW pgaudit.log_file_format;
+SET pgaudit.log_file_format = 'binary';
+
+--
+-- Compression of the file is set in postgresql.conf and needs USE_ZSTD
+SHOW pgaudit.log_file_compression;
+SET pgaudit.log_file_compression = 'zstd';
+
 --
 -- Audit log fields are:
 --     AUDIT_TYPE - SESSION or OBJECT